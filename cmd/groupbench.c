@@ -0,0 +1,265 @@
+/*
+	groupbench.c
+
+	Copyright 2011 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of touchstream.
+
+	touchstream is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	touchstream is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with touchstream.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Broadcast group benchmark, "make bench". Forks clients that connect to
+ * a server in this process, on the usual port, on localhost; then for 1,
+ * 10 and 100 members, or just 'members', sends them 'events' keys each,
+ * once to every member one by one, and once through a group of them (see
+ * ts_display_group.h). It prints the server's CPU time per event, and
+ * that divided by the members, for both; the first is what an event
+ * costs, the second shows what grows with the members. The clients print
+ * how many keys they got, and one of them can be made slow with -s, to
+ * see it doesn't hold the others back.
+ *
+ *	groupbench [-s] [members [events]]
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "ts_defines.h"
+#include "ts_mux.h"
+#include "ts_display_group.h"
+#include "ts_verbose.h"
+
+int verbose = 0;
+
+void V1(const char * format, ...)
+{
+	if (verbose < 1) return;
+	va_list va;
+	va_start(va, format);
+	vprintf(format, va);
+	va_end(va);
+}
+void V2(const char * format, ...)
+{
+	if (verbose < 2) return;
+	va_list va;
+	va_start(va, format);
+	vprintf(format, va);
+	va_end(va);
+}
+void V3(const char * format, ...)
+{
+	if (verbose < 3) return;
+	va_list va;
+	va_start(va, format);
+	vprintf(format, va);
+	va_end(va);
+}
+
+ts_platform_create_callback_p ts_platform_create_server = NULL;
+ts_platform_create_callback_p ts_platform_create_client = NULL;
+ts_platform_create_callback_p ts_xorg_create_client = NULL;
+
+ts_mux_t mux[TS_MUX_SHARDS_MAX];
+ts_master_t master[1];
+
+#define BENCH_KEY	31
+#define BENCH_BURST	16		// keys sent at once, half the proxy fifo
+
+static int keys;
+static int slow;
+
+static void
+bench_key(
+		ts_display_p d,
+		uint16_t k,
+		int down)
+{
+	if (k != BENCH_KEY)
+		return;
+	keys++;
+	if (slow)
+		usleep(3000);
+}
+
+static ts_display_driver_t bench_driver = {
+	.key = bench_key,
+};
+
+static double
+bench_cpu(void)
+{
+	struct rusage u;
+	getrusage(RUSAGE_SELF, &u);
+	return u.ru_utime.tv_sec + u.ru_stime.tv_sec +
+			(u.ru_utime.tv_usec + u.ru_stime.tv_usec) / 1e6;
+}
+
+static ts_display_p
+bench_display(
+		char * name,
+		char * param)
+{
+	ts_display_p d = calloc(1, sizeof(*d));
+	ts_display_init(d, master, &bench_driver, name, param);
+	d->bounds.w = 1024;
+	d->bounds.h = 768;
+	ts_master_display_add(master, d);
+	return d;
+}
+
+/*
+ * A member, until it has had all it's keys, or nothing came for a while;
+ * a longer while for the first ones, the smaller groups go first
+ */
+static int
+bench_member(
+		int index,
+		int expect)
+{
+	char name[32];
+	sprintf(name, "member%d", index);
+	ts_master_init(master);
+	ts_mux_shards_init(mux, 1, ts_mux_policy_leastloaded);
+	ts_display_p d = bench_display(name, "left");
+	ts_mux_port_new(mux, master, strdup("127.0.0.1"), d);
+
+	int last = -1, idle = 0;
+	while (keys < expect && idle < (keys ? 50 : 600)) {
+		usleep(100000);
+		idle = keys == last ? idle + 1 : 0;
+		last = keys;
+	}
+	printf("%s got %d of %d keys%s\n", name, keys, expect, slow ? " (slow)" : "");
+	return 0;
+}
+
+/*
+ * Send 'events' keys to 'd', or to each of the 'count' displays in 'each',
+ * and return the CPU time per event, in microseconds
+ */
+static double
+bench_pass(
+		ts_display_p d,
+		ts_display_p * each,
+		int count,
+		int events)
+{
+	double start = bench_cpu();
+	for (int e = 0; e < events; e += BENCH_BURST) {
+		for (int i = 0; i < BENCH_BURST; i++)
+			if (d)
+				ts_display_key(d, BENCH_KEY, i & 1);
+			else
+				for (int m = 0; m < count; m++)
+					ts_display_key(each[m], BENCH_KEY, i & 1);
+		usleep(2000);
+	}
+	sleep(1);	// let the mux threads finish sending
+	return (bench_cpu() - start) * 1e6 / events;
+}
+
+int
+main(
+		int argc,
+		char * argv[])
+{
+	int sweep[] = { 1, 10, 100 }, sizes = 3;
+	int events = 4000, slowOne = 0;
+	int arg = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-s"))
+			slowOne++;
+		else if (!strncmp(argv[i], "-v", 2))
+			verbose++;
+		else if (arg++ == 0) {
+			sweep[0] = atoi(argv[i]);
+			sizes = 1;
+		} else
+			events = atoi(argv[i]);
+	}
+	int count = sweep[sizes - 1];
+	if (count < 1 || events < BENCH_BURST) {
+		fprintf(stderr, "%s: [-s] [members [events]]\n", argv[0]);
+		exit(1);
+	}
+	// fork the members first, before we have any thread
+	pid_t pid[count];
+	for (int i = 0; i < count; i++) {
+		// the sizes it's part of, both passes each
+		int expect = 0;
+		for (int s = 0; s < sizes; s++)
+			expect += i < sweep[s] ? 2 * events : 0;
+		pid[i] = fork();
+		if (pid[i] == 0) {
+			slow = slowOne && i == 0;
+			sleep(1);
+			exit(bench_member(i, expect));
+		}
+	}
+	ts_master_init(master);
+	ts_mux_shards_init(mux, 1, ts_mux_policy_leastloaded);
+	ts_display_p main_display = bench_display("bench", NULL);
+	ts_mux_port_new(mux, master, NULL, main_display);
+
+	ts_display_p each[count];
+	for (int wait = 0; wait < 100; wait++) {
+		int found = 0;
+		for (int i = 0; i < count; i++) {
+			char name[32];
+			sprintf(name, "member%d", i);
+			each[i] = ts_master_display_get(master, name);
+			found += each[i] != NULL;
+		}
+		if (found == count)
+			break;
+		usleep(100000);
+	}
+	for (int i = 0; i < count; i++)
+		if (!each[i]) {
+			fprintf(stderr, "%s: member%d didn't connect\n", argv[0], i);
+			exit(1);
+		}
+	printf("members   us per event:  one by one     group   "
+			"per member:  one by one     group\n");
+	for (int s = 0; s < sizes; s++) {
+		int size = sweep[s];
+		char name[32], * members = malloc(size * 16 + 1);
+		members[0] = 0;
+		for (int i = 0; i < size; i++)
+			sprintf(members + strlen(members), "%smember%d", i ? "," : "", i);
+		sprintf(name, "group%d", size);
+		ts_display_p group = ts_display_group_new(master, name, "top", members);
+		free(members);
+		master->mousex = group->bounds.x + 10;
+		master->mousey = group->bounds.y + 10;
+		ts_master_set_active(master, group);
+
+		double one = bench_pass(NULL, each, size, events);
+		double all = bench_pass(group, NULL, size, events);
+		printf("%7d   %24.2f  %8.2f   %24.2f  %8.2f\n", size,
+				one, all, one / size, all / size);
+		fflush(stdout);
+	}
+	for (int i = 0; i < count; i++)
+		waitpid(pid[i], NULL, 0);
+	return 0;
+}
@@ -0,0 +1,217 @@
+/*
+	pollbench.c
+
+	Copyright 2011 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of touchstream.
+
+	touchstream is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	touchstream is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with touchstream.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Polling mode benchmark, "make bench". The main thread plays the capture
+ * thread: it kicks a mux 'wakes' times, every 'interval' us, and the kick's
+ * callback, on the mux thread, notes how long after the kick it was
+ * dispatched. That's done in each of the polling modes, or just the one
+ * given with -P, the way touchstream takes it (see ts_mux.h); it prints
+ * the latencies, and the CPU time used per wake, that a spinning mux
+ * trades for them. Spinning only pays off with a CPU to spare, so compare
+ * with "taskset -c 0" too.
+ *
+ *	pollbench [-P block|hybrid|spin[:idle]] [wakes [interval]]
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "ts_defines.h"
+#include "ts_mux.h"
+#include "ts_verbose.h"
+
+int verbose = 0;
+
+void V1(const char * format, ...)
+{
+	if (verbose < 1) return;
+	va_list va;
+	va_start(va, format);
+	vprintf(format, va);
+	va_end(va);
+}
+void V2(const char * format, ...)
+{
+	if (verbose < 2) return;
+	va_list va;
+	va_start(va, format);
+	vprintf(format, va);
+	va_end(va);
+}
+void V3(const char * format, ...)
+{
+	if (verbose < 3) return;
+	va_list va;
+	va_start(va, format);
+	vprintf(format, va);
+	va_end(va);
+}
+
+ts_platform_create_callback_p ts_platform_create_server = NULL;
+ts_platform_create_callback_p ts_platform_create_client = NULL;
+ts_platform_create_callback_p ts_xorg_create_client = NULL;
+
+// one mux per mode, a spinning one can't be stopped; it runs last
+ts_mux_t mux[3];
+ts_master_t master[1];
+
+static const char * mode_name[] = {
+	[ts_mux_spin_block] = "block",
+	[ts_mux_spin_hybrid] = "hybrid",
+	[ts_mux_spin_always] = "spin",
+};
+
+static volatile uint64_t kicked;	// ns, when the kick was sent
+static volatile uint32_t done;		// wakes dispatched
+static uint32_t * latency;			// ns, one per wake
+
+static uint64_t
+bench_now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return ((uint64_t)t.tv_sec * 1000000000) + t.tv_nsec;
+}
+
+static double
+bench_cpu(void)
+{
+	struct rusage u;
+	getrusage(RUSAGE_SELF, &u);
+	return u.ru_utime.tv_sec + u.ru_stime.tv_sec +
+			(u.ru_utime.tv_usec + u.ru_stime.tv_usec) / 1e6;
+}
+
+static void
+bench_kicked(
+		ts_mux_p mux,
+		ts_mux_kick_p kick)
+{
+	latency[done] = bench_now() - kicked;
+	__sync_fetch_and_add(&done, 1);
+}
+
+static int
+bench_compare(
+		const void * a,
+		const void * b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Kick 'm' 'wakes' times, and print what it took to get to the callback
+ */
+static void
+bench_mode(
+		ts_mux_p m,
+		int wakes,
+		int interval)
+{
+	ts_mux_kick_t kick = { .callback = bench_kicked };
+
+	ts_mux_start(m, master);
+	usleep(100000);		// let the thread settle in
+	done = 0;
+	double cpu = bench_cpu();
+	uint64_t start = bench_now();
+	for (int i = 0; i < wakes; i++) {
+		usleep(interval);
+		kicked = bench_now();
+		ts_mux_kick(m, &kick);
+		while (done <= (uint32_t)i)
+			usleep(10);
+	}
+	double wall = (bench_now() - start) / 1e9;
+	cpu = bench_cpu() - cpu;
+
+	qsort(latency, wakes, sizeof(latency[0]), bench_compare);
+	uint64_t sum = 0;
+	for (int i = 0; i < wakes; i++)
+		sum += latency[i];
+	printf("%-7s %8.1f %8.1f %8.1f %8.1f %8.1f   %8.1f %6.0f%%\n",
+			mode_name[m->spin.mode],
+			latency[0] / 1e3, sum / 1e3 / wakes,
+			latency[wakes / 2] / 1e3, latency[wakes * 99 / 100] / 1e3,
+			latency[wakes - 1] / 1e3,
+			cpu * 1e6 / wakes, 100 * cpu / wall);
+	fflush(stdout);
+}
+
+int
+main(
+		int argc,
+		char * argv[])
+{
+	int only = -1, idle = 2000;
+	int wakes = 2000, interval = 1000;
+	int arg = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-P") && i < argc-1) {
+			char * p = argv[++i];
+			char * mode = strsep(&p, ":");
+			for (int m = 0; m < 3; m++)
+				if (!strcmp(mode, mode_name[m]))
+					only = m;
+			if (only < 0)
+				arg = -1;
+			if (p && *p)
+				idle = atoi(p);
+		} else if (!strncmp(argv[i], "-v", 2))
+			verbose++;
+		else if (arg == 0) {
+			wakes = atoi(argv[i]);
+			arg++;
+		} else if (arg == 1) {
+			interval = atoi(argv[i]);
+			arg++;
+		} else
+			arg = -1;
+	}
+	if (arg < 0 || wakes < 1 || interval < 0) {
+		fprintf(stderr, "%s: [-P block|hybrid|spin[:idle]] [wakes [interval]]\n",
+				argv[0]);
+		exit(1);
+	}
+	latency = malloc(wakes * sizeof(latency[0]));
+	ts_master_init(master);
+
+	printf("%d wakes, %dus apart, hybrid idle %dus\n", wakes, interval, idle);
+	printf("mode    latency us:  min      avg      p50      p99      max"
+			"   cpu us/wake   cpu\n");
+	for (int m = 0; m < 3; m++) {
+		if (only >= 0 && m != only)
+			continue;
+		ts_mux_shards_init(&mux[m], 1, ts_mux_policy_leastloaded);
+		mux[m].spin.mode = m;
+		mux[m].spin.idle = idle;
+		bench_mode(&mux[m], wakes, interval);
+	}
+	return 0;
+}
@@ -23,7 +23,6 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <netdb.h>
 #include <libgen.h>
 #include <stdarg.h>
 #include <ctype.h>
@@ -32,6 +31,8 @@
 
 #include "ts_defines.h"
 #include "ts_mux.h"
+#include "ts_display_group.h"
+#include "ts_rt.h"
 #include "ts_verbose.h"
 
 int verbose = 0;
@@ -70,8 +71,9 @@ ts_platform_create_callback_p ts_platform_create_server = NULL;
 ts_platform_create_callback_p ts_platform_create_client = NULL;
 ts_platform_create_callback_p ts_xorg_create_client = NULL;
 
-ts_mux_t mux[1];
+ts_mux_t mux[TS_MUX_SHARDS_MAX];
 ts_master_t master[1];
+ts_rt_t rt;
 
 int
 main(
@@ -82,8 +84,19 @@ main(
 	int dae = 0;
 	char * client = NULL;
 	char * param = NULL;
-	char * xorg[8] = {0};
+	char * xorg[argc];
 	int xorgCount = 0;
+	char * group[argc];
+	int groupCount = 0;
+	int shards = 1, policy = ts_mux_policy_leastloaded;
+	int stats = 0;
+	int realtime = 0;
+	int spin = ts_mux_spin_block, spinIdle = 2000, spinBusy = 0;
+	int batch = 0;
+	int udp = 0;
+	int heartbeat = 0;
+	int ring = 0;
+	char * listenTo = NULL;
 
 	for (int i = 1; i < argc; i++) {
 		if (!strcmp(argv[i], "-s")) {
@@ -96,6 +109,54 @@ main(
 			else
 				verbose++;
 			V1("Set verbose to %d\n", verbose);
+		} else if (!strncmp(argv[i], "-W", 2)) {
+			// wakeup statistics, every N seconds, default 10
+			int period = isdigit(argv[i][2]) ? atoi(argv[i] + 2) : 10;
+			stats = period * 1000;
+		} else if (!strncmp(argv[i], "-B", 2)) {
+			// outgoing events batching delay, in ms, default 1
+			batch = isdigit(argv[i][2]) ? atoi(argv[i] + 2) : 1;
+		} else if (!strncmp(argv[i], "-H", 2)) {
+			// heartbeats, dead peer delay in seconds, default 5
+			heartbeat = (isdigit(argv[i][2]) ? atoi(argv[i] + 2) : 5) * 1000;
+		} else if (!strncmp(argv[i], "-M", 2)) {
+			// shared memory rings on unix sockets, in KB, default 256
+			ring = (isdigit(argv[i][2]) ? atoi(argv[i] + 2) : 256) * 1024;
+		} else if (!strcmp(argv[i], "-U")) {
+			// pointer motion over UDP, if the other end wants it too
+			udp++;
+		} else if (!strncmp(argv[i], "-R", 2)) {
+			// real time input path, -R[priority][:cpu,cpu...]
+			if (ts_rt_parse(&rt, argv[i][2] ? argv[i] + 2 : NULL)) {
+				fprintf(stderr, "%s: invalid real time setting '%s'\n",
+						basename(argv[0]), argv[i]);
+				exit(1);
+			}
+			realtime++;
+		} else if (!strcmp(argv[i], "-P") && i < argc-1) {
+			// polling mode, -P block|hybrid|spin[:idle us[:busy poll us]]
+			char * p = argv[++i];
+			char * mode = strsep(&p, ":");
+			if (!strcmp(mode, "hybrid"))
+				spin = ts_mux_spin_hybrid;
+			else if (!strcmp(mode, "spin"))
+				spin = ts_mux_spin_always;
+			else if (strcmp(mode, "block")) {
+				fprintf(stderr, "%s: invalid polling mode '%s'\n",
+						basename(argv[0]), mode);
+				exit(1);
+			}
+			char * idle = strsep(&p, ":");
+			if (idle && *idle)
+				spinIdle = atoi(idle);
+			if (p)
+				spinBusy = atoi(p);
+		} else if (!strcmp(argv[i], "-j") && i < argc-1) {
+			// number of mux threads, and how to spread connections on them
+			char * p = argv[++i];
+			shards = atoi(strsep(&p, ":"));
+			if (p && !strcmp(p, "rr"))
+				policy = ts_mux_policy_roundrobin;
 		} else if (!strcmp(argv[i], "-x") && i < argc-1) {
 			if (!ts_xorg_create_client) {
 				fprintf(stderr, "%s: xorg client mode unsupported on this platform\n",
@@ -103,17 +164,19 @@ main(
 				exit(1);
 			}
 			xorg[xorgCount++] = argv[++i];
+		} else if (!strcmp(argv[i], "-g") && i < argc-1) {
+			// broadcast group, -g name=where:display,display...
+			group[groupCount++] = argv[++i];
+		} else if (!strcmp(argv[i], "-l") && i < argc-1) {
+			// listen there too, unix:/path or :port; a client relays them
+			listenTo = argv[++i];
 		} else if (!strcmp(argv[i], "-c") && i < argc-1) {
 			i++;
 			param = argv[i];
 			char * name = strsep(&param, "=");
-			char * col = strchr(name, ':');
-			if (col) *col = 0;
-			if (gethostbyname(name)) {
-				client = argv[i];	// with :<port>
-				server = 0;
-				V1("%s client host: '%s'\n", argv[0], name);
-			}
+			client = argv[i];	// with :<port>
+			server = 0;
+			V1("%s client host: '%s'\n", argv[0], name);
 		}
 	}
 
@@ -147,6 +210,20 @@ main(
 	}
 
 	ts_master_init(master);
+	ts_mux_shards_init(mux, shards, policy);
+	for (int i = 0; i < TS_MUX_SHARDS_MAX; i++) {
+		mux[i].stats.period = stats;
+		mux[i].rt = realtime ? &rt : NULL;
+		mux[i].spin.mode = spin;
+		mux[i].spin.idle = spinIdle;
+		mux[i].spin.busy = spinBusy;
+		mux[i].batch = batch;
+		mux[i].udp = udp;
+		mux[i].heartbeat = heartbeat;
+		mux[i].ring = ring;
+	}
+	if (realtime)
+		ts_rt_lock(&rt);
 
 	ts_platform_create_callback_p platform = NULL;
 
@@ -168,11 +245,29 @@ main(
 		}
 	}
 	ts_display_p main_display = platform(mux, master, param);
+	if (realtime)
+		ts_clipboard_reserve(&main_display->clipboard, 1, rt.prealloc);
 
 	ts_mux_port_new(mux, master, client, main_display);
+	if (listenTo)
+		ts_mux_port_listen(mux, master, listenTo, main_display);
 
 	for (int i = 0; i < xorgCount; i++)
 		ts_xorg_create_client(mux, master, xorg[i]);
 
+	for (int i = 0; i < groupCount; i++) {
+		char * p = group[i];
+		char * name = strsep(&p, "=");
+		char * where = p ? strsep(&p, ":") : NULL;
+		if (!where || !p || !ts_display_group_new(master, name, where, p)) {
+			fprintf(stderr, "%s: invalid group '%s'\n",
+					basename(argv[0]), name);
+			exit(1);
+		}
+	}
+
+	// we are the capture thread from now on
+	if (realtime)
+		ts_rt_thread(&rt, 0);
 	ts_display_run(main_display);
 }
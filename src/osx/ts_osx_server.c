@@ -222,7 +222,10 @@ onKey(
 	V3("%s key %04x (%c) %s\n", __func__, key,
 			(key >= ' ' && key < 127) ? key : '.',
 					down ? "down" : "up");
+	// locked, so the active display can't be removed under us
+	ts_master_lock(d->display.master);
 	ts_display_key(ts_master_get_active(d->display.master), key, down);
+	ts_master_unlock(d->display.master);
 
 	return true;
 }
@@ -243,9 +246,11 @@ handleCGInputEvent(
 		case kCGEventRightMouseDown:
 		case kCGEventOtherMouseDown: {
 			int b = CGEventGetIntegerValueField(event, kCGMouseEventButtonNumber);
+			ts_master_lock(d->display.master);
 			ts_display_button(
 					ts_master_get_active(d->display.master),
 					ts_button[b], 1);
+			ts_master_unlock(d->display.master);
 			UInt32 modifiers;
 			MouseTrackingResult res;
 			Point pt;
@@ -259,9 +264,11 @@ handleCGInputEvent(
 		case kCGEventRightMouseUp:
 		case kCGEventOtherMouseUp: {
 			int b = CGEventGetIntegerValueField(event, kCGMouseEventButtonNumber);
+			ts_master_lock(d->display.master);
 			ts_display_button(
 					ts_master_get_active(d->display.master),
 					ts_button[b], 0);
+			ts_master_unlock(d->display.master);
 		}	break;
 		case kCGEventMouseMoved:
 		case kCGEventLeftMouseDragged:
@@ -296,10 +303,13 @@ handleCGInputEvent(
 			int y = mapScrollWheelToSynergy(d, sy);
 			int x = mapScrollWheelToSynergy(d, sx);
 			V3("wheel %f %f -> %3d %3d\n", sy, sx, y, x);
-			if (x || y)
+			if (x || y) {
+				ts_master_lock(d->display.master);
 				ts_display_wheel(
 					ts_master_get_active(d->display.master),
 					0, y, x);
+				ts_master_unlock(d->display.master);
+			}
 		}	break;
 		case kCGEventKeyDown:
 		case kCGEventKeyUp:
@@ -22,7 +22,76 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stddef.h>
 #include "ts_clipboard.h"
+#include "ts_rt.h"
+
+/*
+ * Flavor data lives in a reference counted block, with the header just
+ * before the data, so it can be handed out (to be sent, typically)
+ * without being copied. A block that someone else still holds is never
+ * written to again, a new one is made instead.
+ */
+typedef struct ts_clipboard_block_t {
+	volatile uint32_t ref;
+	uint32_t pad;
+	uint8_t data[0];
+} ts_clipboard_block_t, *ts_clipboard_block_p;
+
+#define _BLOCK(_d) ((ts_clipboard_block_p)((_d) - offsetof(ts_clipboard_block_t, data)))
+
+uint8_t *
+ts_clipboard_data_ref(
+		uint8_t * data )
+{
+	if (data)
+		__sync_fetch_and_add(&_BLOCK(data)->ref, 1);
+	return data;
+}
+
+void
+ts_clipboard_data_unref(
+		uint8_t * data )
+{
+	if (data && __sync_sub_and_fetch(&_BLOCK(data)->ref, 1) == 0)
+		free(_BLOCK(data));
+}
+
+/*
+ * Make sure the flavor's buffer is ours only, and has room for 'size'
+ * bytes, keeping what's there already
+ */
+static int
+_ts_clipboard_grow(
+		ts_clipboard_p clip,
+		int slot,
+		size_t size,
+		int prefault )
+{
+	uint8_t * data = clip->flavor[slot].data;
+	ts_clipboard_block_p b = data ? _BLOCK(data) : NULL;
+
+	if (b && b->ref == 1 && clip->flavor[slot].alloc >= size)
+		return 0;
+	if (b && b->ref > 1) {
+		ts_clipboard_block_p n = malloc(sizeof(*n) + size);
+		if (!n)
+			return -1;
+		memcpy(n->data, data, clip->flavor[slot].size);
+		ts_clipboard_data_unref(data);
+		b = n;
+	} else {
+		b = realloc(b, sizeof(*b) + size);
+		if (!b)
+			return -1;
+	}
+	if (prefault)
+		b = ts_rt_prefault(b, sizeof(*b) + size);
+	b->ref = 1;
+	clip->flavor[slot].data = b->data;
+	clip->flavor[slot].alloc = size;
+	return 0;
+}
 
 void
 ts_clipboard_clear(
@@ -31,15 +100,30 @@ ts_clipboard_clear(
 	for (int i = 0; i < clip->flavorCount; i++) {
 		if (clip->flavor[i].name)
 			free(clip->flavor[i].name);
-		if (clip->flavor[i].data)
-			free(clip->flavor[i].data);
 		clip->flavor[i].name = NULL;
-		clip->flavor[i].data = NULL;
 		clip->flavor[i].size = 0;
+		// if it's still being used, let it go, we'd have to copy it anyway
+		if (clip->flavor[i].data && _BLOCK(clip->flavor[i].data)->ref > 1) {
+			ts_clipboard_data_unref(clip->flavor[i].data);
+			clip->flavor[i].data = NULL;
+			clip->flavor[i].alloc = 0;
+		}
 	}
 	clip->flavorCount = 0;
 }
 
+void
+ts_clipboard_dispose(
+		ts_clipboard_p clip )
+{
+	ts_clipboard_clear(clip);
+	for (int i = 0; i < (int)(sizeof(clip->flavor) / sizeof(clip->flavor[0])); i++) {
+		ts_clipboard_data_unref(clip->flavor[i].data);
+		clip->flavor[i].data = NULL;
+		clip->flavor[i].alloc = 0;
+	}
+}
+
 int
 ts_clipboard_add(
 		ts_clipboard_p clip,
@@ -59,12 +143,31 @@ ts_clipboard_add(
 		slot = clip->flavorCount++;
 		clip->flavor[slot].name = strdup(flavor);
 	}
-	clip->flavor[slot].data =  realloc(
-			clip->flavor[slot].data,
-			clip->flavor[slot].size + size + 1);
+	size_t need = clip->flavor[slot].size + size + 1;
+	// flavors are received in chunks, so grow geometrically
+	if (need > clip->flavor[slot].alloc && need < clip->flavor[slot].alloc * 3 / 2)
+		need = clip->flavor[slot].alloc * 3 / 2;
+	if (_ts_clipboard_grow(clip, slot,
+			need > clip->flavor[slot].alloc ? (need + 1023) & ~1023 : need, 0))
+		return -1;
 	memcpy(clip->flavor[slot].data + clip->flavor[slot].size,
 			data, size);
 	clip->flavor[slot].size += size;
 	clip->flavor[slot].data[clip->flavor[slot].size] = 0;
 	return 0;
 }
+
+int
+ts_clipboard_reserve(
+		ts_clipboard_p clip,
+		int count,
+		size_t size )
+{
+	if (count > (int)(sizeof(clip->flavor) / sizeof(clip->flavor[0])))
+		count = sizeof(clip->flavor) / sizeof(clip->flavor[0]);
+	for (int i = 0; i < count; i++)
+		if (clip->flavor[i].alloc < size &&
+				_ts_clipboard_grow(clip, i, size, 1))
+			return -1;
+	return 0;
+}
@@ -35,13 +35,24 @@ typedef struct ts_clipboard_t {
 	struct {
 		char * name;
 		size_t size;
+		size_t alloc;	// bytes allocated for 'data'
 		uint8_t * data;
 	} flavor[8];
 } ts_clipboard_t, *ts_clipboard_p;
 
+/*
+ * Clearing the clipboard keeps the flavor buffers around, so the next
+ * content that fits doesn't need to allocate anything
+ */
 void
 ts_clipboard_clear(
 		ts_clipboard_p clip );
+/*
+ * Release everything, buffers too
+ */
+void
+ts_clipboard_dispose(
+		ts_clipboard_p clip );
 
 int
 ts_clipboard_add(
@@ -50,5 +61,24 @@ ts_clipboard_add(
 		uint8_t * data,
 		size_t size );
 
+/*
+ * Flavor 'data' is reference counted; take a reference to send it without
+ * copying it, the clipboard won't write to it again while it's held.
+ */
+uint8_t *
+ts_clipboard_data_ref(
+		uint8_t * data );
+void
+ts_clipboard_data_unref(
+		uint8_t * data );
+
+/*
+ * Preallocate, and touch, 'size' bytes for the first 'count' flavors
+ */
+int
+ts_clipboard_reserve(
+		ts_clipboard_p clip,
+		int count,
+		size_t size );
 
 #endif /* __TS_CLIPBOARD_H___ */
@@ -125,7 +125,7 @@ ts_display_place(
 		which->bounds.x = main->bounds.x;
 		which->bounds.y = main->bounds.y - which->bounds.h;
 	} else if (!strcmp(where, "left")) {
-		which->bounds.x = main->bounds.y - which->bounds.w;
+		which->bounds.x = main->bounds.x - which->bounds.w;
 		which->bounds.y = main->bounds.y;
 	} else if (!strcmp(where, "bottom")) {
 		which->bounds.x = main->bounds.x;
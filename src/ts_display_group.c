@@ -0,0 +1,271 @@
+/*
+	ts_display_group.c
+
+	Copyright 2011 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of touchstream.
+
+	touchstream is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	touchstream is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with touchstream.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "ts_display_group.h"
+#include "ts_display_proxy.h"
+#include "ts_verbose.h"
+
+/*
+ * Look the members up again if displays were added or removed since
+ * last time; a member that went away mustn't be touched anymore.
+ * Called with the master locked, so they stay there while we use them.
+ */
+static ts_display_group_driver_p
+ts_group_get(
+		ts_display_p d )
+{
+	ts_display_group_driver_p g = (ts_display_group_driver_p)d->driver;
+	ts_master_p master = d->master;
+
+	if (g->generation == master->generation)
+		return g;
+	g->generation = master->generation;
+	for (int i = 0; i < g->count; i++) {
+		ts_display_p m = ts_master_display_get(master, g->name[i]);
+		if (m == d)
+			m = NULL;
+		if (m != g->member[i])
+			V1("%s %s member %s %s\n", __func__, d->name, g->name[i],
+					m ? "found" : "gone");
+		g->member[i] = m;
+	}
+	return g;
+}
+
+/*
+ * Hand 'e' to every member; it's encoded once, and each member's proxy
+ * gets a reference to it. A member that isn't a proxy, like an -x display
+ * on a client, gets the call instead.
+ */
+static void
+ts_group_send(
+		ts_display_p d,
+		ts_display_proxy_event_t e )
+{
+	ts_master_lock(d->master);
+	ts_display_group_driver_p g = ts_group_get(d);
+	ts_mux_frame_p f = ts_mux_frame_new(&e);
+
+	for (int i = 0; i < g->count; i++) {
+		ts_display_p m = g->member[i];
+		if (!m)
+			continue;
+		if (e.event == ts_proxy_mouse) {
+			if (e.u.mouse.x || e.u.mouse.y)
+				m->moved = 1;
+			m->mousex += e.u.mouse.x;
+			m->mousey += e.u.mouse.y;
+		}
+		e.frame = f ? ts_mux_frame_ref(f) : NULL;
+		if (!ts_display_proxy_queue(m, e) || !m->driver)
+			continue;
+		switch (e.event) {
+			case ts_proxy_mouse:
+				if (m->driver->mouse)
+					m->driver->mouse(m, e.u.mouse.x, e.u.mouse.y);
+				break;
+			case ts_proxy_button:
+				if (m->driver->button)
+					m->driver->button(m, e.u.button, e.down);
+				break;
+			case ts_proxy_key:
+				if (m->driver->key)
+					m->driver->key(m, e.u.key, e.down);
+				break;
+			case ts_proxy_wheel:
+				if (m->driver->wheel)
+					m->driver->wheel(m, e.u.wheel.wheel, e.u.wheel.y, e.u.wheel.x);
+				break;
+		}
+	}
+	ts_master_unlock(d->master);
+	ts_mux_frame_unref(f);
+}
+
+static void
+ts_group_enter(
+		ts_display_p d )
+{
+	ts_master_lock(d->master);
+	ts_display_group_driver_p g = ts_group_get(d);
+
+	// the members are the same size, they get the mouse where we have it
+	for (int i = 0; i < g->count; i++) {
+		ts_display_p m = g->member[i];
+		if (!m)
+			continue;
+		m->moved = 0;
+		m->mousex = d->mousex;
+		m->mousey = d->mousey;
+		if (m->driver && m->driver->enter)
+			m->driver->enter(m);
+		m->active = 1;
+	}
+	ts_master_unlock(d->master);
+}
+
+static void
+ts_group_leave(
+		ts_display_p d )
+{
+	ts_master_lock(d->master);
+	ts_display_group_driver_p g = ts_group_get(d);
+
+	for (int i = 0; i < g->count; i++)
+		ts_display_leave(g->member[i]);
+	ts_master_unlock(d->master);
+}
+
+static void
+ts_group_mouse(
+		ts_display_p d,
+		int x, int y )
+{
+	ts_display_proxy_event_t e = {
+			.event = ts_proxy_mouse,
+			.u.mouse.x = x,
+			.u.mouse.y = y,
+	};
+	ts_group_send(d, e);
+}
+
+static void
+ts_group_button(
+		ts_display_p d,
+		int b,
+		int down )
+{
+	ts_display_proxy_event_t e = {
+			.event = ts_proxy_button,
+			.u.button = b,
+			.down = down ? 1 : 0,
+	};
+	ts_group_send(d, e);
+}
+
+static void
+ts_group_key(
+		ts_display_p d,
+		uint16_t k,
+		int down )
+{
+	ts_display_proxy_event_t e = {
+			.event = ts_proxy_key,
+			.u.key = k,
+			.down = down ? 1 : 0,
+	};
+	ts_group_send(d, e);
+}
+
+static void
+ts_group_wheel(
+		ts_display_p d,
+		int wheel,
+		int y, int x )
+{
+	ts_display_proxy_event_t e = {
+			.event = ts_proxy_wheel,
+			.u.wheel.wheel = wheel,
+			.u.wheel.y = y,
+			.u.wheel.x = x,
+	};
+	ts_group_send(d, e);
+}
+
+// the clipboard comes from the first member that is there
+static void
+ts_group_getclipboard(
+		ts_display_p d,
+		ts_display_p to )
+{
+	ts_master_lock(d->master);
+	ts_display_group_driver_p g = ts_group_get(d);
+
+	for (int i = 0; i < g->count; i++)
+		if (g->member[i]) {
+			ts_display_getclipboard(g->member[i], to);
+			break;
+		}
+	ts_master_unlock(d->master);
+}
+
+static void
+ts_group_setclipboard(
+		ts_display_p d,
+		ts_clipboard_p clipboard )
+{
+	ts_master_lock(d->master);
+	ts_display_group_driver_p g = ts_group_get(d);
+
+	for (int i = 0; i < g->count; i++)
+		ts_display_setclipboard(g->member[i], clipboard);
+	ts_master_unlock(d->master);
+}
+
+static ts_display_driver_t ts_group_driver = {
+		.enter = ts_group_enter,
+		.leave = ts_group_leave,
+		.mouse = ts_group_mouse,
+		.button = ts_group_button,
+		.key = ts_group_key,
+		.wheel = ts_group_wheel,
+		.getclipboard = ts_group_getclipboard,
+		.setclipboard = ts_group_setclipboard,
+};
+
+ts_display_p
+ts_display_group_new(
+		ts_master_p master,
+		char * name,
+		char * where,
+		char * members )
+{
+	ts_display_p main = ts_master_get_main(master);
+	if (!main || !members)
+		return NULL;
+	ts_display_group_driver_p res = malloc(sizeof(*res));
+	memset(res, 0, sizeof(*res));
+	res->driver = ts_group_driver;
+
+	char * list = strdup(members), *p = list, *n;
+	int size = 1;
+	for (char * c = list; *c; c++)
+		if (*c == ',')
+			size++;
+	res->name = malloc(size * sizeof(char*));
+	res->member = calloc(size, sizeof(ts_display_p));
+	while ((n = strsep(&p, ",")) != NULL)
+		if (*n)
+			res->name[res->count++] = n;
+
+	ts_display_init(&res->display, master, &res->driver, name, where);
+	res->display.bounds.w = main->bounds.w;
+	res->display.bounds.h = main->bounds.h;
+	// that changes the generation, the members are looked up on first use
+	ts_master_display_add(master, &res->display);
+	ts_display_place(main, &res->display, where);
+	V1("%s %s has %d members\n", __func__, name, res->count);
+	return &res->display;
+}
@@ -0,0 +1,62 @@
+/*
+	ts_display_group.h
+
+	Copyright 2011 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of touchstream.
+
+	touchstream is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	touchstream is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with touchstream.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A "group" is a display that isn't a screen; whatever is typed while the
+ * mouse is on it goes to all it's "member" displays at once, to drive a
+ * rack of machines the same way.
+ *
+ * Each input event is encoded once, in a refcounted ts_mux_frame_t, that
+ * every member's proxy queues, and it's mux "data" remote sends without
+ * encoding it again.
+ * A member that can't keep up fills it's own fifo, and loses events like
+ * it would on it's own; the others don't wait for it.
+ *
+ * Members are found by name, and looked up again whenever the master's
+ * list of displays changes, so they can come and go.
+ */
+#ifndef __TS_DISPLAY_GROUP_H___
+#define __TS_DISPLAY_GROUP_H___
+
+#include "ts_master.h"
+
+typedef struct ts_display_group_driver_t {
+	ts_display_driver_t driver;
+	ts_display_t display;
+
+	int count;
+	char ** name;		// of the members
+	ts_display_p * member;	// NULL for the ones that aren't there
+	uint32_t generation;	// of the master, when 'member' was looked up
+} ts_display_group_driver_t, *ts_display_group_driver_p;
+
+/*
+ * Create group 'name', placed 'where' of the main display, and the same
+ * size. 'members' is a comma separated list of display names
+ */
+ts_display_p
+ts_display_group_new(
+		ts_master_p master,
+		char * name,
+		char * where,
+		char * members );
+
+#endif /* __TS_DISPLAY_GROUP_H___ */
@@ -29,16 +29,76 @@
 
 DEFINE_FIFO(ts_display_proxy_event_t, proxy_fifo);
 
+/*
+ * Read the next event. If it's a motion, the motions queued right behind
+ * it are added to it, as long as the sum fits; there is no point replaying
+ * stale positions one by one when we're late. Anything else is a barrier,
+ * keys and buttons are never merged or reordered.
+ * Called from the mux thread only, like proxy_fifo_read()
+ */
+static inline uint32_t
+ts_proxy_held_pack(
+		int x, int y )
+{
+	return (uint16_t)x | ((uint32_t)(uint16_t)y << 16);
+}
+
+static inline ts_display_proxy_event_t
+ts_proxy_held_event(
+		uint32_t held )
+{
+	ts_display_proxy_event_t e = {
+			.event = ts_proxy_mouse,
+			.u.mouse.x = (int16_t)(held & 0xffff),
+			.u.mouse.y = (int16_t)(held >> 16),
+	};
+	return e;
+}
+
+int
+ts_display_proxy_pending(
+		ts_display_proxy_driver_p p )
+{
+	return !proxy_fifo_isempty(&p->fifo) || p->held;
+}
+
+ts_display_proxy_event_t
+ts_display_proxy_read(
+		ts_display_proxy_driver_p p )
+{
+	/*
+	 * The fifo is empty, so the producer has nothing queued behind the
+	 * held motion; if it took it back meanwhile, this is a null motion
+	 */
+	if (proxy_fifo_isempty(&p->fifo))
+		return ts_proxy_held_event(__sync_lock_test_and_set(&p->held, 0));
+
+	ts_display_proxy_event_t e = proxy_fifo_read(&p->fifo);
+
+	if (e.event != ts_proxy_mouse)
+		return e;
+	while (!proxy_fifo_isempty(&p->fifo)) {
+		ts_display_proxy_event_t n = proxy_fifo_read_at(&p->fifo, 0);
+		if (n.event != ts_proxy_mouse)
+			break;
+		int x = e.u.mouse.x + n.u.mouse.x, y = e.u.mouse.y + n.u.mouse.y;
+		if (abs(x) > TS_PROXY_MOUSE_MAX || abs(y) > TS_PROXY_MOUSE_MAX)
+			break;
+		e.u.mouse.x = x;
+		e.u.mouse.y = y;
+		// the sum isn't what the group encoded anymore
+		ts_mux_frame_unref(e.frame);
+		ts_mux_frame_unref(n.frame);
+		e.frame = NULL;
+		proxy_fifo_read_offset(&p->fifo, 1);
+	}
+	return e;
+}
+
 static int
 ts_proxy_driver_flush(
 		struct ts_remote_t * r)
 {
-	{
-		uint8_t buf[32];
-		while (read(r->socket, buf, sizeof(buf)) == sizeof(buf))
-			;
-	}
-
 //	printf("%s display %p\n", __func__, r->display);
 	if (!r->display)
 		return 0;
@@ -46,8 +106,8 @@ ts_proxy_driver_flush(
 	ts_display_p display = r->display;
 	ts_display_proxy_driver_p d = (ts_display_proxy_driver_p)display->driver;
 
-	while (!proxy_fifo_isempty(&d->fifo)) {
-		ts_display_proxy_event_t e = proxy_fifo_read(&d->fifo);
+	while (ts_display_proxy_pending(d)) {
+		ts_display_proxy_event_t e = ts_display_proxy_read(d);
 		switch (e.event) {
 			case ts_proxy_init:
 				d->slave->init(display);
@@ -80,10 +140,61 @@ ts_proxy_driver_flush(
 				d->slave->setclipboard(display, e.u.clipboard);
 				break;
 		}
+		ts_mux_frame_unref(e.frame);
 	}
 	return 0;
 }
 
+/*
+ * Called in the mux thread when we've been kicked, hand the events
+ * to whoever consumes them.
+ */
+static void
+ts_proxy_driver_kick(
+		ts_mux_p mux,
+		ts_mux_kick_p kick)
+{
+	ts_display_proxy_driver_p p = kick->refCon;
+	ts_remote_p r = p->target;
+
+	if (!r || !r->data_write)
+		return;
+	if (r->data_write(r) >= 0)
+		ts_mux_remote_update(r);
+}
+
+/*
+ * If the fifo is full, a motion is held back and summed with the next
+ * ones, rather than lost; it is queued before whatever comes next, or
+ * the consumer takes it once it has emptied the fifo. Nothing else is
+ * queued while there is a held motion, so the order is kept.
+ */
+static void
+ts_proxy_driver_queue(
+		ts_display_proxy_driver_p p,
+		ts_display_proxy_event_t e)
+{
+	ts_display_proxy_event_t m = ts_proxy_held_event(
+			__sync_lock_test_and_set(&p->held, 0));
+	int full = (m.u.mouse.x || m.u.mouse.y) && !proxy_fifo_write(&p->fifo, m);
+
+	if (full || !proxy_fifo_write(&p->fifo, e)) {
+		int x = full ? m.u.mouse.x : 0, y = full ? m.u.mouse.y : 0;
+		ts_mux_frame_unref(e.frame);
+		if (e.event == ts_proxy_mouse) {
+			x += e.u.mouse.x;
+			y += e.u.mouse.y;
+			x = x < -TS_PROXY_MOUSE_MAX ? -TS_PROXY_MOUSE_MAX :
+					x > TS_PROXY_MOUSE_MAX ? TS_PROXY_MOUSE_MAX : x;
+			y = y < -TS_PROXY_MOUSE_MAX ? -TS_PROXY_MOUSE_MAX :
+					y > TS_PROXY_MOUSE_MAX ? TS_PROXY_MOUSE_MAX : y;
+		}
+		if (x || y)
+			__sync_lock_test_and_set(&p->held, ts_proxy_held_pack(x, y));
+	}
+	ts_mux_kick(p->remote.mux, &p->kick);
+}
+
 static void
 ts_proxy_driver_init(
 		ts_display_p d)
@@ -95,8 +206,7 @@ ts_proxy_driver_init(
 	ts_display_proxy_event_t e = {
 			.event = ts_proxy_init,
 	};
-	proxy_fifo_write(&p->fifo, e);
-	ts_signal(&p->signal, TS_SIGNAL_END0, 0);
+	ts_proxy_driver_queue(p, e);
 }
 
 static void
@@ -109,8 +219,7 @@ ts_proxy_driver_dispose(
 	ts_display_proxy_event_t e = {
 			.event = ts_proxy_dispose,
 	};
-	proxy_fifo_write(&p->fifo, e);
-	ts_signal(&p->signal, TS_SIGNAL_END0, 0);
+	ts_proxy_driver_queue(p, e);
 }
 
 static void
@@ -123,8 +232,7 @@ ts_proxy_driver_enter(
 	ts_display_proxy_event_t e = {
 			.event = ts_proxy_enter,
 	};
-	proxy_fifo_write(&p->fifo, e);
-	ts_signal(&p->signal, TS_SIGNAL_END0, 0);
+	ts_proxy_driver_queue(p, e);
 }
 
 static void
@@ -137,8 +245,7 @@ ts_proxy_driver_leave(
 	ts_display_proxy_event_t e = {
 			.event = ts_proxy_leave,
 	};
-	proxy_fifo_write(&p->fifo, e);
-	ts_signal(&p->signal, TS_SIGNAL_END0, 0);
+	ts_proxy_driver_queue(p, e);
 }
 
 static void
@@ -154,8 +261,7 @@ ts_proxy_driver_mouse(
 			.u.mouse.x = x,
 			.u.mouse.y = y,
 	};
-	proxy_fifo_write(&p->fifo, e);
-	ts_signal(&p->signal, TS_SIGNAL_END0, 0);
+	ts_proxy_driver_queue(p, e);
 }
 
 static void
@@ -172,8 +278,7 @@ ts_proxy_driver_button(
 			.u.button = b,
 			.down = down ? 1 : 0,
 	};
-	proxy_fifo_write(&p->fifo, e);
-	ts_signal(&p->signal, TS_SIGNAL_END0, 0);
+	ts_proxy_driver_queue(p, e);
 }
 
 static void
@@ -190,8 +295,7 @@ ts_proxy_driver_key(
 			.u.key = k,
 			.down = down ? 1 : 0,
 	};
-	proxy_fifo_write(&p->fifo, e);
-	ts_signal(&p->signal, TS_SIGNAL_END0, 0);
+	ts_proxy_driver_queue(p, e);
 }
 
 static void
@@ -209,8 +313,7 @@ ts_proxy_driver_wheel(
 			.u.wheel.y = y,
 			.u.wheel.x = x,
 	};
-	proxy_fifo_write(&p->fifo, e);
-	ts_signal(&p->signal, TS_SIGNAL_END0, 0);
+	ts_proxy_driver_queue(p, e);
 }
 
 static void
@@ -225,8 +328,7 @@ ts_proxy_driver_getclipboard(
 			.event = ts_proxy_getclipboard,
 			.u.display = to,
 	};
-	proxy_fifo_write(&p->fifo, e);
-	ts_signal(&p->signal, TS_SIGNAL_END0, 0);
+	ts_proxy_driver_queue(p, e);
 }
 
 static void
@@ -242,8 +344,32 @@ ts_proxy_driver_setclipboard(
 			.event = ts_proxy_setclipboard,
 			.u.clipboard = clipboard,
 	};
-	proxy_fifo_write(&p->fifo, e);
-	ts_signal(&p->signal, TS_SIGNAL_END0, 0);
+	ts_proxy_driver_queue(p, e);
+}
+
+int
+ts_display_proxy_queue(
+		ts_display_p d,
+		ts_display_proxy_event_t e )
+{
+	if (!d || !d->driver || d->driver->init != ts_proxy_driver_init) {
+		ts_mux_frame_unref(e.frame);
+		return -1;
+	}
+	ts_display_proxy_driver_p p = (ts_display_proxy_driver_p)d->driver;
+	// replayed to a local driver, that has to be able to take it
+	if (p->slave) {
+		ts_mux_frame_unref(e.frame);
+		e.frame = NULL;
+		void * has = e.event == ts_proxy_mouse ? (void*)p->slave->mouse :
+				e.event == ts_proxy_button ? (void*)p->slave->button :
+				e.event == ts_proxy_key ? (void*)p->slave->key :
+				e.event == ts_proxy_wheel ? (void*)p->slave->wheel : NULL;
+		if (!has)
+			return 0;
+	}
+	ts_proxy_driver_queue(p, e);
+	return 0;
 }
 
 static ts_display_driver_t ts_proxy_driver = {
@@ -267,16 +393,19 @@ ts_display_proxy_driver(
 	ts_display_proxy_driver_p res = malloc(sizeof(ts_display_proxy_driver_t));
 	memset(res, 0, sizeof(*res));
 	res->driver = ts_proxy_driver;
+	res->kick.refCon = res;
+	res->kick.callback = ts_proxy_driver_kick;
+	res->remote.mux = mux;
 
+	/*
+	 * Our remote doesn't have a socket, it's only ever kicked, so it
+	 * doesn't need to be registered with the mux either.
+	 */
 	if (driver) {
 		res->slave = ts_display_clone_driver(driver);
-		ts_signal_init(&res->signal);
-
 		res->remote.display = NULL;
-		res->remote.mux = mux;
-		res->remote.socket = res->signal.fd[TS_SIGNAL_END1];
-		res->remote.data_read = ts_proxy_driver_flush;
-		ts_mux_register(&res->remote);
+		res->remote.data_write = ts_proxy_driver_flush;
+		res->target = &res->remote;
 	}
 	return &res->driver;
 }
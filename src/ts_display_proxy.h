@@ -40,6 +40,9 @@ enum {
 	ts_proxy_setclipboard,
 };
 
+// the most a queued motion can hold, see ts_display_proxy_read()
+#define TS_PROXY_MOUSE_MAX	2047
+
 typedef struct ts_display_proxy_event_t {
 	uint32_t event : 8, flags : 8, down : 1;
 	union {
@@ -54,18 +57,38 @@ typedef struct ts_display_proxy_event_t {
 		} wheel;
 		ts_clipboard_p clipboard;
 	} u;
+	/*
+	 * The same input event, already encoded by a group, that holds a
+	 * reference for us; NULL for an event of our own
+	 */
+	struct ts_mux_frame_t * frame;
 } ts_display_proxy_event_t, *ts_display_proxy_event_p;
 
 #include "fifo_declare.h"
 
 DECLARE_FIFO(ts_display_proxy_event_t, proxy_fifo, 32);
 
+/*
+ * Events are queued in the fifo by whatever thread calls the driver, and
+ * the proxy kicks the mux; the mux thread then calls the 'target' remote
+ * data_write() callback to consume them. The target is either our own
+ * 'remote' that replays the events to the 'slave' driver, or a mux "data"
+ * remote that packetizes them for a network client.
+ * 'target' is only changed in the mux thread.
+ */
 typedef struct ts_display_proxy_driver_t {
 	ts_display_driver_t driver;
 	ts_display_driver_p slave;
 
-	ts_signal_t signal;
 	proxy_fifo_t fifo;
+	/*
+	 * Motion that didn't fit in the fifo, x and y in 16 bits each. Whoever
+	 * swaps it for zero owns it; the producer queues it before the next
+	 * event, the consumer takes it when it finds the fifo empty.
+	 */
+	volatile uint32_t held;
+	ts_mux_kick_t kick;
+	ts_remote_p target;
 	ts_remote_t remote;
 } ts_display_proxy_driver_t, *ts_display_proxy_driver_p;
 
@@ -75,4 +98,26 @@ ts_display_proxy_driver(
 		ts_mux_p  mux,
 		ts_display_driver_p driver );
 
+/*
+ * Queue 'e' for 'd', if it's a proxy display, it then owns the reference
+ * to 'e.frame'. Returns -1 if 'd' isn't a proxy, and the event wasn't
+ * queued; if the fifo is full, it's dropped like any other event would.
+ */
+int
+ts_display_proxy_queue(
+		ts_display_p d,
+		ts_display_proxy_event_t e );
+
+// Nonzero if there is an event to read, in the fifo or held back
+int
+ts_display_proxy_pending(
+		ts_display_proxy_driver_p p );
+
+/*
+ * Read the next event from the fifo, coalescing motions, see the .c
+ */
+ts_display_proxy_event_t
+ts_display_proxy_read(
+		ts_display_proxy_driver_p p );
+
 #endif /* __TS_DISPLAY_PROXY_H___ */
@@ -31,6 +31,29 @@ ts_master_init(
 		ts_master_p master)
 {
 	memset(master, 0, sizeof(*master));
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+#ifdef _POSIX_THREAD_PRIO_INHERIT
+	// the capture thread can be real time, see ts_rt.h
+	pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+#endif
+	pthread_mutex_init(&master->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+void
+ts_master_lock(
+		ts_master_p master)
+{
+	pthread_mutex_lock(&master->lock);
+}
+
+void
+ts_master_unlock(
+		ts_master_p master)
+{
+	pthread_mutex_unlock(&master->lock);
 }
 
 void
@@ -38,36 +61,68 @@ ts_master_display_add(
 		ts_master_p master,
 		ts_display_p d)
 {
+	ts_master_lock(master);
 	for (int i = 0; i < master->displayCount; i++)
 		if (master->display[i] == d)
-			return;
+			goto done;
 
+	if (master->displayCount == master->displaySize) {
+		int size = master->displaySize ? master->displaySize * 2 : 8;
+		ts_display_p * display = realloc(master->display,
+				size * sizeof(ts_display_p));
+		if (!display) {
+			fprintf(stderr, "%s can't add display %s\n", __func__, d->name);
+			goto done;
+		}
+		master->display = display;
+		master->displaySize = size;
+	}
 	master->display[master->displayCount++] = d;
+	master->generation++;
 	d->master = master;
 	if (master->displayCount == 1)
 		ts_master_set_active(master, d);
+done:
+	ts_master_unlock(master);
 }
 
-void
-ts_master_display_remove(
+int
+ts_master_display_detach(
 		ts_master_p master,
 		ts_display_p d)
 {
+	int res = -1;
+	ts_master_lock(master);
 	for (int i = 0; i < master->displayCount && d; i++)
 		if (master->display[i] == d) {
 			memmove(master->display + i,
 					master->display + i + 1,
 					(master->displayCount - i - 1) * sizeof(ts_display_p));
 			master->displayCount--;
+			master->generation++;
 			if (master->active == d) {
 				if (master->displayCount && d != master->display[0])
 					ts_master_set_active(master, master->display[0]);
 				else
 					ts_master_set_active(master, NULL);
 			}
-			ts_display_dispose(d);
+			res = 0;
 			break;
 		}
+	ts_master_unlock(master);
+	return res;
+}
+
+void
+ts_master_display_remove(
+		ts_master_p master,
+		ts_display_p d)
+{
+	// still locked, so whoever walks the list is done with 'd'
+	ts_master_lock(master);
+	if (!ts_master_display_detach(master, d))
+		ts_display_dispose(d);
+	ts_master_unlock(master);
 }
 
 ts_display_p
@@ -75,12 +130,15 @@ ts_master_display_get(
 	ts_master_p master,
 	char * display )
 {
+	ts_display_p res = NULL;
 	if (!master)
 		return NULL;
-	for (int i = 0; i < master->displayCount; i++)
+	ts_master_lock(master);
+	for (int i = 0; i < master->displayCount && !res; i++)
 		if (!strcmp(master->display[i]->name, display))
-			return master->display[i];
-	return NULL;
+			res = master->display[i];
+	ts_master_unlock(master);
+	return res;
 }
 
 ts_display_p
@@ -115,7 +173,10 @@ ts_display_p
 ts_master_get_main(
 	ts_master_p master )
 {
-	return master->displayCount ? master->display[0] : NULL;
+	ts_master_lock(master);
+	ts_display_p res = master->displayCount ? master->display[0] : NULL;
+	ts_master_unlock(master);
+	return res;
 }
 
 
@@ -127,8 +188,9 @@ ts_master_set_active(
 	if (!master)
 		return -1;
 
+	ts_master_lock(master);
 	if (master->active == d)
-		return 0;
+		goto done;
 	ts_display_p old = master->active;
 	if (old)
 		ts_display_leave(old);
@@ -141,6 +203,8 @@ ts_master_set_active(
 		if (old)
 			ts_display_getclipboard(old, master->active);
 	}
+done:
+	ts_master_unlock(master);
 	return 0;
 }
 
@@ -149,6 +213,7 @@ ts_master_mouse_move(
 		ts_master_p m,
 		int dx, int dy )
 {
+	ts_master_lock(m);
 	int wasedge = ts_ptonedge(&m->active->bounds, m->mousex, m->mousey);
 	int nx = m->mousex + dx;
 	int ny = m->mousey + dy;
@@ -187,5 +252,5 @@ ts_master_mouse_move(
 	ts_display_movemouse(m->active, dx, dy);
 	if (newd != m->active)
 		ts_master_set_active(m, newd);
-
+	ts_master_unlock(m);
 }
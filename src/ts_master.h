@@ -27,17 +27,27 @@
  *
  * There is a convention that the first display in the list is the "main" one,
  * regarless of wether you are a server or a client.
+ *
+ * Displays are added and removed by the main mux thread, while the capture
+ * thread moves the mouse around them; the list can be reallocated, so it
+ * is only walked with the master locked. The lock is recursive, since the
+ * drivers called with it held can call back in.
  */
 
 #ifndef __TS_MASTER_H___
 #define __TS_MASTER_H___
 
+#include <pthread.h>
 #include "ts_display.h"
 
 typedef struct ts_master_t {
+	pthread_mutex_t lock;
 	int displayCount;
-	ts_display_p display[8];
+	int displaySize;
+	ts_display_p * display;
 	ts_display_p active;
+	// changes when displays are added or removed, see ts_display_group.h
+	uint32_t generation;
 
 	int mousex, mousey;
 } ts_master_t, *ts_master_p;
@@ -46,6 +56,13 @@ void
 ts_master_init(
 		ts_master_p master);
 
+void
+ts_master_lock(
+		ts_master_p master);
+void
+ts_master_unlock(
+		ts_master_p master);
+
 void
 ts_master_display_add(
 		ts_master_p master,
@@ -55,12 +72,21 @@ void
 ts_master_display_remove(
 		ts_master_p master,
 		ts_display_p d);
+/*
+ * Same as ts_master_display_remove(), but 'd' isn't disposed of, it can
+ * be added back later. Returns -1 if it wasn't there.
+ */
+int
+ts_master_display_detach(
+		ts_master_p master,
+		ts_display_p d);
 
 ts_display_p
 ts_master_display_get(
 		ts_master_p master,
 		char * display);
 
+// with the master locked
 ts_display_p
 ts_master_display_get_for(
 		ts_master_p master,
@@ -34,6 +34,118 @@
  * 'w1920' sets the width to 1920
  * 'h1200' sets the height to 1200
  * nyelp sets the name to 'yelp' -- ends at the end of the packet, or ':'
+ *
+ * Version 2
+ * Both ends still start with their 'S' or 'C' packet as above, with the
+ * highest version they speak in 'v'. Nothing else is sent until the
+ * other end's packet is received, and from then on both ends use the
+ * lowest of the two versions, so old peers keep on using the text format.
+ * In version 2, everything after that first packet is a binary "frame":
+ *   <type> <length> <payload>
+ * 'type' is one byte, the same letters as the text packets, 'length'
+ * is a varint (see ts_wire.h) and the payload is made of varints and
+ * length prefixed strings:
+ *   'E' input events, as many as fit, see below
+ *   'e' enter: x, y (signed)
+ *   'l' leave: nothing
+ *   'g' get, 'c' clear, 's' set clipboard: name
+ *   'f' flavor: name, flavor name, and the data is the rest of the frame,
+ *       so it can be anything, binary too. Big flavors are split in
+ *       several 'f' frames, their data is appended.
+ * Frames of unknown types are skipped. None is ever longer than a few
+ * chunks of bulk data, so a longer one drops the connection.
+ * Each event in an 'E' frame starts with a varint made of a value, a
+ * 'down' bit and the kind of event in the low two bits:
+ *   (value << 3) | (down << 2) | kind
+ *   0 motion: value is dx (signed), followed by dy (signed)
+ *   1 button: value is the button
+ *   2 key: value is the key code
+ *   3 wheel: value is the wheel (signed), followed by x, y (signed)
+ * So a small motion is 2 bytes, a button 1 byte and most keys 2 or 3.
+ *
+ * Version 3
+ * Same frames, but clipboards are streamed instead of 'c', 'f', 's':
+ *   'T' transfer: id, name, count, and 'count' times a flavor name and
+ *       it's size. The flavors are then sent one after the other, as if
+ *       they were one stream of bytes.
+ *   'D' data: name, id, offset in the stream, and the data is the rest
+ *       of the frame
+ *   'A' ack: id, offset, window; sent by the receiver after 'T', and after
+ *       each 'D' it has stored. The sender can send up to offset + window.
+ * The receiver keeps incomplete transfers around for a while, so if the
+ * link drops, the sender announces the same 'T' again, and the 'A' it
+ * gets back tells it where to resume from. Once all the data is there, the
+ * clipboard is set, as 's' would.
+ *
+ * UDP side channel
+ * A client started with -U adds 'u' (a UDP port) and 't' (a token) to it's
+ * 'C' packet. A server started with -U then sends pointer motion to that
+ * port, in datagrams made of:
+ *   'M' token, seq, x, y (signed)
+ * x and y are all the motion sent so far, added up, so a datagram holds a
+ * position, and the receiver moves by the difference with the last one it
+ * applied. A datagram whose 'seq' isn't newer than that is dropped, and a
+ * lost one is made up for by the next. The receiver acknowledges them on
+ * the TCP link, with no more than one of these every 100ms:
+ *   'U' seq
+ * The server only sends motion over UDP once it has seen a 'U' for one of
+ * it's probes. If it hasn't seen any for a while, it goes back to TCP for
+ * good. Before anything else (keys, buttons...) it also sends the position
+ * over TCP, so they can't overtake the motion that came before them:
+ *   'P' seq, x, y (signed) same as 'M'
+ *
+ * Version 4
+ * Same frames, plus heartbeats, when either end is started with -H:
+ *   'H' ping: stamp, the sender's clock in us
+ *   'h' pong: the stamp of the ping it answers, as is
+ * Each end pings the other every third of it's dead peer delay, measures
+ * the round trip time with the pongs, and drops the connection when it
+ * hasn't read anything at all for the whole delay.
+ *
+ * Sessions
+ * The server adds 'r', a session token, to it's 'S' packet. When a client
+ * loses it's connection, the server keeps it's display aside for a while;
+ * the client adds the last token it got as 'r' to the 'C' packet when it
+ * reconnects, and gets the same display back, where it was, with the
+ * pointer if it had it and it hasn't moved since, and the clipboard it was
+ * being sent, resumed. Keys and buttons it was told are down are let go.
+ *
+ * Shared memory rings
+ * On a unix socket, an end started with -M adds 'm', a ring size, to it's
+ * 'S' or 'C' packet, and passes a sealed memfd of that size, and an
+ * eventfd, along with it. When both ends did, each writes it's frames to
+ * it's own ring instead of the socket, and rings the other's eventfd only
+ * when that one said it was waiting for data, or for room. The frames are
+ * the same, see ts_ring.h for the ring itself.
+ *
+ * Version 5
+ * Same frames, plus relays. A client that listens too (-l) is a relay;
+ * the clients that connect to it are tunneled to it's own server, over
+ * it's connection, with:
+ *   'O' open: id, a client connected to the relay
+ *   'R' relay: id, and the rest of the frame is the next bytes of that
+ *       client's stream, in either direction
+ *   'X' close: id, either end dropped it
+ *   'F' fan-out: length, that many bytes, and ids; those bytes are next
+ *       in the stream of each of these clients, from the server only
+ * The relay doesn't look at the streams, it just forwards them; the
+ * server sees a client like any other, except it's display is placed
+ * next to the relay's (and it gets no UDP, nor rings). Relays can be
+ * relayed too, so the clients make a tree, with one connection per relay
+ * to the server, and one per client only to it's relay.
+ *
+ * The relay follows the frames of each stream, without decoding them,
+ * so it can answer a client's 'H' pings itself, and the server doesn't
+ * ping relayed clients; it pings the relay, that drops the tunnels when
+ * the link goes. So no client's heartbeats cross the link.
+ *
+ * What that saves is connections, not work: the server still runs a data
+ * remote per client, at the end of a socket pair, and each client's own
+ * stream crosses the link. Input only ever goes to the active display, so
+ * that's one stream per event whatever the number of clients; a broadcast
+ * group's frames (see ts_display_group.h) go in 'F' frames, once for the
+ * relayed members that got the same ones, see data_relay_fanout(). So a
+ * group's events cross the link about once, plus an id per member.
  */
 
 #include <string.h>
@@ -41,670 +153,4639 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <ctype.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <errno.h>
+#include <time.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
+#ifdef CONFIG_LINUX
+#define TS_MUX_EPOLL 1
+#include <sys/epoll.h>
+#include <linux/errqueue.h>
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define TS_MUX_ZEROCOPY 1
+#endif
+#else
 #include <sys/select.h>
+#endif
 
 #include "ts_mux.h"
 #include "ts_display_proxy.h"
+#include "ts_resolve.h"
+#include "ts_wire.h"
+#include "ts_ring.h"
 #include "ts_verbose.h"
 
-#define TS_MUX_VERSION 0x0001
-
-DEFINE_FIFO(ts_display_proxy_event_t, proxy_fifo);
+#define TS_MUX_VERSION 0x0005
 
-#define _MAX(a, b) ((a) > (b) ? (a) : (b))
+// so a peer going away doesn't SIGPIPE us
+#ifdef MSG_NOSIGNAL
+#define TS_MUX_NOSIGNAL		MSG_NOSIGNAL
+#else
+#define TS_MUX_NOSIGNAL		0
+#endif
 
+// payloads at least that big are sent with MSG_ZEROCOPY, if supported
+#define TS_MUX_ZEROCOPY_MIN	(64 * 1024)
 /*
- * Mux/demux thread
- *
- * This thread waits for events on it's signal socket or on any of the
- * 'remote' sockets, and then calls their callbacks to dispatch the event.
- *
- * Note that the mux thread is used with network socket as expected, but is
- * also used for xorg "Connection" and ts_signal socketpair(), it makes sure
- * that all the code runs on a single thread, and prevents the need for
- * mutexes and other garbage.
+ * Bulk data is sent in chunks that big, and we don't let the kernel hold
+ * much more than that unsent; that's the most input events wait behind it
  */
-static void *
-_sn_mux_thread(
-		void * ignore)
-{
-	ts_mux_p mux = (ts_mux_p)ignore;
+#define TS_MUX_CHUNK		(64 * 1024)
+#define TS_MUX_NOTSENT_LOWAT	(2 * TS_MUX_CHUNK)
+// longest frame we accept; the bulk chunks, and their header, fit easily
+#define TS_MUX_FRAME_MAX	(4 * TS_MUX_CHUNK)
+/*
+ * Clipboard streams; how much a receiver lets the sender have in flight,
+ * and for how long (ms) an incomplete one is kept, waiting to be resumed
+ */
+#define TS_MUX_WINDOW		(4 * TS_MUX_CHUNK)
+#define TS_MUX_XFER_GRACE	(60 * 1000)
+/*
+ * UDP side channel, in ms; how often, and how many times, we probe it,
+ * how long a datagram can go unacknowledged, and how long the receiver
+ * waits to acknowledge them
+ */
+#define TS_MUX_UDP_PROBE	500
+#define TS_MUX_UDP_PROBES	4
+#define TS_MUX_UDP_TIMEOUT	2000
+#define TS_MUX_UDP_ACK		100
+/*
+ * Reconnection delay, in ms; it doubles every time up to the maximum, and
+ * half of it is random, so clients don't all come back at the same time
+ */
+#define TS_MUX_BACKOFF_MIN	250
+#define TS_MUX_BACKOFF_MAX	5000
+// how long (ms) a client display is kept, waiting for it's client to resume
+#define TS_MUX_SESSION_GRACE	(60 * 1000)
 
-	fd_set readSet, writeSet;
-	while (1) {
-		int max = -1;
-		FD_ZERO(&readSet);
-		FD_ZERO(&writeSet);
+/*
+ * Relays; the tunnels to a link are only read from while it has less
+ * than a window queued, and a client that doesn't keep up with what is
+ * relayed to it is dropped, rather than holding up the link
+ */
+#define TS_MUX_RELAY_CHUNK	(TS_MUX_SEG_SIZE - 16)
+#define TS_MUX_RELAY_WINDOW	TS_MUX_CHUNK
+#define TS_MUX_RELAY_PENDING	(4 * TS_MUX_WINDOW)
 
-		FD_SET(mux->signal.fd[TS_SIGNAL_END1], &readSet);
-		max = _MAX(max, mux->signal.fd[TS_SIGNAL_END1]);
+// input buffer sizes, see data_event_read()
+#define TS_MUX_IN_SIZE		(16 * 1024)
+#define TS_MUX_IN_READ		4096	// smallest read we bother with
+#define TS_MUX_READ_BUDGET	(256 * 1024)
 
-		/*
-		 * Mark all the remotes ready to read, also check to see if
-		 * they have outgoing data, if so, also check for an event
-		 * to make sure socket is ready to send before sending out
-		 */
-		for (int i = 0; i < 32; i++) {
-			if ((mux->dp_usage & (1U << i))) {
-				ts_remote_p fun = mux->dp[i];
-				if (fun->socket <= 0 && fun->start(fun))
-					continue;
+DEFINE_FIFO(ts_display_proxy_event_t, proxy_fifo);
 
-				if (!fun->can_read || fun->can_read(fun)) {
-					FD_SET(fun->socket, &readSet);
-					max = _MAX(max, fun->socket);
-				}
+/*
+ * Poll backend. On linux, each remote registers it's read/write interest
+ * with epoll once, and only changes it when it's state changes (see
+ * ts_mux_remote_update()) so a wakeup only costs as much as the number of
+ * remotes that have something to do, not the number of remotes we have.
+ * Other platforms fall back to select() using the same interest bits.
+ */
+#ifdef TS_MUX_EPOLL
+static void
+_ts_mux_poll_init(
+		ts_mux_p mux)
+{
+	mux->poll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (mux->poll_fd < 0) {
+		perror("_ts_mux_poll_init epoll_create1");
+		exit(1);
+	}
+	// the signal socket is the only one without a remote (handle zero)
+	struct epoll_event ev = { .events = EPOLLIN, .data.u64 = 0 };
+	if (epoll_ctl(mux->poll_fd, EPOLL_CTL_ADD,
+			mux->signal.fd[TS_SIGNAL_END1], &ev))
+		perror("_ts_mux_poll_init epoll_ctl");
+}
 
-				if (fun->can_write && fun->can_write(fun)) {
-					FD_SET(fun->socket, &writeSet);
-					max = _MAX(max, fun->socket);
-				}
-			}
-		}
+static void
+_ts_mux_poll_set(
+		ts_remote_p r,
+		uint32_t events )
+{
+	struct epoll_event ev = {
+		.events = ((events & ts_mux_event_read) ? EPOLLIN : 0) |
+				((events & ts_mux_event_write) ? EPOLLOUT : 0),
+		.data.u64 = r->handle,
+	};
+	int op = r->poll_socket == r->socket ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	if (epoll_ctl(r->mux->poll_fd, op, r->socket, &ev))
+		perror("_ts_mux_poll_set epoll_ctl");
+}
 
-		/*
-		 * Wait for an event on any of the sockets
-		 */
-		struct timeval timo = { .tv_sec = 1, .tv_usec = 0 };
-		/*int ret = */
-		select(max + 1, &readSet, &writeSet, NULL, &timo);
-
-		// have we been signaled ?
-		if (FD_ISSET(mux->signal.fd[TS_SIGNAL_END1], &readSet)) {
-			// flush socket
-			ts_signal_flush(&mux->signal, TS_SIGNAL_END1);
-		//	printf("%s: signaled\n", __FUNCTION__);
-		}
-		for (int i = 0; i < 32; i++)
-			if ((mux->dp_usage & (1U << i))) {
-				ts_remote_p fun = mux->dp[i];
-				if (fun->socket <= 0) /* not yet connected anyway */
-					continue;
-				int rd = FD_ISSET(fun->socket, &readSet);
-				int wr = FD_ISSET(fun->socket, &writeSet);
-				if (rd || wr)
-					V3("slot %d %p socket %d rd %d wr %d\n",
-						i, fun, fun->socket, rd, wr);
-				if (rd && fun->data_read)
-					fun->data_read(fun);
-				if (wr && fun->data_write)
-					fun->data_write(fun);
-			}
-	}
-	return NULL;
+static void
+_ts_mux_poll_del(
+		ts_remote_p r )
+{
+	struct epoll_event ev = { 0 };
+	epoll_ctl(r->mux->poll_fd, EPOLL_CTL_DEL, r->poll_socket, &ev);
 }
+#else
+#define _MAX(a, b) ((a) > (b) ? (a) : (b))
 
-int
-ts_mux_start(
-		ts_mux_p mux,
-		ts_master_p master )
+static void _ts_mux_poll_init(ts_mux_p mux) { mux->poll_fd = -1; }
+static void _ts_mux_poll_set(ts_remote_p r, uint32_t events) {}
+static void _ts_mux_poll_del(ts_remote_p r) {}
+#endif
+
+void
+ts_mux_remote_update(
+		ts_remote_p r )
 {
-	if (mux->thread)
-		return 0;
-	mux->master = master;
-	/*
-	 * Create the socket pair for signaling the mux thread
-	 */
-	ts_signal_init(&mux->signal);
 	/*
-	 * Create the thread
+	 * Not connected (yet, or anymore); make sure the poll backend forgets
+	 * about us, and tell the mux thread we want to be start()ed
 	 */
-	if (pthread_create(&mux->thread, NULL,
-			_sn_mux_thread, mux)) {
-		perror("_sn_server_mux_create pthread_create");
-		mux->thread = 0;
-		return -1;
+	if (r->socket <= 0) {
+		if (r->poll_socket > 0)
+			_ts_mux_poll_del(r);
+		r->poll_socket = 0;
+		r->events = 0;
+		if (r->start && !ts_mux_timer_armed(&r->timer))
+			ts_mux_timer_arm(r->mux, &r->timer, ts_mux_now());
+		return;
 	}
-	return 0;
+	uint32_t want = 0;
+	if (!r->can_read || r->can_read(r))
+		want |= ts_mux_event_read;
+	if (r->can_write && r->can_write(r))
+		want |= ts_mux_event_write;
+
+	if (r->poll_socket == r->socket && want == r->events)
+		return;
+	if (r->poll_socket > 0 && r->poll_socket != r->socket)
+		_ts_mux_poll_del(r);
+	_ts_mux_poll_set(r, want);
+	r->poll_socket = r->socket;
+	r->events = want;
 }
 
-//! Signal the thread side from the client side
 void
-ts_mux_signal(
-		ts_mux_p mux,
-		uint8_t what )
+ts_mux_remote_close(
+		ts_remote_p r )
 {
-	ts_signal(&mux->signal, TS_SIGNAL_END0, 0);
+	if (r->poll_socket > 0)
+		_ts_mux_poll_del(r);
+	r->poll_socket = 0;
+	r->events = 0;
+	if (r->socket > 0)
+		close(r->socket);
+	r->socket = -1;
 }
 
-/*
- * These are not thread safe, fortunately, they should only happend
- * before the thread is started OR in the mux's thread context.
- */
-int
-ts_mux_register(
-		ts_remote_p r)
+uint64_t
+ts_mux_now(void)
 {
-	for (int i = 0; i < 32; i++)
-		if (!(r->mux->dp_usage & (1U << i))) {
-			r->mux->dp[i] = r;
-			r->mux->dp_usage |= 1 << i;
-			ts_mux_signal(r->mux, 0);
-			return 0;
-		}
-	return -1;
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return ((uint64_t)t.tv_sec * 1000) + (t.tv_nsec / 1000000);
 }
 
-int
-ts_mux_unregister(
-		ts_remote_p r)
+// same clock, in us, for spinning and latency measurements
+static uint64_t
+_ts_mux_now_us(void)
 {
-	for (int i = 0; i < 32; i++)
-		if ((r->mux->dp_usage & (1U << i)) && r->mux->dp[i] == r) {
-			r->mux->dp_usage &= ~(1 << i);
-			r->mux->dp[i] = NULL;
-//			ts_mux_signal(r->mux, 0);
-			return 0;
-		}
-	return -1;
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return ((uint64_t)t.tv_sec * 1000000) + (t.tv_nsec / 1000);
 }
 
 /*
- * Create an outgoing socket, and attempts to connect to it asynchronously
+ * Timer min-heap. Each timer knows it's own position in the heap, so
+ * cancelling or moving one is O(log n) too.
  */
-static int
-connect_start(
-		struct ts_remote_t * r)
+static void
+_ts_mux_timer_set(
+		ts_mux_p mux,
+		uint32_t i,
+		ts_mux_timer_p t )
 {
-	if (r->timeout && time(NULL) - r->timeout < 5)
-		return -1;
-
-	int skt = socket(AF_INET, SOCK_STREAM, 0);
-	if (skt < 0)
-		return -1;
-	size_t addrLen = sizeof(r->addr);
+	mux->timers.heap[i] = t;
+	t->index = i + 1;
+}
 
-	r->state = skt_state_Connect;
-	int i = 1;
-	// we can ignore error here, on UNIX sockets
-	setsockopt (skt, IPPROTO_TCP, TCP_NODELAY, &i, sizeof (i));
+static void
+_ts_mux_timer_up(
+		ts_mux_p mux,
+		uint32_t i )
+{
+	ts_mux_timer_p t = mux->timers.heap[i];
+	while (i) {
+		uint32_t parent = (i - 1) / 2;
+		if (mux->timers.heap[parent]->when <= t->when)
+			break;
+		_ts_mux_timer_set(mux, i, mux->timers.heap[parent]);
+		i = parent;
+	}
+	_ts_mux_timer_set(mux, i, t);
+}
 
-	r->timeout = 0;
-	r->socket = skt;
-	{	// make it nonblocking
-		int flags = fcntl(r->socket, F_GETFL, 0);
-		fcntl(r->socket, F_SETFL, flags | O_NONBLOCK);
+static void
+_ts_mux_timer_down(
+		ts_mux_p mux,
+		uint32_t i )
+{
+	ts_mux_timer_p t = mux->timers.heap[i];
+	while (1) {
+		uint32_t child = (i * 2) + 1;
+		if (child >= mux->timers.count)
+			break;
+		if (child + 1 < mux->timers.count &&
+				mux->timers.heap[child + 1]->when < mux->timers.heap[child]->when)
+			child++;
+		if (t->when <= mux->timers.heap[child]->when)
+			break;
+		_ts_mux_timer_set(mux, i, mux->timers.heap[child]);
+		i = child;
 	}
+	_ts_mux_timer_set(mux, i, t);
+}
 
-	if (connect(skt, (struct sockaddr*)&r->addr, addrLen) < 0) {
-		if (errno != EINPROGRESS) {
-			perror("connect_start");
-			close(skt);
-			return -1;
+void
+ts_mux_timer_arm(
+		ts_mux_p mux,
+		ts_mux_timer_p timer,
+		uint64_t when )
+{
+	if (ts_mux_timer_armed(timer)) {
+		uint64_t old = timer->when;
+		timer->when = when;
+		if (when < old)
+			_ts_mux_timer_up(mux, timer->index - 1);
+		else
+			_ts_mux_timer_down(mux, timer->index - 1);
+		return;
+	}
+	if (mux->timers.count == mux->timers.size) {
+		uint32_t size = mux->timers.size ? mux->timers.size * 2 : 16;
+		ts_mux_timer_p * heap = realloc(mux->timers.heap, size * sizeof(*heap));
+		if (!heap) {
+			fprintf(stderr, "%s can't arm timer %p\n", __func__, timer);
+			return;
 		}
-		V1("Connection in progress (%s)\n", __func__);
+		mux->timers.heap = heap;
+		mux->timers.size = size;
 	}
+	timer->when = when;
+	_ts_mux_timer_set(mux, mux->timers.count++, timer);
+	_ts_mux_timer_up(mux, mux->timers.count - 1);
+}
 
-	return 0;
+void
+ts_mux_timer_cancel(
+		ts_mux_p mux,
+		ts_mux_timer_p timer )
+{
+	if (!ts_mux_timer_armed(timer))
+		return;
+	uint32_t i = timer->index - 1;
+	timer->index = 0;
+	ts_mux_timer_p last = mux->timers.heap[--mux->timers.count];
+	if (last == timer)
+		return;
+	_ts_mux_timer_set(mux, i, last);
+	if (i && mux->timers.heap[(i - 1) / 2]->when > last->when)
+		_ts_mux_timer_up(mux, i);
+	else
+		_ts_mux_timer_down(mux, i);
 }
 
 /*
- * if a remote socket fails, delete it, and set ourself up
- * ready to re-attempt connection in a few seconds.
+ * Fire all the timers that have expired, and return how long to sleep
+ * until the next one, or -1 if there is none
  */
 static int
-connect_restart(
-		struct ts_remote_t * r)
+_ts_mux_timers_run(
+		ts_mux_p mux )
 {
-	V1("Outgoing connection retrying (%s)\n", __func__);
-	r->timeout = time(NULL);
-	/*
-	 * Note, we do NOT delete the r->display here, as outgoing socket's hold
-	 * the 'main' display there, so we just close the socket and try to
-	 * reconnect to the server instead.
-	 */
-	close(r->socket);
-	r->socket = -1;
+	uint64_t now = ts_mux_now();
+
+	while (mux->timers.count) {
+		ts_mux_timer_p t = mux->timers.heap[0];
+		if (t->when > now) {
+			uint64_t delay = t->when - now;
+			return delay > 0x7fffffff ? 0x7fffffff : (int)delay;
+		}
+		ts_mux_timer_cancel(mux, t);
+		t->callback(mux, t);
+	}
 	return -1;
 }
 
 /*
- * This is called when the socket has been truly established.
- * Theoricaly, we could use the existing system to buffer & send
- * our message, but since we /just started/ we can assume there's
- * a few bytes free in the socket's buffer for a write() to work!
+ * Remote slab. Slots are allocated from the free list, and the remotes
+ * are also kept packed in 'live' for iteration; removing one moves the
+ * last one in it's place. These are only called from the mux thread, or
+ * before it is started.
  */
 static int
-connect_established(
-		struct ts_remote_t * r)
+_ts_mux_slab_add(
+		ts_mux_p mux,
+		ts_remote_p r )
 {
-	V1("Outgoing connection established (%s)\n", __func__);
-	ts_display_p d = r->display;
-	char msg[32];
-	sprintf(msg, "Cvx%xw%dh%dn%s:p%s:", TS_MUX_VERSION,
-			d->bounds.w, d->bounds.h, d->name,
-			d->param ? d->param : "");
-	if (write(r->socket, msg, strlen(msg)+1))
-		;
+	if (!mux->remotes.free) {
+		uint32_t size = mux->remotes.size ? mux->remotes.size * 2 : 32;
+		if (size > TS_MUX_HANDLE_INDEX_MASK + 1)
+			return -1;
+		ts_mux_slot_p slot = realloc(mux->remotes.slot, size * sizeof(*slot));
+		if (!slot)
+			return -1;
+		mux->remotes.slot = slot;
+		ts_remote_p * live = realloc(mux->remotes.live, size * sizeof(*live));
+		if (!live)
+			return -1;
+		mux->remotes.live = live;
+		for (uint32_t i = size; i > mux->remotes.size; i--) {
+			slot[i - 1].remote = NULL;
+			slot[i - 1].generation = 0;
+			slot[i - 1].index = mux->remotes.free;
+			mux->remotes.free = i;
+		}
+		V3("%s slab grown to %d slots\n", __func__, (int)size);
+		mux->remotes.size = size;
+	}
+	uint32_t index = mux->remotes.free - 1;
+	ts_mux_slot_p slot = &mux->remotes.slot[index];
+	mux->remotes.free = slot->index;
+
+	slot->generation = (slot->generation + 1) & TS_MUX_HANDLE_GEN_MASK;
+	if (!slot->generation)
+		slot->generation++;
+	slot->remote = r;
+	slot->index = mux->remotes.count;
+	mux->remotes.live[mux->remotes.count++] = r;
+	r->handle = (slot->generation << TS_MUX_HANDLE_INDEX_BITS) | index;
 	return 0;
 }
 
-/*
- * If the outgoing socket is not established, do not
- * try to register for read events, it won't work
- */
 static int
-connect_can_read(
-		struct ts_remote_t * r)
+_ts_mux_slab_remove(
+		ts_mux_p mux,
+		ts_remote_p r )
 {
-	if (r->state == skt_state_Connect) {
-		return 0;
-	}
-	return 1;
+	if (ts_mux_get_remote(mux, r->handle) != r)
+		return -1;
+	uint32_t index = r->handle & TS_MUX_HANDLE_INDEX_MASK;
+	ts_mux_slot_p slot = &mux->remotes.slot[index];
+
+	ts_remote_p last = mux->remotes.live[--mux->remotes.count];
+	mux->remotes.live[slot->index] = last;
+	mux->remotes.slot[last->handle & TS_MUX_HANDLE_INDEX_MASK].index = slot->index;
+
+	slot->remote = NULL;
+	slot->index = mux->remotes.free;
+	mux->remotes.free = index + 1;
+	r->handle = 0;
+	return 0;
+}
+
+ts_remote_p
+ts_mux_get_remote(
+		ts_mux_p mux,
+		ts_remote_handle_t handle )
+{
+	uint32_t index = handle & TS_MUX_HANDLE_INDEX_MASK;
+	if (!handle || index >= mux->remotes.size)
+		return NULL;
+	ts_mux_slot_p slot = &mux->remotes.slot[index];
+	if (!slot->remote ||
+			(handle >> TS_MUX_HANDLE_INDEX_BITS) != slot->generation)
+		return NULL;
+	return slot->remote;
 }
 
 /*
- * Check to see whether we want to write anything. It could be
- * + That we are still establishing the connection, therefore we
- *   need to register for this event as per select() requirement
- * + We have an outgoing buffer that still has some data not sent
- *   from the last time we tried to send it
- * + There are new events in the FIFO to convert into packets
+ * Output segments. The standard sized ones are recycled on a (per mux,
+ * so unlocked) spare list, so a busy connection doesn't keep on calling
+ * malloc() and free()
  */
-static int
-connect_can_write(
-		struct ts_remote_t * r)
+#define TS_MUX_SEG_SPARE	64
+
+static ts_mux_seg_p
+_ts_mux_seg_new(
+		ts_mux_p mux,
+		uint32_t size )
 {
-	if (r->state == skt_state_Connect) {
-		return 1;
+	ts_mux_seg_p seg = NULL;
+	if (size <= TS_MUX_SEG_SIZE) {
+		size = TS_MUX_SEG_SIZE;
+		if (mux->seg) {
+			seg = mux->seg;
+			mux->seg = seg->next;
+			mux->segCount--;
+		}
 	}
-	if (r->out_len)
-		return 1;
-	// check fifo...
-	if (!r->proxy)
-		return 0;
-
-	return !proxy_fifo_isempty(&r->proxy->fifo);
+	if (!seg)
+		seg = malloc(sizeof(ts_mux_seg_t) + size);
+	if (!seg)
+		return NULL;
+	memset(seg, 0, sizeof(*seg));
+	seg->data = seg->buf;
+	seg->size = size;
+	return seg;
 }
 
-/*
- * This is called when an incoming socket has been established (from the listen one)
- * It means we are a 'server' and therefore we send a 'server' packet quickly
- * with the geometry of the screen
- */
-static int
-data_start(
-		struct ts_remote_t * r)
+static void
+_ts_mux_seg_free(
+		ts_mux_p mux,
+		ts_mux_seg_p seg )
 {
-	r->socket = r->accept_socket;
-	V2("%s Incoming connection socket %d\n", __func__, r->socket);
-	ts_display_p d = ts_master_get_main(r->mux->master);
-	char msg[32];
-	sprintf(msg, "Svx%xw%dh%dn%s", TS_MUX_VERSION, d->bounds.w, d->bounds.h, d->name);
-	if (write(r->socket, msg, strlen(msg)+1))
-		;
-	return 0;
+	if (seg->release)
+		seg->release(seg);
+	if (seg->size == TS_MUX_SEG_SIZE && mux->segCount < TS_MUX_SEG_SPARE) {
+		seg->next = mux->seg;
+		mux->seg = seg;
+		mux->segCount++;
+	} else
+		free(seg);
 }
 
 /*
- * Incoming socket has closed down, we need to tear down any proxy display
- * we had, clean the buffers, unregister ourselves from the mux and die.
+ * Drop anything queued for output
  */
-static int
-data_restart(
-		struct ts_remote_t * r)
+static void
+_ts_mux_out_clear(
+		ts_remote_p r )
 {
-	V1("Incoming connection to %s terminated (%s)\n",
-			r->display ? r->display->name : "(unknown)",__func__);
-	if (r->display) {
-		ts_master_display_remove(r->display->master, r->display);
-		r->display = NULL;
+	ts_mux_timer_cancel(r->mux, &r->flush);
+	while (r->out) {
+		ts_mux_seg_p seg = r->out;
+		r->out = seg->next;
+		_ts_mux_seg_free(r->mux, seg);
 	}
-	ts_mux_unregister(r);
-	if (r->in)
-		free(r->in);
-	r->in = NULL;
-	r->in_size = r->in_len = 0;
-	if (r->out)
-		free(r->out);
-	r->out = NULL;
-	r->out_size = r->out_len = 0;
-	if (r->dispose)
-		r->dispose(r);
-	else {
-		close(r->socket);
-		free(r);
+	r->out_tail = NULL;
+	while (r->bulk.head) {
+		ts_mux_seg_p seg = r->bulk.head;
+		r->bulk.head = seg->next;
+		_ts_mux_seg_free(r->mux, seg);
 	}
-	return -1;
+	r->bulk.tail = NULL;
+	r->out_len = 0;
+	// the socket is gone, the kernel won't tell us about these anymore
+	while (r->zerocopy.pending) {
+		ts_mux_seg_p seg = r->zerocopy.pending;
+		r->zerocopy.pending = seg->next;
+		_ts_mux_seg_free(r->mux, seg);
+	}
+	r->zerocopy.tail = NULL;
+	r->zerocopy.enabled = 0;
+	r->zerocopy.next = 0;
 }
 
-
 /*
- * Check to see wether we want to write anything. It could be
+ * Release a clipboard stream, see ts_mux_xfer_t
+ */
+static void
+_ts_mux_xfer_free(
+		ts_mux_xfer_p x )
+{
+	if (!x)
+		return;
+	for (int i = 0; i < x->flavorCount; i++)
+		ts_clipboard_data_unref(x->flavor[i].data);
+	ts_clipboard_dispose(&x->clipboard);
+	free(x);
+}
+
+/*
+ * Timer callback for remotes that aren't connected. If start() fails, and
+ * it didn't schedule it's own retry, try again in a second
+ */
+static void
+_ts_mux_remote_start(
+		ts_mux_p mux,
+		ts_mux_timer_p timer )
+{
+	ts_remote_p r = timer->refCon;
+
+	if (r->socket <= 0 && r->start(r) && !ts_mux_timer_armed(timer))
+		ts_mux_timer_arm(mux, timer, ts_mux_now() + 1000);
+	ts_mux_remote_update(r);
+}
+
+static void
+_ts_mux_add(
+		ts_remote_p r )
+{
+	if (_ts_mux_slab_add(r->mux, r)) {
+		fprintf(stderr, "%s can't register remote %p\n", __func__, r);
+		__sync_fetch_and_sub(&r->mux->load, 1);
+		return;
+	}
+	ts_mux_remote_update(r);
+}
+
+/*
+ * We've been signaled by another thread; pick up any remote it registered,
+ * and service the kicks that were queued. Both lists are taken in one go,
+ * anything queued after that will signal us again.
+ */
+static void
+_ts_mux_signaled(
+		ts_mux_p mux )
+{
+	uint64_t signaled = __sync_lock_test_and_set(&mux->stats.signaled, 0);
+	if (signaled) {
+		uint64_t now = _ts_mux_now_us();
+		uint32_t us = now > signaled ? now - signaled : 0;
+		if (!mux->stats.latency.count || us < mux->stats.latency.min)
+			mux->stats.latency.min = us;
+		if (us > mux->stats.latency.max)
+			mux->stats.latency.max = us;
+		mux->stats.latency.sum += us;
+		mux->stats.latency.count++;
+	}
+	uint32_t what = ts_signal_flush(&mux->signal, TS_SIGNAL_END1);
+	V3("%s signals %02x\n", __func__, what);
+
+	ts_remote_p pending = __sync_lock_test_and_set(&mux->pending, NULL);
+	while (pending) {
+		ts_remote_p r = pending;
+		pending = r->pending;
+		r->pending = NULL;
+		_ts_mux_add(r);
+	}
+	ts_mux_kick_p kick = __sync_lock_test_and_set(&mux->kick, NULL);
+	// the list is LIFO, put it back in order
+	ts_mux_kick_p ordered = NULL;
+	while (kick) {
+		ts_mux_kick_p k = kick;
+		kick = k->next;
+		k->next = ordered;
+		ordered = k;
+	}
+	kick = ordered;
+	while (kick) {
+		ts_mux_kick_p k = kick;
+		kick = k->next;
+		k->next = NULL;
+		// clear it first, so it can be kicked again while we service it
+		__sync_lock_release(&k->queued);
+		k->callback(mux, k);
+	}
+}
+
+/*
+ * The remote's address, for humans
+ */
+static const char *
+_ts_mux_addr_name(
+		ts_remote_p r,
+		char * buf,
+		size_t size )
+{
+	if (r->addr.sa.sa_family == AF_UNIX)
+		snprintf(buf, size, "unix:%s", r->addr.un.sun_path);
+	else if (r->addr.sa.sa_family != AF_INET)
+		snprintf(buf, size, "relayed");
+	else {
+		char ip[INET_ADDRSTRLEN] = "";
+		inet_ntop(AF_INET, &r->addr.in.sin_addr, ip, sizeof(ip));
+		snprintf(buf, size, "%s:%d", ip, ntohs(r->addr.in.sin_port));
+	}
+	return buf;
+}
+
+static socklen_t
+_ts_mux_addr_len(
+		ts_remote_p r )
+{
+	return r->addr.sa.sa_family == AF_UNIX ?
+			sizeof(r->addr.un) : sizeof(r->addr.in);
+}
+
+/*
+ * Account for one wakeup; 'causes' is a bitfield of ts_mux_wake_*, zero
+ * for a poll that didn't wait, and found nothing. If reporting is on, the
+ * report is printed on the first wakeup after the period has elapsed,
+ * rather than using a timer, so the reporting itself doesn't wake us up.
+ */
+static void
+_ts_mux_account(
+		ts_mux_p mux,
+		uint32_t causes )
+{
+	static const char * name[ts_mux_wake_count] = {
+		[ts_mux_wake_socket] = "socket",
+		[ts_mux_wake_signal] = "signal",
+		[ts_mux_wake_xorg] = "xorg",
+		[ts_mux_wake_timer] = "timer",
+	};
+	if (causes)
+		mux->stats.wakeups++;
+	else
+		mux->stats.spins++;
+	for (int i = 0; i < ts_mux_wake_count; i++)
+		if (causes & (1 << i))
+			mux->stats.cause[i]++;
+
+	if (!mux->stats.period)
+		return;
+	uint64_t now = ts_mux_now();
+	if (now - mux->stats.start < mux->stats.period)
+		return;
+	double secs = (now - mux->stats.start) / 1000.0;
+	printf("mux %p: %.2f wakeups/s over %.1fs (", mux,
+			mux->stats.wakeups / secs, secs);
+	for (int i = 0; i < ts_mux_wake_count; i++)
+		printf("%s%s %.2f", i ? " " : "", name[i], mux->stats.cause[i] / secs);
+	printf(")");
+	if (mux->spin.mode != ts_mux_spin_block)
+		printf(" spins %.0f/s", mux->stats.spins / secs);
+	if (mux->stats.latency.count)
+		printf(" signal latency %u/%u/%uus min/avg/max",
+				mux->stats.latency.min,
+				(uint32_t)(mux->stats.latency.sum / mux->stats.latency.count),
+				mux->stats.latency.max);
+	if (mux->stats.batch.writes)
+		printf(" %.2f events/write, %.2f held/s",
+				(double)mux->stats.batch.events / mux->stats.batch.writes,
+				mux->stats.batch.held / secs);
+	for (uint32_t i = 0; i < mux->remotes.count; i++) {
+		ts_remote_p r = mux->remotes.live[i];
+		char addr[128];
+		if (r->rtt.count)
+			printf(" rtt %s %u/%u/%uus min/srtt/var",
+					_ts_mux_addr_name(r, addr, sizeof(addr)),
+					r->rtt.min, r->rtt.srtt, r->rtt.var);
+	}
+	printf("\n");
+	fflush(stdout);
+	memset(mux->stats.cause, 0, sizeof(mux->stats.cause));
+	memset(&mux->stats.latency, 0, sizeof(mux->stats.latency));
+	memset(&mux->stats.batch, 0, sizeof(mux->stats.batch));
+	mux->stats.wakeups = 0;
+	mux->stats.spins = 0;
+	mux->stats.start = now;
+}
+
+/*
+ * Call the remote's callbacks for the event(s) it received, then update
+ * it's interest bits, as the callbacks are likely to have changed them.
+ * A callback returning < 0 means the remote was restarted, or is gone
+ * altogether, so we don't touch it again.
+ */
+static void
+_ts_mux_dispatch(
+		ts_remote_p r,
+		int rd,
+		int wr )
+{
+	int socket = r->socket;
+
+	V3("remote %p socket %d rd %d wr %d\n", r, socket, rd != 0, wr != 0);
+	if (rd && r->data_read && r->data_read(r) < 0)
+		return;
+	if (wr && r->socket == socket && r->data_write && r->data_write(r) < 0)
+		return;
+	ts_mux_remote_update(r);
+}
+
+/*
+ * Wait for events for up to 'timeout' ms (forever if < 0) and dispatch
+ * them. Returns the number of events
+ */
+#ifdef TS_MUX_EPOLL
+static int
+_ts_mux_poll(
+		ts_mux_p mux,
+		int timeout )
+{
+	struct epoll_event ev[32];
+
+	int count = epoll_wait(mux->poll_fd, ev, 32, timeout);
+	if (count < 0)
+		return 0;
+	uint32_t causes = count || !timeout ? 0 : (1 << ts_mux_wake_timer);
+	for (int i = 0; i < count; i++) {
+		if (!ev[i].data.u64) {
+			causes |= 1 << ts_mux_wake_signal;
+			_ts_mux_signaled(mux);
+			continue;
+		}
+		/*
+		 * The remote could have been unregistered by a previous
+		 * callback, in which case the handle is stale
+		 */
+		ts_remote_p r = ts_mux_get_remote(mux, ev[i].data.u64);
+		if (!r)
+			continue;
+		uint32_t e = ev[i].events;
+		/*
+		 * Errors are delivered to the callback that will notice them
+		 * first; a pending connect() only ever registers for write.
+		 */
+		if (e & (EPOLLERR | EPOLLHUP))
+			e |= (r->events & ts_mux_event_read) ? EPOLLIN : EPOLLOUT;
+		causes |= 1 << r->wake;
+		_ts_mux_dispatch(r, e & EPOLLIN, e & EPOLLOUT);
+	}
+	_ts_mux_account(mux, causes);
+	return count;
+}
+#else
+static int
+_ts_mux_poll(
+		ts_mux_p mux,
+		int timeout )
+{
+	fd_set readSet, writeSet;
+	int max = -1;
+	FD_ZERO(&readSet);
+	FD_ZERO(&writeSet);
+
+	FD_SET(mux->signal.fd[TS_SIGNAL_END1], &readSet);
+	max = _MAX(max, mux->signal.fd[TS_SIGNAL_END1]);
+
+	for (uint32_t i = 0; i < mux->remotes.count; i++) {
+		ts_remote_p fun = mux->remotes.live[i];
+		if (fun->poll_socket <= 0)
+			continue;
+		if (fun->events & ts_mux_event_read)
+			FD_SET(fun->poll_socket, &readSet);
+		if (fun->events & ts_mux_event_write)
+			FD_SET(fun->poll_socket, &writeSet);
+		max = _MAX(max, fun->poll_socket);
+	}
+
+	struct timeval timo = {
+			.tv_sec = timeout / 1000, .tv_usec = (timeout % 1000) * 1000 };
+	int count = select(max + 1, &readSet, &writeSet, NULL,
+			timeout < 0 ? NULL : &timo);
+	if (count < 0)
+		return 0;
+	uint32_t causes = count || !timeout ? 0 : (1 << ts_mux_wake_timer);
+
+	if (FD_ISSET(mux->signal.fd[TS_SIGNAL_END1], &readSet)) {
+		causes |= 1 << ts_mux_wake_signal;
+		_ts_mux_signaled(mux);
+	}
+	/*
+	 * Go backward, a callback removing it's remote moves the last
+	 * one in it's place, and we've already seen that one
+	 */
+	for (uint32_t i = mux->remotes.count; i > 0; i--) {
+		if (i > mux->remotes.count)
+			continue;
+		ts_remote_p fun = mux->remotes.live[i - 1];
+		if (fun->poll_socket <= 0)
+			continue;
+		int rd = FD_ISSET(fun->poll_socket, &readSet);
+		int wr = FD_ISSET(fun->poll_socket, &writeSet);
+		if (rd || wr) {
+			causes |= 1 << fun->wake;
+			_ts_mux_dispatch(fun, rd, wr);
+		}
+	}
+	_ts_mux_account(mux, causes);
+	return count;
+}
+#endif
+
+/*
+ * Mux/demux thread
+ *
+ * This thread waits for events on it's signal socket or on any of the
+ * 'remote' sockets, and then calls their callbacks to dispatch the event.
+ *
+ * Note that the mux thread is used with network socket as expected, but is
+ * also used for xorg "Connection" and ts_signal socketpair(), it makes sure
+ * that all the code runs on a single thread, and prevents the need for
+ * mutexes and other garbage.
+ */
+static void *
+_sn_mux_thread(
+		void * ignore)
+{
+	ts_mux_p mux = (ts_mux_p)ignore;
+
+	// the capture thread is 0, we come after it
+	ts_rt_thread(mux->rt, 1 + mux->index);
+	while (1) {
+		/*
+		 * Sleep until the next deadline; if there is no timer armed,
+		 * there is no reason to wake up on our own at all.
+		 * Unless we're spinning, then we just check, and come back.
+		 */
+		int timeout = _ts_mux_timers_run(mux);
+		uint64_t now = 0;
+		switch (mux->spin.mode) {
+			case ts_mux_spin_always:
+				timeout = 0;
+				break;
+			case ts_mux_spin_hybrid:
+				now = _ts_mux_now_us();
+				if (now < mux->spin.until)
+					timeout = 0;
+				break;
+		}
+		if (_ts_mux_poll(mux, timeout)) {
+			if (mux->spin.mode == ts_mux_spin_hybrid)
+				mux->spin.until = (timeout ? _ts_mux_now_us() : now) + mux->spin.idle;
+		} else if (!timeout)
+			sched_yield();	// don't starve whoever is going to wake us
+	}
+	return NULL;
+}
+
+void
+ts_mux_shards_init(
+		ts_mux_p mux,
+		int count,
+		int policy )
+{
+	if (count < 2)
+		return;
+	if (count > TS_MUX_SHARDS_MAX)
+		count = TS_MUX_SHARDS_MAX;
+	for (int i = 0; i < count; i++) {
+		mux[i].shards = mux;
+		mux[i].shardCount = count;
+		mux[i].index = i;
+		mux[i].policy = policy;
+	}
+}
+
+ts_mux_p
+ts_mux_pick(
+		ts_mux_p mux )
+{
+	ts_mux_p main = ts_mux_main(mux);
+	if (main->shardCount < 2)
+		return main;
+	uint32_t start = __sync_fetch_and_add(&main->next, 1) % main->shardCount;
+	if (main->policy == ts_mux_policy_roundrobin)
+		return &main->shards[start];
+	/*
+	 * Least loaded, starting from the round robin cursor so that
+	 * shards with the same load get used in turn
+	 */
+	ts_mux_p res = &main->shards[start];
+	for (int i = 1; i < main->shardCount; i++) {
+		ts_mux_p m = &main->shards[(start + i) % main->shardCount];
+		if (m->load < res->load)
+			res = m;
+	}
+	return res;
+}
+
+/*
+ * Cross thread calls are just kicks that free themselves
+ */
+typedef struct ts_mux_call_t {
+	ts_mux_kick_t kick;
+	ts_mux_call_p fn;
+	void * a, * b;
+} ts_mux_call_t, *ts_mux_call_t_p;
+
+static void
+_ts_mux_call_kick(
+		ts_mux_p mux,
+		ts_mux_kick_p kick )
+{
+	ts_mux_call_t_p c = kick->refCon;
+	c->fn(mux, c->a, c->b);
+	free(c);
+}
+
+int
+ts_mux_call(
+		ts_mux_p mux,
+		ts_mux_call_p fn,
+		void * a,
+		void * b )
+{
+	if (!mux->thread || pthread_equal(pthread_self(), mux->thread)) {
+		fn(mux, a, b);
+		return 0;
+	}
+	ts_mux_call_t_p c = malloc(sizeof(ts_mux_call_t));
+	if (!c)
+		return -1;
+	memset(c, 0, sizeof(*c));
+	c->kick.refCon = c;
+	c->kick.callback = _ts_mux_call_kick;
+	c->fn = fn;
+	c->a = a;
+	c->b = b;
+	ts_mux_kick(mux, &c->kick);
+	return 0;
+}
+
+int
+ts_mux_start(
+		ts_mux_p mux,
+		ts_master_p master )
+{
+	if (mux->thread)
+		return 0;
+	mux->master = master;
+	// the main mux starts the other shards
+	if (mux->shards == mux)
+		for (int i = 1; i < mux->shardCount; i++)
+			ts_mux_start(&mux->shards[i], master);
+	/*
+	 * Create the socket pair for signaling the mux thread
+	 */
+	ts_signal_init(&mux->signal);
+	_ts_mux_poll_init(mux);
+	mux->stats.start = ts_mux_now();
+	/*
+	 * Remotes could have been registered before we were started,
+	 * tell the poll backend about them now
+	 */
+	for (uint32_t i = 0; i < mux->remotes.count; i++)
+		ts_mux_remote_update(mux->remotes.live[i]);
+	/*
+	 * Create the thread
+	 */
+	if (pthread_create(&mux->thread, NULL,
+			_sn_mux_thread, mux)) {
+		perror("_sn_server_mux_create pthread_create");
+		mux->thread = 0;
+		return -1;
+	}
+	/*
+	 * Kicks queued before there was a thread couldn't signal it, and the
+	 * next ones won't either, they only signal an empty list
+	 */
+	if (mux->kick || mux->pending)
+		ts_mux_signal(mux, ts_mux_signal_kick);
+	return 0;
+}
+
+//! Signal the thread side from the client side
+void
+ts_mux_signal(
+		ts_mux_p mux,
+		uint8_t what )
+{
+	if (!mux->thread)
+		return;
+	if (mux->stats.period)
+		__sync_bool_compare_and_swap(&mux->stats.signaled, 0, _ts_mux_now_us());
+	ts_signal(&mux->signal, TS_SIGNAL_END0, what);
+}
+
+void
+ts_mux_kick(
+		ts_mux_p mux,
+		ts_mux_kick_p kick )
+{
+	// already queued, the mux will see the new work when it services it
+	if (__sync_lock_test_and_set(&kick->queued, 1))
+		return;
+	ts_mux_kick_p head;
+	do {
+		head = mux->kick;
+		kick->next = head;
+	} while (!__sync_bool_compare_and_swap(&mux->kick, head, kick));
+	// only the first kick needs to wake the mux up
+	if (!head)
+		ts_mux_signal(mux, ts_mux_signal_kick);
+}
+
+/*
+ * The remote slab isn't thread safe, so if we're called from another
+ * thread while the mux is running, the remote is queued, and the mux
+ * thread will add it when it gets signaled.
+ */
+int
+ts_mux_register(
+		ts_remote_p r)
+{
+	ts_mux_p mux = r->mux;
+
+	r->timer.refCon = r;
+	r->timer.callback = _ts_mux_remote_start;
+	__sync_fetch_and_add(&mux->load, 1);
+
+	if (mux->thread && !pthread_equal(pthread_self(), mux->thread)) {
+		do {
+			r->pending = mux->pending;
+		} while (!__sync_bool_compare_and_swap(&mux->pending, r->pending, r));
+		ts_mux_signal(mux, ts_mux_signal_register);
+		return 0;
+	}
+	if (_ts_mux_slab_add(mux, r)) {
+		__sync_fetch_and_sub(&mux->load, 1);
+		return -1;
+	}
+	// if the mux isn't started, ts_mux_start() will do it
+	if (mux->thread)
+		ts_mux_remote_update(r);
+	return 0;
+}
+
+int
+ts_mux_unregister(
+		ts_remote_p r)
+{
+	if (r->poll_socket > 0)
+		_ts_mux_poll_del(r);
+	r->poll_socket = 0;
+	r->events = 0;
+	ts_mux_timer_cancel(r->mux, &r->timer);
+	ts_mux_timer_cancel(r->mux, &r->flush);
+	ts_mux_timer_cancel(r->mux, &r->udp.timer);
+	ts_mux_timer_cancel(r->mux, &r->heartbeat);
+	if (_ts_mux_slab_remove(r->mux, r))
+		return -1;
+	__sync_fetch_and_sub(&r->mux->load, 1);
+	return 0;
+}
+
+static void
+data_keepalive(
+		struct ts_remote_t * r);
+static void
+data_ring_close(
+		struct ts_remote_t * r);
+static void
+data_relay_drop(
+		struct ts_remote_t * r);
+static void
+data_relay_unblock(
+		struct ts_remote_t * r);
+static void
+data_relay_fanout_end(
+		struct ts_remote_t * r);
+
+/*
+ * Next reconnection delay, see TS_MUX_BACKOFF_MIN
+ */
+static uint32_t
+connect_backoff(
+		struct ts_remote_t * r)
+{
+	uint32_t b = r->backoff * 2;
+	r->backoff = b < TS_MUX_BACKOFF_MIN ? TS_MUX_BACKOFF_MIN :
+			b > TS_MUX_BACKOFF_MAX ? TS_MUX_BACKOFF_MAX : b;
+	return r->backoff / 2 + (uint32_t)(_ts_mux_now_us() % (r->backoff / 2 + 1));
+}
+
+/*
+ * Create an outgoing socket, and attempts to connect to it asynchronously
+ */
+static int
+connect_start(
+		struct ts_remote_t * r)
+{
+	/*
+	 * Make sure we know where to go first; if the address needs to be
+	 * looked up, the lookup completion restarts us
+	 */
+	if (r->resolve) {
+		int ready = ts_resolve_lookup(r->resolve);
+		if (ready <= 0) {
+			ts_mux_timer_arm(r->mux, &r->timer, ts_mux_now() + 5000);
+			return ready;
+		}
+		r->addr.in.sin_addr = r->resolve->addr;
+	}
+	int skt = socket(r->addr.sa.sa_family, SOCK_STREAM, 0);
+	if (skt < 0)
+		return -1;
+	size_t addrLen = _ts_mux_addr_len(r);
+
+	r->state = skt_state_Connect;
+	int i = 1;
+	// we can ignore error here, on UNIX sockets
+	setsockopt (skt, IPPROTO_TCP, TCP_NODELAY, &i, sizeof (i));
+
+	r->socket = skt;
+	{	// make it nonblocking
+		int flags = fcntl(r->socket, F_GETFL, 0);
+		fcntl(r->socket, F_SETFL, flags | O_NONBLOCK);
+	}
+
+	// so a connection that doesn't go through fails as fast as a dead one
+	data_keepalive(r);
+
+	if (connect(skt, &r->addr.sa, addrLen) < 0) {
+		if (errno != EINPROGRESS) {
+			perror("connect_start");
+			close(skt);
+			r->socket = -1;
+			ts_mux_timer_arm(r->mux, &r->timer, ts_mux_now() + connect_backoff(r));
+			return -1;
+		}
+		V1("Connection in progress (%s)\n", __func__);
+	}
+
+	return 0;
+}
+
+/*
+ * The host name lookup is done, try to connect now, or retry later
+ * if we still have no address at all
+ */
+static void
+connect_resolved(
+		ts_mux_p mux,
+		ts_resolve_p res)
+{
+	ts_remote_p r = res->refCon;
+	ts_mux_timer_arm(mux, &r->timer,
+			ts_mux_now() + (res->valid ? 0 : connect_backoff(r)));
+}
+
+/*
+ * if a remote socket fails, delete it, and set ourself up
+ * ready to re-attempt connection, sooner the first times.
+ */
+static int
+connect_restart(
+		struct ts_remote_t * r)
+{
+	uint32_t delay = connect_backoff(r);
+	V1("Outgoing connection retrying in %ums (%s)\n", delay, __func__);
+	ts_mux_timer_arm(r->mux, &r->timer, ts_mux_now() + delay);
+	// the host might have moved, look it up again when we retry
+	if (r->resolve)
+		ts_resolve_expire(r->resolve);
+	/*
+	 * Note, we do NOT delete the r->display here, as outgoing socket's hold
+	 * the 'main' display there, so we just close the socket and try to
+	 * reconnect to the server instead.
+	 */
+	ts_mux_remote_close(r);
+	// don't glue half a packet from that connection to the next one
+	r->in_len = r->in_start = r->in_scan = 0;
+	r->version = 0;
+	r->motion.x = r->motion.y = 0;
+	ts_mux_timer_cancel(r->mux, &r->udp.timer);
+	ts_mux_timer_cancel(r->mux, &r->heartbeat);
+	data_ring_close(r);
+	// the relayed clients reconnect to us, once we are connected again
+	data_relay_drop(r);
+	// r->xfer stays, it's resumed once we are connected again
+	_ts_mux_out_clear(r);
+	ts_mux_remote_update(r);
+	return -1;
+}
+
+/*
+ * In real time mode, the buffers of a data connection are made big
+ * enough for anything but clipboards up front, so that reading and
+ * packetizing events never has to realloc(), or fault pages in.
+ */
+static void
+data_prealloc(
+		struct ts_remote_t * r)
+{
+	ts_rt_p rt = r->mux->rt;
+	if (!rt || !rt->prealloc)
+		return;
+	if (r->in_size < (int)rt->prealloc) {
+		uint8_t * in = ts_rt_prefault(r->in, rt->prealloc);
+		if (in) {
+			r->in = in;
+			r->in_size = rt->prealloc;
+		}
+	}
+	// and the output segments come from the mux spare list
+	ts_mux_p mux = r->mux;
+	while (mux->segCount < TS_MUX_SEG_SPARE &&
+			mux->segCount * 4096 < rt->prealloc) {
+		ts_mux_seg_p seg = ts_rt_prefault(NULL, 4096);
+		if (!seg)
+			break;
+		seg->size = TS_MUX_SEG_SIZE;
+		seg->release = NULL;
+		_ts_mux_seg_free(mux, seg);
+	}
+}
+
+/*
+ * Ask the kernel to busy poll the device queue for a while when we read
+ * from a data socket that has nothing, see -P
+ */
+static void
+data_busy_poll(
+		struct ts_remote_t * r)
+{
+#ifdef SO_BUSY_POLL
+	int us = r->mux->spin.busy;
+	if (us && setsockopt(r->socket, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us)))
+		perror("data_busy_poll SO_BUSY_POLL");
+#endif
+}
+
+/*
+ * Don't let bulk data pile up in the socket, see TS_MUX_CHUNK
+ */
+static void
+data_notsent_lowat(
+		struct ts_remote_t * r)
+{
+#ifdef TCP_NOTSENT_LOWAT
+	int lowat = TS_MUX_NOTSENT_LOWAT;
+	// we can ignore error here, on UNIX sockets
+	setsockopt(r->socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+#endif
+}
+
+/*
+ * With heartbeats, have the kernel give up on the connection within the
+ * same delay too; when data we sent isn't acknowledged (TCP_USER_TIMEOUT)
+ * and when it's idle, with keepalives, in case the peer doesn't ping us.
+ */
+static void
+data_keepalive(
+		struct ts_remote_t * r)
+{
+	uint32_t ms = r->mux->heartbeat;
+	// a unix socket peer can't be cut off, the heartbeats will do
+	if (!ms || r->addr.sa.sa_family != AF_INET)
+		return;
+	int on = 1;
+	if (setsockopt(r->socket, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)))
+		perror("data_keepalive SO_KEEPALIVE");
+#ifdef TCP_USER_TIMEOUT
+	unsigned int timeout = ms;
+	setsockopt(r->socket, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof(timeout));
+#endif
+#if defined(TCP_KEEPIDLE) && defined(TCP_KEEPINTVL) && defined(TCP_KEEPCNT)
+	// idle for a third of it, then 2 probes, as far apart as we can
+	int idle = ms / 3000 ? ms / 3000 : 1, count = 2;
+	setsockopt(r->socket, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+	setsockopt(r->socket, IPPROTO_TCP, TCP_KEEPINTVL, &idle, sizeof(idle));
+	setsockopt(r->socket, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+#endif
+}
+
+/*
+ * Big clipboards are sent straight from their buffer with MSG_ZEROCOPY;
+ * these buffers can only be released once the kernel tells us, on the
+ * socket error queue, that it is done with them.
+ */
+static void
+data_zerocopy_init(
+		struct ts_remote_t * r)
+{
+#ifdef TS_MUX_ZEROCOPY
+	int one = 1;
+	r->zerocopy.enabled =
+		!setsockopt(r->socket, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one));
+	r->zerocopy.next = 0;
+#endif
+}
+
+static void
+data_zerocopy_reap(
+		struct ts_remote_t * r)
+{
+#ifdef TS_MUX_ZEROCOPY
+	while (r->zerocopy.pending) {
+		char control[128];
+		struct msghdr msg = {
+				.msg_control = control, .msg_controllen = sizeof(control) };
+		if (recvmsg(r->socket, &msg, MSG_ERRQUEUE) < 0)
+			break;
+		for (struct cmsghdr * cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			struct sock_extended_err * err = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (err->ee_errno || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			// sends ee_info to ee_data are done; TCP completes them in order
+			while (r->zerocopy.pending &&
+					(int32_t)(r->zerocopy.pending->zerocopy - 1 - err->ee_data) <= 0) {
+				ts_mux_seg_p seg = r->zerocopy.pending;
+				r->zerocopy.pending = seg->next;
+				_ts_mux_seg_free(r->mux, seg);
+			}
+		}
+	}
+	if (!r->zerocopy.pending)
+		r->zerocopy.tail = NULL;
+#endif
+}
+
+/*
+ * Make room at the end of the input buffer, first by moving the packet in
+ * progress to the front, or by growing the buffer. Returns the room, or -1
+ * if the remote was restarted
+ */
+static int
+data_event_room(
+		struct ts_remote_t * r)
+{
+	if (r->in_size - r->in_len < TS_MUX_IN_READ && r->in_start) {
+		memmove(r->in, r->in + r->in_start, r->in_len - r->in_start);
+		r->in_len -= r->in_start;
+		r->in_scan -= r->in_start;
+		r->in_start = 0;
+	}
+	if (r->in_size - r->in_len < TS_MUX_IN_READ) {
+		int news = r->in_size < TS_MUX_IN_SIZE ? TS_MUX_IN_SIZE : r->in_size * 2;
+		uint8_t * in = realloc(r->in, news);
+		if (!in) {
+			perror("data_event_read");
+			if (r->restart)
+				r->restart(r);
+			return -1;
+		}
+		V3("%s reallocated in from %d to %d\n", __func__, r->in_size, news);
+		r->in = in;
+		r->in_size = news;
+	}
+	return r->in_size - r->in_len;
+}
+
+static int
+data_event_parse(
+		struct ts_remote_t * r);
+
+/*
+ * Shared memory rings, for unix socket peers started with -M. Each end
+ * offers a ring it writes to, passing it's memfd, and a doorbell, with the
+ * 'S' or 'C' packet; when both did, each end reads the other's ring, and
+ * the socket is only left to tell when the peer goes away. The doorbell
+ * is read by a remote of it's own, like the UDP socket.
+ */
+typedef struct data_ring_remote_t {
+	ts_remote_t remote;
+	ts_remote_p owner;
+} data_ring_remote_t, *data_ring_remote_p;
+
+static void
+data_ring_close(
+		struct ts_remote_t * r)
+{
+	if (r->ring.remote) {
+		ts_mux_unregister(r->ring.remote);
+		free(r->ring.remote);
+	}
+	int * fd[] = { &r->ring.fd, &r->ring.bell, &r->ring.peer,
+			&r->ring.recv[0], &r->ring.recv[1] };
+	for (int i = 0; i < 5; i++)
+		if (*fd[i] > 0)
+			close(*fd[i]);
+	ts_ring_unmap(r->ring.out, r->ring.outSize);
+	ts_ring_unmap(r->ring.in, r->ring.inSize);
+	uint8_t failed = r->ring.failed;
+	memset(&r->ring, 0, sizeof(r->ring));
+	r->ring.failed = failed;
+}
+
+/*
+ * Make our ring, and our doorbell, for the 'S' or 'C' packet to offer.
+ * Returns the ring size, zero if not offering one
+ */
+static uint32_t
+data_ring_offer(
+		struct ts_remote_t * r)
+{
+	data_ring_close(r);
+	if (!r->mux->ring || r->addr.sa.sa_family != AF_UNIX || r->ring.failed)
+		return 0;
+	uint32_t size = 4096;
+	while (size < r->mux->ring && size < (1 << 28))
+		size <<= 1;
+	r->ring.bell = ts_ring_bell_new();
+	if (r->ring.bell < 0) {
+		r->ring.bell = 0;
+		return 0;
+	}
+	r->ring.out = ts_ring_create(size, &r->ring.fd);
+	if (!r->ring.out) {
+		data_ring_close(r);
+		return 0;
+	}
+	r->ring.outSize = size;
+	return size;
+}
+
+/*
+ * Send the 'S' or 'C' packet, with our ring and doorbell if we offer them
+ */
+static void
+data_ring_handshake(
+		struct ts_remote_t * r,
+		char * msg,
+		int len )
+{
+	if (!r->ring.fd) {
+		if (send(r->socket, msg, len, TS_MUX_NOSIGNAL) < 0)
+			perror("data_ring_handshake send");
+		return;
+	}
+	int fds[2] = { r->ring.fd, r->ring.bell };
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(fds))];
+	} control;
+	struct iovec iov = { .iov_base = msg, .iov_len = len };
+	struct msghdr mh = {
+			.msg_iov = &iov, .msg_iovlen = 1,
+			.msg_control = control.buf, .msg_controllen = sizeof(control.buf) };
+	struct cmsghdr * cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+	if (sendmsg(r->socket, &mh, TS_MUX_NOSIGNAL) < 0)
+		perror("data_ring_handshake sendmsg");
+	// the peer has it's own copy, if it wants it
+	close(r->ring.fd);
+	r->ring.fd = 0;
+}
+
+/*
+ * Read from a unix socket, keeping any descriptor the peer sent along
+ */
+static ssize_t
+data_ring_recv(
+		struct ts_remote_t * r,
+		uint8_t * buf,
+		int len )
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} control;
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
+	struct msghdr mh = {
+			.msg_iov = &iov, .msg_iovlen = 1,
+			.msg_control = control.buf, .msg_controllen = sizeof(control.buf) };
+	int flags = 0;
+#ifdef MSG_CMSG_CLOEXEC
+	flags |= MSG_CMSG_CLOEXEC;
+#endif
+	ssize_t ss = recvmsg(r->socket, &mh, flags);
+	if (ss <= 0)
+		return ss;
+	for (struct cmsghdr * cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+		if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+			continue;
+		int count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (int i = 0; i < count; i++) {
+			int fd;
+			memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(fd));
+			if (i < 2) {
+				if (r->ring.recv[i] > 0)
+					close(r->ring.recv[i]);
+				r->ring.recv[i] = fd;
+			} else
+				close(fd);
+		}
+	}
+	return ss;
+}
+
+/*
+ * Drain the peer's ring into the input buffer, and parse it, until it's
+ * empty, and the peer knows to ring us. Returns -1 if the remote was
+ * restarted
+ */
+static int
+data_ring_read(
+		struct ts_remote_t * r)
+{
+	int budget = TS_MUX_READ_BUDGET;
+	for (;;) {
+		int room = data_event_room(r);
+		if (room < 0)
+			return -1;
+		int n = ts_ring_read(r->ring.in, r->ring.inSize, r->in + r->in_len, room);
+		if (n < 0) {
+			V1("%s the peer broke the ring, dropping it\n", __func__);
+			if (r->restart)
+				r->restart(r);
+			return -1;
+		}
+		if (ts_ring_wake_writer(r->ring.in))
+			ts_ring_bell(r->ring.peer);
+		if (!n) {
+			if (ts_ring_sleep(r->ring.in))
+				break;
+			continue;
+		}
+		r->in_len += n;
+		budget -= n;
+		if (r->mux->heartbeat)
+			r->heard = ts_mux_now();
+		if (data_event_parse(r) < 0)
+			return -1;
+		// give the other remotes a chance, and come back for the rest
+		if (budget <= 0) {
+			ts_ring_bell(r->ring.bell);
+			break;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Our doorbell rang; there is something in the peer's ring, or room in
+ * ours, or both
+ */
+static int
+data_ring_bell(
+		struct ts_remote_t * b)
+{
+	ts_remote_p r = ((data_ring_remote_p)b)->owner;
+
+	ts_ring_bell_clear(b->socket);
+	r->ring.full = 0;
+	if (data_ring_read(r) < 0)
+		return -1;
+	if (r->data_write && r->data_write(r) < 0)
+		return -1;
+	ts_mux_remote_update(r);
+	return 0;
+}
+
+/*
+ * The peer offered it's ring too; map it, and listen for our doorbell
+ */
+static int
+data_ring_start(
+		struct ts_remote_t * r)
+{
+	if (r->ring.recv[0] <= 0 || r->ring.recv[1] <= 0)
+		return -1;
+	r->ring.in = ts_ring_map(r->ring.recv[0], &r->ring.inSize);
+	close(r->ring.recv[0]);
+	r->ring.recv[0] = 0;
+	if (!r->ring.in)
+		return -1;
+	r->ring.peer = r->ring.recv[1];
+	r->ring.recv[1] = 0;
+
+	// the caller drops the connection, the next one won't ask for rings
+	data_ring_remote_p b = malloc(sizeof(data_ring_remote_t));
+	if (!b)
+		return -1;
+	memset(b, 0, sizeof(*b));
+	b->owner = r;
+	b->remote.mux = r->mux;
+	b->remote.socket = r->ring.bell;
+	b->remote.data_read = data_ring_bell;
+	if (ts_mux_register(&b->remote)) {
+		free(b);
+		return -1;
+	}
+	r->ring.remote = &b->remote;
+	r->ring.up = 1;
+	// nothing to reap there
+	r->zerocopy.enabled = 0;
+	return 0;
+}
+
+/*
+ * Flush, the same as sendmsg() would on a socket
+ */
+static ssize_t
+data_ring_send(
+		struct ts_remote_t * r,
+		struct iovec * iov,
+		int count )
+{
+	ssize_t total = 0;
+	int i;
+	for (i = 0; i < count; i++) {
+		int n = ts_ring_write(r->ring.out, r->ring.outSize,
+				iov[i].iov_base, iov[i].iov_len);
+		if (n < 0) {
+			errno = EPIPE;
+			return -1;
+		}
+		total += n;
+		if (n < (int)iov[i].iov_len)
+			break;
+	}
+	// full; if it still is, the peer rings us when it makes room
+	if (i < count && ts_ring_full(r->ring.out, r->ring.outSize))
+		r->ring.full = 1;
+	if (!total) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if (ts_ring_wake_reader(r->ring.out))
+		ts_ring_bell(r->ring.peer);
+	return total;
+}
+
+static int
+data_udp_listen(
+		struct ts_remote_t * r);
+
+/*
+ * This is called when the socket has been truly established.
+ * Theoricaly, we could use the existing system to buffer & send
+ * our message, but since we /just started/ we can assume there's
+ * a few bytes free in the socket's buffer for a write() to work!
+ */
+static int
+connect_established(
+		struct ts_remote_t * r)
+{
+	V1("Outgoing connection established (%s)\n", __func__);
+	data_prealloc(r);
+	data_busy_poll(r);
+	data_notsent_lowat(r);
+	data_zerocopy_init(r);
+	ts_display_p d = r->display;
+	char msg[320];
+	// room for what goes after the name, "ux%xtx%x", "rx%x" and "mx%x"
+	const int tail = 2 + 4 + 2 + 8 + 2 * (2 + 8);
+	// cut the name and placement short, rather than what follows them
+	int l = snprintf(msg, sizeof(msg) - tail, "Cvx%xw%dh%dn%.*s:p%.*s:", TS_MUX_VERSION,
+			d->bounds.w, d->bounds.h, 128, d->name,
+			64, d->param ? d->param : "");
+	if (l > (int)sizeof(msg) - tail - 1)
+		l = sizeof(msg) - tail - 1;
+	// offer the UDP side channel, last, older servers stop parsing there
+	int port = r->mux->udp && r->addr.sa.sa_family == AF_INET ?
+			data_udp_listen(r) : 0;
+	if (port > 0)
+		l += snprintf(msg + l, sizeof(msg) - l, "ux%xtx%x", port, r->udp.token);
+	// and ask for our display back, if we had one
+	if (r->session)
+		l += snprintf(msg + l, sizeof(msg) - l, "rx%x", r->session);
+	uint32_t ring = data_ring_offer(r);
+	if (ring)
+		l += snprintf(msg + l, sizeof(msg) - l, "mx%x", ring);
+	data_ring_handshake(r, msg, l + 1);
+	return 0;
+}
+
+/*
+ * Is there a clipboard chunk we are allowed to send, and room to queue it
+ */
+static int
+data_xfer_ready(
+		struct ts_remote_t * r)
+{
+	return r->xfer && r->version >= 3 && !r->bulk.head &&
+			r->xfer->offset < r->xfer->limit;
+}
+
+/*
+ * If the outgoing socket is not established, do not
+ * try to register for read events, it won't work
+ */
+static int
+connect_can_read(
+		struct ts_remote_t * r)
+{
+	if (r->state == skt_state_Connect) {
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Check to see whether we want to write anything. It could be
+ * + That we are still establishing the connection, therefore we
+ *   need to register for this event as per select() requirement
+ * + We have an outgoing buffer that still has some data not sent
+ *   from the last time we tried to send it
+ * + There are new events in the FIFO to convert into packets
+ */
+static int
+connect_can_write(
+		struct ts_remote_t * r)
+{
+	if (r->state == skt_state_Connect) {
+		return 1;
+	}
+	// the batching timer will send it, or the peer will ring for more
+	if (ts_mux_timer_armed(&r->flush) || r->ring.full)
+		return 0;
+	if (r->out_len || r->motion.x || r->motion.y || data_xfer_ready(r))
+		return 1;
+	// check fifo...
+	if (!r->proxy)
+		return 0;
+
+	return ts_display_proxy_pending(r->proxy);
+}
+
+/*
+ * The master, and the main display, are only touched from the main mux
+ * thread; remotes on other shards hand these over with ts_mux_call()
+ */
+static void
+data_display_attach(
+		ts_mux_p mux,
+		void * a,
+		void * server)
+{
+	ts_display_p d = a;
+	ts_master_display_add(mux->master, d);
+	if (!server)
+		ts_display_place(ts_master_get_main(mux->master), d, d->param);
+	else
+		// we're a client, we still attach a screen for the "server",
+		// so the mouse warp is easier
+		ts_display_place(d, ts_master_get_main(mux->master), d->param);
+}
+
+static void
+data_display_detach(
+		ts_mux_p mux,
+		void * a,
+		void * b)
+{
+	ts_display_p d = a;
+	ts_master_display_remove(mux->master, d);
+}
+
+/*
+ * A clipboard packet, with it's parameters copied, so it can be applied
+ * to the target display from the main mux
+ */
+typedef struct data_clipboard_op_t {
+	char kind;
+	char * name;
+	char * flavor;
+	size_t size;
+	uint8_t data[0];
+} data_clipboard_op_t, *data_clipboard_op_p;
+
+static void
+data_clipboard_apply(
+		ts_mux_p mux,
+		void * a,
+		void * b)
+{
+	data_clipboard_op_p op = a;
+	ts_display_p target = op->name ?
+			ts_master_display_get(mux->master, op->name) :
+			ts_master_get_main(mux->master);
+	if (target) {
+		switch (op->kind) {
+			case 'c':
+				ts_clipboard_clear(&target->clipboard);
+				break;
+			case 'f':
+				ts_clipboard_add(&target->clipboard, op->flavor, op->data, op->size);
+				break;
+			case 's':
+				ts_display_setclipboard(
+					ts_master_get_main(mux->master),
+					&target->clipboard);
+				break;
+		}
+	}
+	free(op);
+}
+
+static void
+data_clipboard_op(
+		struct ts_remote_t * r,
+		char kind,
+		char * name,
+		char * flavor,
+		uint8_t * data,
+		size_t size)
+{
+	size_t nl = name ? strlen(name) + 1 : 0;
+	size_t fl = flavor ? strlen(flavor) + 1 : 0;
+	data_clipboard_op_p op = malloc(sizeof(*op) + size + nl + fl);
+	if (!op)
+		return;
+	op->kind = kind;
+	op->size = size;
+	if (size)
+		memcpy(op->data, data, size);
+	op->name = nl ? memcpy(op->data + size, name, nl) : NULL;
+	op->flavor = fl ? memcpy(op->data + size + nl, flavor, fl) : NULL;
+	ts_mux_call(ts_mux_main(r->mux), data_clipboard_apply, op, NULL);
+}
+
+/*
+ * This is called when an incoming socket has been established (from the listen one)
+ * It means we are a 'server' and therefore we send a 'server' packet quickly
+ * with the geometry of the screen
+ */
+static int
+data_start(
+		struct ts_remote_t * r)
+{
+	r->socket = r->accept_socket;
+	V2("%s Incoming connection socket %d\n", __func__, r->socket);
+	{	// make it nonblocking, we read and write until EAGAIN
+		int flags = fcntl(r->socket, F_GETFL, 0);
+		fcntl(r->socket, F_SETFL, flags | O_NONBLOCK);
+	}
+	data_prealloc(r);
+	data_busy_poll(r);
+	data_notsent_lowat(r);
+	data_keepalive(r);
+	data_zerocopy_init(r);
+	ts_display_p d = ts_master_get_main(r->mux->master);
+	// a new session for each connection, the client can resume it later
+	static uint32_t sessions;
+	do {
+		r->session = ((uint32_t)_ts_mux_now_us() ^ ((uint32_t)getpid() << 16)) +
+				__sync_add_and_fetch(&sessions, 1) * 0x9e3779b9;
+	} while (!r->session);
+	char msg[320];
+	// room for what goes after the name, "rx%x" and "mx%x"
+	const int tail = 2 * (2 + 8);
+	int l = snprintf(msg, sizeof(msg) - tail, "Svx%xw%dh%dn%.*s:", TS_MUX_VERSION,
+			d->bounds.w, d->bounds.h, 128, d->name);
+	if (l > (int)sizeof(msg) - tail - 1)
+		l = sizeof(msg) - tail - 1;
+	l += snprintf(msg + l, sizeof(msg) - l, "rx%x", r->session);
+	uint32_t ring = data_ring_offer(r);
+	if (ring)
+		l += snprintf(msg + l, sizeof(msg) - l, "mx%x", ring);
+	data_ring_handshake(r, msg, l + 1);
+	return 0;
+}
+
+static void
+data_session_park(
+		ts_mux_p mux,
+		void * a,
+		void * b);
+
+/*
+ * Same as above for a client display, placed next to 'next' (a display
+ * name, freed here) rather than the main display, if it's there
+ */
+static void
+data_display_attach_next(
+		ts_mux_p mux,
+		void * a,
+		void * next)
+{
+	ts_display_p d = a;
+	ts_display_p to = next ? ts_master_display_get(mux->master, next) : NULL;
+	ts_master_display_add(mux->master, d);
+	ts_display_place(to ? to : ts_master_get_main(mux->master), d, d->param);
+	free(next);
+}
+
+/*
+ * Incoming socket has closed down, we need to tear down any proxy display
+ * we had, clean the buffers, unregister ourselves from the mux and die.
+ */
+static int
+data_restart(
+		struct ts_remote_t * r)
+{
+	V1("Incoming connection to %s terminated (%s)\n",
+			r->display ? r->display->name : "(unknown)",__func__);
+	// the proxy outlives us, make sure it's kicks don't reach us anymore
+	if (r->proxy)
+		r->proxy->target = NULL;
+	// keep it for the client to resume, see data_session_park()
+	ts_mux_session_p s = r->display && r->proxy && r->session ?
+			calloc(1, sizeof(*s)) : NULL;
+	if (s) {
+		s->token = r->session;
+		s->display = r->display;
+		s->proxy = r->proxy;
+		s->xfer = r->xfer;
+		s->pressed = r->pressed;
+		r->xfer = NULL;
+		r->display = NULL;
+		ts_mux_call(ts_mux_main(r->mux), data_session_park, s, NULL);
+	} else if (r->display) {
+		ts_mux_call(ts_mux_main(r->mux), data_display_detach, r->display, NULL);
+		r->display = NULL;
+	}
+	ts_mux_unregister(r);
+	if (r->in)
+		free(r->in);
+	r->in = NULL;
+	r->in_size = r->in_len = r->in_start = r->in_scan = 0;
+	_ts_mux_out_clear(r);
+	_ts_mux_xfer_free(r->xfer);
+	r->xfer = NULL;
+	if (r->udp.socket > 0)
+		close(r->udp.socket);
+	r->udp.socket = 0;
+	data_ring_close(r);
+	data_relay_drop(r);
+	if (r->dispose)
+		r->dispose(r);
+	else {
+		close(r->socket);
+		free(r);
+	}
+	return -1;
+}
+
+
+/*
+ * Check to see wether we want to write anything. It could be
  * + We have an outgoing buffer that still has some data not sent
  *   from the last time we tried to send it
  * + There are new events in the FIFO to convert into packets
  */
-static int
-data_can_write(
-		struct ts_remote_t * r)
+static int
+data_can_write(
+		struct ts_remote_t * r)
+{
+	if (ts_mux_timer_armed(&r->flush) || r->ring.full)
+		return 0;
+	if (r->out_len || r->motion.x || r->motion.y || data_xfer_ready(r) ||
+			r->relay.fanout.frames)
+		return 1;
+	if (!r->proxy)
+		return 0;
+
+	return ts_display_proxy_pending(r->proxy);
+}
+
+/* INTERNAL PACKET DECODING UTILITY
+ * extract one numerical parameter from the string, advance the pointer.
+ * format is either 'xXXXXXX' hex or 'DDDD'
+ */
+static int
+data_get_integer(
+		uint8_t ** o)
+{
+	int hex = 0;
+	int minus = 1;
+	uint8_t *p = *o;
+
+	if (*p == 'x') {
+		hex = 1; p++;
+	} else if (*p == '-') {
+		minus = -1; p++;
+	}
+	int res = 0;
+	if (hex) {
+		while (isxdigit(*p)) {
+			char c = tolower(*p);
+			if (isdigit(c))
+				res = (res << 4) | (c - '0');
+			else
+				res = (res << 4) | (c - 'a' + 10);
+			p++;
+		}
+	} else {
+		while (isdigit(*p)) {
+			res = (res * 10) + (*p - '0');
+			p++;
+		}
+	}
+	*o = p;
+	return res * minus;
+}
+
+/* INTERNAL PACKET DECODING UTILITY
+ * Reads a string, terminated with zero or a specified
+ */
+static char *
+data_get_string(
+		uint8_t **o,
+		char term )
+{
+	uint8_t * p = *o;
+	while (*p && *p != term)
+		p++;
+	if (*p) {
+		*p = 0; p++;
+	}
+	uint8_t * res = *o;
+	*o = p;
+	return (char*)res;
+}
+
+
+/* INTERNAL PACKET UTILITY
+ * The output queue is empty, move the next bulk chunk to it; that is
+ * a segment, and the ones it's glued to.
+ */
+static void
+data_event_bulk_next(
+		struct ts_remote_t * r)
+{
+	ts_mux_seg_p seg;
+	do {
+		seg = r->bulk.head;
+		r->bulk.head = seg->next;
+		seg->next = NULL;
+		if (r->out_tail)
+			r->out_tail->next = seg;
+		else
+			r->out = seg;
+		r->out_tail = seg;
+	} while (seg->glued && r->bulk.head);
+	if (!r->bulk.head)
+		r->bulk.tail = NULL;
+}
+
+/* INTERNAL PACKET UTILITY
+ * Swap the output and bulk queues; the writers only ever queue to 'out',
+ * so this is how they queue bulk data. Call it again to swap them back.
+ */
+static void
+data_event_bulk_swap(
+		struct ts_remote_t * r)
+{
+	ts_mux_seg_p head = r->out, tail = r->out_tail;
+	r->out = r->bulk.head;
+	r->out_tail = r->bulk.tail;
+	r->bulk.head = head;
+	r->bulk.tail = tail;
+}
+
+/* INTERNAL PACKET UTILITY
+ * Attemps to write as much as possible of the output queue to the socket,
+ * in one go. Segments that are sent are freed, a partial one is left
+ * where it is, we just remember how much of it went.
+ * If a big payload is in there, it's sent with MSG_ZEROCOPY, and all
+ * the segments of that send are kept until the kernel is done with them.
+ * return the bytes remaining
+ */
+#define TS_MUX_IOV	64
+
+static void
+data_xfer_pump(
+		struct ts_remote_t * r);
+
+static int
+data_event_write_flush(
+		struct ts_remote_t * r)
+{
+	int nozerocopy = 0;
+
+	data_zerocopy_reap(r);
+	data_relay_fanout_end(r);
+	// a relayed client's own bytes go after what it's link has for it
+	if (r->relay.via && r->out_len) {
+		ts_remote_p link = ts_mux_get_remote(r->mux, r->relay.via);
+		if (link)
+			data_relay_fanout_end(link);
+	}
+	data_xfer_pump(r);
+	while (r->out_len) {
+		if (!r->out)
+			data_event_bulk_next(r);
+		struct iovec iov[TS_MUX_IOV];
+		int count = 0;
+		int flags = TS_MUX_NOSIGNAL;
+		for (ts_mux_seg_p seg = r->out; seg && count < TS_MUX_IOV; seg = seg->next) {
+			if (seg->len == seg->sent)
+				continue;
+			iov[count].iov_base = seg->data + seg->sent;
+			iov[count].iov_len = seg->len - seg->sent;
+#ifdef TS_MUX_ZEROCOPY
+			if (seg->release && iov[count].iov_len >= TS_MUX_ZEROCOPY_MIN &&
+					r->zerocopy.enabled && !nozerocopy)
+				flags |= MSG_ZEROCOPY;
+#endif
+			count++;
+		}
+		struct msghdr msg = { .msg_iov = iov, .msg_iovlen = count };
+		ssize_t ss = r->ring.up ? data_ring_send(r, iov, count) :
+				sendmsg(r->socket, &msg, flags);
+		if (ss < 0) {
+			// out of pinned memory allowance, just copy this time
+			if (errno == ENOBUFS && flags != TS_MUX_NOSIGNAL && !nozerocopy) {
+				nozerocopy = 1;
+				continue;
+			}
+			if (errno != EAGAIN && errno != EINTR)
+				return -1;
+			break;
+		}
+		r->mux->stats.batch.writes++;
+		uint32_t zerocopy = flags != TS_MUX_NOSIGNAL ? ++r->zerocopy.next : 0;
+		r->out_len -= ss;
+		while (r->out && ss >= r->out->len - r->out->sent) {
+			ts_mux_seg_p seg = r->out;
+			ss -= seg->len - seg->sent;
+			r->out = seg->next;
+			seg->next = NULL;
+			if (zerocopy)
+				seg->zerocopy = zerocopy;
+			if (!seg->zerocopy) {
+				_ts_mux_seg_free(r->mux, seg);
+				continue;
+			}
+			if (r->zerocopy.tail)
+				r->zerocopy.tail->next = seg;
+			else
+				r->zerocopy.pending = seg;
+			r->zerocopy.tail = seg;
+		}
+		if (!r->out) {
+			r->out_tail = NULL;
+			// all gone, the next clipboard chunk can be queued
+			data_xfer_pump(r);
+		} else {
+			if (zerocopy && ss)
+				r->out->zerocopy = zerocopy;
+			r->out->sent += ss;
+			break;	// the socket is full
+		}
+	}
+	if (r->relay.blocked && r->out_len < TS_MUX_RELAY_WINDOW)
+		data_relay_unblock(r);
+	return r->out_len;
+}
+
+/* INTERNAL PACKET UTILITY
+ * Tries to make sure there's at least 'size' bytes free at the end of the
+ * queue, and return a pointer to the place we allocated.
+ */
+static uint8_t *
+data_event_write_alloc(
+		struct ts_remote_t * r,
+		int size )
+{
+	ts_mux_seg_p seg = r->out_tail;
+	if (!seg || seg->data != seg->buf || seg->len + size > seg->size) {
+		seg = _ts_mux_seg_new(r->mux, size);
+		if (!seg)
+			return NULL;
+		if (r->out_tail)
+			r->out_tail->next = seg;
+		else
+			r->out = seg;
+		r->out_tail = seg;
+	}
+	*(seg->data + seg->len) = 0;
+	return seg->data + seg->len;
+}
+
+/* INTERNAL PACKET UTILITY
+ * Queue 'len' bytes written at 'buf' (from data_event_write_alloc())
+ */
+static void
+data_event_write_append(
+		struct ts_remote_t * r,
+		uint8_t * buf,
+		int len )
+{
+	r->out_tail->len += len;
+	r->out_len += len;
+}
+
+/* INTERNAL PACKET UTILITY
+ * Queue the zero terminated packet at 'buf'
+ */
+static uint8_t *
+data_event_write_commit(
+		struct ts_remote_t * r,
+		uint8_t * buf )
+{
+	if (!buf || !*buf)
+		return NULL;
+	data_event_write_append(r, buf, strlen((char*)buf) + 1);
+	return NULL;
+}
+
+static void
+data_event_write_release(
+		ts_mux_seg_p seg )
+{
+	ts_clipboard_data_unref(seg->refCon);
+}
+
+/* INTERNAL PACKET UTILITY
+ * A version 2 frame being written. Room for the length is reserved for
+ * the biggest payload we could write, and it's filled when we're done.
+ * 'extra' bytes of payload are not allocated here, they are queued
+ * separately after the frame header.
+ */
+typedef struct data_frame_t {
+	uint8_t * start;
+	uint8_t * p;		// where the payload goes
+	int lsize;			// bytes reserved for the length
+} data_frame_t, *data_frame_p;
+
+static int
+data_frame_begin(
+		struct ts_remote_t * r,
+		data_frame_p f,
+		uint8_t type,
+		uint32_t max,
+		uint32_t extra )
+{
+	f->lsize = ts_wire_size_u(max + extra);
+	f->start = data_event_write_alloc(r, 1 + f->lsize + max);
+	if (!f->start)
+		return -1;
+	f->start[0] = type;
+	f->p = f->start + 1 + f->lsize;
+	return 0;
+}
+
+/*
+ * Queue the frame; the 'extra' bytes must be queued right after it
+ */
+static void
+data_frame_end(
+		struct ts_remote_t * r,
+		data_frame_p f,
+		uint32_t extra )
+{
+	uint32_t len = f->p - f->start - 1 - f->lsize;
+	ts_wire_put_un(f->start + 1, len + extra, f->lsize);
+	data_event_write_append(r, f->start, f->p - f->start);
+}
+
+/* INTERNAL PACKET UTILITY
+ * Queue 'size' bytes of a clipboard flavor from 'offset', by reference;
+ * they are the end of the frame that was just queued
+ */
+static int
+data_event_write_flavor(
+		struct ts_remote_t * r,
+		uint8_t * data,
+		size_t offset,
+		size_t size )
+{
+	ts_mux_seg_p seg = _ts_mux_seg_new(r->mux, 0);
+	if (!seg)
+		return -1;
+	seg->refCon = ts_clipboard_data_ref(data);
+	seg->data = data + offset;
+	seg->len = size;
+	seg->release = data_event_write_release;
+	r->out_tail->glued = 1;
+	r->out_tail->next = seg;
+	r->out_tail = seg;
+	r->out_len += seg->len;
+	return 0;
+}
+
+/*
+ * UDP side channel, see the top of the file. The receiver's socket is
+ * read by a remote of it's own, that knows which connection it's for.
+ */
+typedef struct data_udp_remote_t {
+	ts_remote_t remote;
+	ts_remote_p owner;
+} data_udp_remote_t, *data_udp_remote_p;
+
+/*
+ * Move by the difference with the last position we applied, unless this
+ * one is older; for both 'M' datagrams and 'P' frames
+ */
+static void
+data_udp_apply(
+		struct ts_remote_t * r,
+		uint32_t seq,
+		int32_t x,
+		int32_t y )
+{
+	if ((int32_t)(seq - r->udp.seq) <= 0)
+		return;
+	int dx = x - r->udp.x, dy = y - r->udp.y;
+	r->udp.seq = seq;
+	r->udp.x = x;
+	r->udp.y = y;
+	if (!r->proxy && (dx || dy))
+		ts_display_movemouse(ts_master_get_main(r->mux->master), dx, dy);
+}
+
+/*
+ * Receiver timer, tell the sender the datagrams are getting through
+ */
+static void
+data_udp_ack(
+		ts_mux_p mux,
+		ts_mux_timer_p timer )
+{
+	ts_remote_p r = timer->refCon;
+	data_frame_t f;
+
+	if (r->version < 2 || data_frame_begin(r, &f, 'U', TS_WIRE_VARINT_MAX, 0))
+		return;
+	f.p = ts_wire_put_u(f.p, r->udp.seq);
+	data_frame_end(r, &f, 0);
+	ts_mux_remote_update(r);
+}
+
+static int
+data_udp_read(
+		struct ts_remote_t * u)
+{
+	ts_remote_p r = ((data_udp_remote_p)u)->owner;
+	uint8_t buf[64];
+	ssize_t ss;
+
+	while ((ss = recv(u->socket, buf, sizeof(buf), 0)) > 0) {
+		const uint8_t * p = buf + 1, * end = buf + ss;
+		uint32_t token = 0, seq = 0;
+		int32_t x = 0, y = 0;
+		if (buf[0] != 'M' || r->version < 2)
+			continue;
+		p = ts_wire_get_u(p, end, &token);
+		p = ts_wire_get_u(p, end, &seq);
+		p = ts_wire_get_s(p, end, &x);
+		p = ts_wire_get_s(p, end, &y);
+		if (!p || token != r->udp.token)
+			continue;
+		data_udp_apply(r, seq, x, y);
+		if (!ts_mux_timer_armed(&r->udp.timer))
+			ts_mux_timer_arm(r->mux, &r->udp.timer, ts_mux_now() + TS_MUX_UDP_ACK);
+	}
+	return 0;
+}
+
+/*
+ * Receiver; make sure we have a socket, and a remote reading it, and pick
+ * a new token for this connection. Returns the port, or -1
+ */
+static int
+data_udp_listen(
+		struct ts_remote_t * r)
+{
+	if (!r->udp.remote) {
+		int skt = socket(AF_INET, SOCK_DGRAM, 0);
+		if (skt < 0)
+			return -1;
+		struct sockaddr_in addr = { .sin_family = AF_INET };
+		if (bind(skt, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+			perror("data_udp_listen bind");
+			close(skt);
+			return -1;
+		}
+		{	// make it nonblocking
+			int flags = fcntl(skt, F_GETFL, 0);
+			fcntl(skt, F_SETFL, flags | O_NONBLOCK);
+		}
+		data_udp_remote_p u = malloc(sizeof(data_udp_remote_t));
+		if (!u) {
+			close(skt);
+			return -1;
+		}
+		memset(u, 0, sizeof(*u));
+		u->owner = r;
+		u->remote.mux = r->mux;
+		u->remote.socket = skt;
+		u->remote.data_read = data_udp_read;
+		if (ts_mux_register(&u->remote)) {
+			close(skt);
+			free(u);
+			return -1;
+		}
+		r->udp.remote = &u->remote;
+		r->udp.socket = skt;
+		r->udp.timer.refCon = r;
+		r->udp.timer.callback = data_udp_ack;
+	}
+	struct sockaddr_in addr;
+	socklen_t addrLen = sizeof(addr);
+	if (getsockname(r->udp.socket, (struct sockaddr*)&addr, &addrLen) < 0)
+		return -1;
+	// not a secret, just so datagrams meant for another connection don't match
+	r->udp.token = (uint32_t)_ts_mux_now_us() ^ ((uint32_t)getpid() << 16);
+	r->udp.seq = 0;
+	r->udp.x = r->udp.y = 0;
+	return ntohs(addr.sin_port);
+}
+
+/*
+ * Sender; put the position in a datagram. Returns what send() did
+ */
+static int
+data_udp_datagram(
+		struct ts_remote_t * r)
+{
+	uint8_t buf[1 + (4 * TS_WIRE_VARINT_MAX)], * p = buf;
+	*p++ = 'M';
+	p = ts_wire_put_u(p, r->udp.token);
+	p = ts_wire_put_u(p, ++r->udp.seq);
+	p = ts_wire_put_s(p, r->udp.x);
+	p = ts_wire_put_s(p, r->udp.y);
+	return send(r->udp.socket, buf, p - buf, TS_MUX_NOSIGNAL);
+}
+
+static void
+data_udp_fail(
+		struct ts_remote_t * r,
+		const char * why )
+{
+	V1("Pointer motion for '%s' back on TCP, %s\n",
+			r->display ? r->display->name : "(unknown)", why);
+	r->udp.state = ts_mux_udp_failed;
+	ts_mux_timer_cancel(r->mux, &r->udp.timer);
+}
+
+/*
+ * Sender timer, probe the channel until we hear back, or give up
+ */
+static void
+data_udp_probe(
+		ts_mux_p mux,
+		ts_mux_timer_p timer )
+{
+	ts_remote_p r = timer->refCon;
+
+	if (r->udp.state != ts_mux_udp_probing)
+		return;
+	if (r->udp.seq >= TS_MUX_UDP_PROBES) {
+		data_udp_fail(r, "UDP seems blocked");
+		return;
+	}
+	if (data_udp_datagram(r) < 0 && errno != EAGAIN && errno != ENOBUFS) {
+		data_udp_fail(r, strerror(errno));
+		return;
+	}
+	ts_mux_timer_arm(mux, timer, ts_mux_now() + TS_MUX_UDP_PROBE);
+}
+
+/*
+ * Sender, the receiver asked for motion on UDP 'port' of it's address
+ */
+static void
+data_udp_start(
+		struct ts_remote_t * r,
+		int port,
+		uint32_t token )
+{
+	ts_mux_timer_cancel(r->mux, &r->udp.timer);
+	if (r->udp.socket > 0)
+		close(r->udp.socket);
+	memset(&r->udp, 0, sizeof(r->udp));
+	int skt = socket(AF_INET, SOCK_DGRAM, 0);
+	if (skt < 0)
+		return;
+	{	// make it nonblocking
+		int flags = fcntl(skt, F_GETFL, 0);
+		fcntl(skt, F_SETFL, flags | O_NONBLOCK);
+	}
+	struct sockaddr_in addr = r->addr.in;
+	addr.sin_port = htons(port);
+	if (connect(skt, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		perror("data_udp_start connect");
+		close(skt);
+		return;
+	}
+	V2("%s probing UDP port %d\n", __func__, port);
+	r->udp.socket = skt;
+	r->udp.token = token;
+	r->udp.state = ts_mux_udp_probing;
+	r->udp.timer.refCon = r;
+	r->udp.timer.callback = data_udp_probe;
+	ts_mux_timer_arm(r->mux, &r->udp.timer, ts_mux_now());
+}
+
+/*
+ * Sender, the receiver has seen up to 'seq'
+ */
+static void
+data_udp_acked(
+		struct ts_remote_t * r,
+		uint32_t seq )
+{
+	if (r->udp.state == ts_mux_udp_probing) {
+		V1("Pointer motion for '%s' on UDP\n",
+				r->display ? r->display->name : "(unknown)");
+		r->udp.state = ts_mux_udp_on;
+		ts_mux_timer_cancel(r->mux, &r->udp.timer);
+	}
+	if (r->udp.since && (int32_t)(seq - r->udp.since_seq) >= 0)
+		r->udp.since = 0;
+}
+
+/*
+ * Sender, the position changed; if the receiver hasn't acknowledged
+ * anything for too long, we stop using UDP
+ */
+static void
+data_udp_send(
+		struct ts_remote_t * r)
+{
+	if (data_udp_datagram(r) < 0 && errno != EAGAIN && errno != ENOBUFS) {
+		data_udp_fail(r, strerror(errno));
+		return;
+	}
+	uint64_t now = ts_mux_now();
+	if (!r->udp.since) {
+		r->udp.since = now;
+		r->udp.since_seq = r->udp.seq;
+	} else if (now - r->udp.since > TS_MUX_UDP_TIMEOUT)
+		data_udp_fail(r, "datagrams aren't acknowledged");
+}
+
+/*
+ * Sender, send the position over TCP too, if it's not there yet; this
+ * ends the 'E' frame in 'batch', if any
+ */
+static void
+data_udp_sync(
+		struct ts_remote_t * r,
+		data_frame_p batch )
+{
+	data_frame_t f;
+	if (r->udp.seq == r->udp.synced || r->udp.state < ts_mux_udp_on)
+		return;
+	if (batch->start)
+		data_frame_end(r, batch, 0);
+	batch->start = NULL;
+	if (data_frame_begin(r, &f, 'P', 3 * TS_WIRE_VARINT_MAX, 0))
+		return;
+	f.p = ts_wire_put_u(f.p, r->udp.seq);
+	f.p = ts_wire_put_s(f.p, r->udp.x);
+	f.p = ts_wire_put_s(f.p, r->udp.y);
+	data_frame_end(r, &f, 0);
+	r->udp.synced = r->udp.seq;
+}
+
+/*
+ * Heartbeats, version 4. A ping or a pong is sent right away, so the
+ * batching delay isn't counted in the round trip time.
+ */
+static void
+data_heartbeat_write(
+		struct ts_remote_t * r,
+		uint8_t type,
+		uint32_t stamp )
+{
+	data_frame_t f;
+	if (data_frame_begin(r, &f, type, TS_WIRE_VARINT_MAX, 0))
+		return;
+	f.p = ts_wire_put_u(f.p, stamp);
+	data_frame_end(r, &f, 0);
+	ts_mux_timer_cancel(r->mux, &r->flush);
+	ts_mux_remote_update(r);
+}
+
+/*
+ * Drop the connection if the peer has been quiet for too long, or ping it,
+ * and come back when it's due for the next ping, or to be dropped
+ */
+static void
+data_heartbeat(
+		ts_mux_p mux,
+		ts_mux_timer_p timer )
+{
+	ts_remote_p r = timer->refCon;
+	uint64_t now = ts_mux_now();
+	if (now - r->heard >= mux->heartbeat) {
+		char addr[128];
+		V1("%s nothing from %s for %ums, dropping it\n", __func__,
+				_ts_mux_addr_name(r, addr, sizeof(addr)),
+				(uint32_t)(now - r->heard));
+		if (r->restart)
+			r->restart(r);
+		return;
+	}
+	data_heartbeat_write(r, 'H', (uint32_t)_ts_mux_now_us());
+	uint64_t when = now + mux->heartbeat / 3;
+	if (when > r->heard + mux->heartbeat)
+		when = r->heard + mux->heartbeat;
+	ts_mux_timer_arm(mux, timer, when);
+}
+
+static void
+data_heartbeat_start(
+		struct ts_remote_t * r)
+{
+	if (!r->mux->heartbeat || r->version < 4)
+		return;
+	// a relayed client is pinged by it's relay, and we ping the relay
+	if (r->relay.via)
+		return;
+	memset(&r->rtt, 0, sizeof(r->rtt));
+	r->heard = ts_mux_now();
+	r->heartbeat.refCon = r;
+	r->heartbeat.callback = data_heartbeat;
+	// the first ping goes now, the batching wants the round trip time
+	ts_mux_timer_arm(r->mux, &r->heartbeat, r->heard);
+}
+
+/*
+ * A pong is back, 'stamp' is when we sent the ping
+ */
+static void
+data_heartbeat_pong(
+		struct ts_remote_t * r,
+		uint32_t stamp )
+{
+	uint32_t rtt = (uint32_t)_ts_mux_now_us() - stamp;
+	if (!r->rtt.count) {
+		r->rtt.min = r->rtt.srtt = rtt;
+		r->rtt.var = rtt / 2;
+	} else {
+		uint32_t delta = rtt > r->rtt.srtt ? rtt - r->rtt.srtt : r->rtt.srtt - rtt;
+		r->rtt.var = r->rtt.var - r->rtt.var / 4 + delta / 4;
+		r->rtt.srtt = r->rtt.srtt - r->rtt.srtt / 8 + rtt / 8;
+		if (rtt < r->rtt.min)
+			r->rtt.min = rtt;
+	}
+	if (r->rtt.count < UINT32_MAX)
+		r->rtt.count++;
+	V3("%s rtt %uus srtt %uus var %uus\n", __func__, rtt, r->rtt.srtt, r->rtt.var);
+}
+
+/*
+ * Version 3 clipboards are streamed, see the top of the file. The flavors
+ * are sent by reference, and only one chunk at a time is queued, when the
+ * bulk queue is empty, so nothing here grows with the clipboard size.
+ * Announce r->xfer, and wait for the 'A' telling us where to start from.
+ */
+static void
+data_xfer_announce(
+		struct ts_remote_t * r)
+{
+	ts_mux_xfer_p x = r->xfer;
+	data_frame_t f;
+
+	x->offset = x->limit = 0;
+	uint32_t max = (3 * TS_WIRE_VARINT_MAX) + strlen(x->name);
+	for (int i = 0; i < x->flavorCount; i++)
+		max += (2 * TS_WIRE_VARINT_MAX) + strlen(x->flavor[i].name);
+	if (data_frame_begin(r, &f, 'T', max, 0))
+		return;
+	f.p = ts_wire_put_u(f.p, x->id);
+	f.p = ts_wire_put_str(f.p, x->name);
+	f.p = ts_wire_put_u(f.p, x->flavorCount);
+	for (int i = 0; i < x->flavorCount; i++) {
+		f.p = ts_wire_put_str(f.p, x->flavor[i].name);
+		f.p = ts_wire_put_u(f.p, x->flavor[i].size);
+	}
+	data_frame_end(r, &f, 0);
+	V2("%s clipboard '%s' id %u, %u bytes\n", __func__, x->name, x->id, x->size);
+}
+
+/*
+ * Queue the next chunk of r->xfer in the bulk queue, if the window
+ * allows it. Chunks never straddle two flavors.
+ */
+static void
+data_xfer_pump(
+		struct ts_remote_t * r)
+{
+	if (!data_xfer_ready(r))
+		return;
+	ts_mux_xfer_p x = r->xfer;
+	uint32_t start = 0;
+	int i = 0;
+	while (start + x->flavor[i].size <= x->offset)
+		start += x->flavor[i++].size;
+	uint32_t size = start + x->flavor[i].size - x->offset;
+	if (size > TS_MUX_CHUNK)
+		size = TS_MUX_CHUNK;
+	if (size > x->limit - x->offset)
+		size = x->limit - x->offset;
+
+	data_frame_t f;
+	data_event_bulk_swap(r);
+	if (!data_frame_begin(r, &f, 'D',
+			(3 * TS_WIRE_VARINT_MAX) + strlen(x->name), size)) {
+		f.p = ts_wire_put_str(f.p, x->name);
+		f.p = ts_wire_put_u(f.p, x->id);
+		f.p = ts_wire_put_u(f.p, x->offset);
+		data_frame_end(r, &f, size);
+		if (!data_event_write_flavor(r, x->flavor[i].data, x->offset - start, size))
+			x->offset += size;
+	}
+	data_event_bulk_swap(r);
+}
+
+/*
+ * The receiver stored our data up to 'offset', and lets us send 'window'
+ * more. The first one after 'T' is where it wants us to (re)start from.
+ */
+static void
+data_xfer_acked(
+		struct ts_remote_t * r,
+		uint32_t id,
+		uint32_t offset,
+		uint32_t window )
+{
+	ts_mux_xfer_p x = r->xfer;
+	if (!x || x->id != id || offset > x->size)
+		return;
+	if (offset == x->size) {
+		V2("%s clipboard '%s' id %u done\n", __func__, x->name, x->id);
+		_ts_mux_xfer_free(x);
+		r->xfer = NULL;
+		return;
+	}
+	if (offset > x->offset) {
+		V1("%s clipboard '%s' resumed at %u/%u\n", __func__,
+				x->name, offset, x->size);
+		x->offset = offset;
+	}
+	uint32_t limit = window < x->size - offset ? offset + window : x->size;
+	if (limit > x->limit)
+		x->limit = limit;
+}
+
+/*
+ * This look for text in a clipboard, and generate packets to
+ * + clear remote clipboard named 'name'
+ * + set the text flavors
+ * + set the clipboard once it is fully sent
+ */
+static void
+data_event_write_clipboard(
+		struct ts_remote_t * r,
+		ts_clipboard_p clipboard,
+		char * name)
+{
+	int nl = strlen(name);
+	data_frame_t f;
+
+	if (r->version >= 3) {
+		/*
+		 * Any previous transfer is abandoned, the receiver drops it
+		 * when it sees the new one under the same name
+		 */
+		static volatile uint32_t id = 0;
+		ts_mux_xfer_p x = calloc(1, sizeof(*x));
+		if (!x)
+			return;
+		x->id = __sync_add_and_fetch(&id, 1);
+		snprintf(x->name, sizeof(x->name), "%s", name);
+		for (int i = 0; i < clipboard->flavorCount; i++) {
+			snprintf(x->flavor[i].name, sizeof(x->flavor[i].name), "%s",
+					clipboard->flavor[i].name);
+			x->flavor[i].size = clipboard->flavor[i].size;
+			x->flavor[i].data = ts_clipboard_data_ref(clipboard->flavor[i].data);
+			x->size += x->flavor[i].size;
+			x->flavorCount++;
+		}
+		_ts_mux_xfer_free(r->xfer);
+		r->xfer = x;
+		data_xfer_announce(r);
+		return;
+	}
+	if (r->version >= 2) {
+		/*
+		 * It all goes in the bulk queue, and the flavors are split in
+		 * TS_MUX_CHUNK frames, the other end appends them together
+		 */
+		data_event_bulk_swap(r);
+		if (data_frame_begin(r, &f, 'c', TS_WIRE_VARINT_MAX + nl, 0))
+			goto done;
+		f.p = ts_wire_put_str(f.p, name);
+		data_frame_end(r, &f, 0);
+		// any flavor goes, they are sent as is
+		for (int i = 0; i < clipboard->flavorCount; i++) {
+			int fl = strlen(clipboard->flavor[i].name);
+			size_t offset = 0;
+			do {
+				size_t size = clipboard->flavor[i].size - offset;
+				if (size > TS_MUX_CHUNK)
+					size = TS_MUX_CHUNK;
+				if (data_frame_begin(r, &f, 'f',
+						(2 * TS_WIRE_VARINT_MAX) + nl + fl, size))
+					goto done;
+				f.p = ts_wire_put_str(f.p, name);
+				f.p = ts_wire_put_str(f.p, clipboard->flavor[i].name);
+				data_frame_end(r, &f, size);
+				if (size && data_event_write_flavor(r,
+						clipboard->flavor[i].data, offset, size))
+					goto done;
+				offset += size;
+			} while (offset < clipboard->flavor[i].size);
+		}
+		if (data_frame_begin(r, &f, 's', TS_WIRE_VARINT_MAX + nl, 0))
+			goto done;
+		f.p = ts_wire_put_str(f.p, name);
+		data_frame_end(r, &f, 0);
+	done:
+		data_event_bulk_swap(r);
+		return;
+	}
+	uint8_t * buf = data_event_write_alloc(r, 16 + nl);
+	sprintf((char*)buf, "cn%s", name);
+	buf = data_event_write_commit(r, buf);
+	for (int i = 0; i < clipboard->flavorCount; i++)
+		if (!strncmp(clipboard->flavor[i].name, "text", 4)) {
+			/*
+			 * The header goes with the other packets, the payload, and
+			 * it's terminating zero, are sent from the flavor buffer
+			 */
+			buf = data_event_write_alloc(r,
+					32 + nl + strlen(clipboard->flavor[i].name));
+			if (!buf)
+				return;
+			data_event_write_append(r, buf, sprintf((char*)buf, "fn%s:F%s:D",
+					name, clipboard->flavor[i].name));
+			if (data_event_write_flavor(r, clipboard->flavor[i].data, 0,
+					clipboard->flavor[i].size + 1))
+				return;
+		}
+	buf = data_event_write_alloc(r, 16 + nl);
+	sprintf((char*)buf, "sn%s", name);
+	buf = data_event_write_commit(r, buf);
+}
+
+/*
+ * Version 2 of the event packets, see the top of the file. The input
+ * events go in 'E' frames, this does the others.
+ */
+static void
+data_event_write_frame(
+		struct ts_remote_t * r,
+		ts_display_proxy_event_t * e)
+{
+	data_frame_t f;
+	char * name = NULL;
+
+	switch (e->event) {
+		case ts_proxy_enter:
+			if (data_frame_begin(r, &f, 'e', 2 * TS_WIRE_VARINT_MAX, 0))
+				return;
+			f.p = ts_wire_put_s(f.p, r->display->mousex);
+			f.p = ts_wire_put_s(f.p, r->display->mousey);
+			break;
+		case ts_proxy_leave:
+			if (data_frame_begin(r, &f, 'l', 0, 0))
+				return;
+			break;
+		case ts_proxy_getclipboard:
+			name = ts_master_get_main(r->mux->master)->name;
+			if (data_frame_begin(r, &f, 'g', TS_WIRE_VARINT_MAX + strlen(name), 0))
+				return;
+			f.p = ts_wire_put_str(f.p, name);
+			break;
+		case ts_proxy_setclipboard:
+			if (e->u.clipboard && e->u.clipboard->flavorCount)
+				data_event_write_clipboard(r,
+						e->u.clipboard, ts_master_get_main(r->mux->master)->name);
+			return;
+		default:
+			return;
+	}
+	data_frame_end(r, &f, 0);
+}
+
+/*
+ * Kind of each event in an 'E' frame, in the low bits of its first varint
+ */
+enum {
+	data_event_motion = 0,
+	data_event_button,
+	data_event_key,
+	data_event_wheel,
+};
+#define TS_MUX_EVENT_HEAD(_value, _down, _kind) \
+		(((uint32_t)(_value) << 3) | ((_down) << 2) | (_kind))
+#define TS_MUX_EVENT_BATCH	1024	// max payload of an 'E' frame
+#define TS_MUX_SHARED_COPY	256		// shared frames up to that are copied
+
+/*
+ * Encode an input event, as it goes in an 'E' frame, at 'p', there is
+ * room for 3 varints. Returns the end, or NULL for any other event
+ */
+static uint8_t *
+data_event_encode(
+		uint8_t * p,
+		const ts_display_proxy_event_t * e)
+{
+	switch (e->event) {
+		case ts_proxy_mouse:
+			p = ts_wire_put_u(p, TS_MUX_EVENT_HEAD(
+					ts_wire_zigzag(e->u.mouse.x), 0, data_event_motion));
+			p = ts_wire_put_s(p, e->u.mouse.y);
+			break;
+		case ts_proxy_button:
+			p = ts_wire_put_u(p, TS_MUX_EVENT_HEAD(
+					e->u.button, e->down, data_event_button));
+			break;
+		case ts_proxy_key:
+			p = ts_wire_put_u(p, TS_MUX_EVENT_HEAD(
+					e->u.key, e->down, data_event_key));
+			break;
+		case ts_proxy_wheel:
+			p = ts_wire_put_u(p, TS_MUX_EVENT_HEAD(
+					ts_wire_zigzag(e->u.wheel.wheel), 0, data_event_wheel));
+			p = ts_wire_put_s(p, e->u.wheel.x);
+			p = ts_wire_put_s(p, e->u.wheel.y);
+			break;
+		default:
+			return NULL;
+	}
+	return p;
+}
+
+ts_mux_frame_p
+ts_mux_frame_new(
+		const struct ts_display_proxy_event_t * e )
+{
+	uint8_t ev[3 * TS_WIRE_VARINT_MAX];
+	uint8_t * p = data_event_encode(ev, e);
+	if (!p)
+		return NULL;
+	// that's less than 128 bytes, so the length is one byte
+	ts_mux_frame_p f = malloc(sizeof(*f) + 2 + (p - ev));
+	if (!f)
+		return NULL;
+	f->ref = 1;
+	f->len = 2 + (p - ev);
+	f->data[0] = 'E';
+	f->data[1] = p - ev;
+	memcpy(f->data + 2, ev, p - ev);
+	return f;
+}
+
+void
+ts_mux_frame_unref(
+		ts_mux_frame_p f )
+{
+	if (f && __sync_sub_and_fetch(&f->ref, 1) == 0)
+		free(f);
+}
+
+static void
+data_event_write_unshare(
+		ts_mux_seg_p seg )
+{
+	ts_mux_frame_unref(seg->refCon);
+}
+
+/*
+ * Add 'n' bytes of encoded events to the 'E' frame in 'batch', starting
+ * a new one if needed
+ */
+static void
+data_event_batch_add(
+		struct ts_remote_t * r,
+		data_frame_p batch,
+		const uint8_t * ev,
+		int n)
+{
+	if (batch->start && batch->p + n >
+			batch->start + 1 + batch->lsize + TS_MUX_EVENT_BATCH) {
+		data_frame_end(r, batch, 0);
+		batch->start = NULL;
+	}
+	if (!batch->start &&
+			data_frame_begin(r, batch, 'E', TS_MUX_EVENT_BATCH, 0))
+		return;
+	memcpy(batch->p, ev, n);
+	batch->p += n;
+}
+
+static int
+data_relay_fanout(
+		struct ts_remote_t * r,
+		data_frame_p batch,
+		ts_mux_frame_p frame);
+
+/*
+ * Queue a frame a group encoded, taking over the reference the event had.
+ * An event is a few bytes, they are cheaper copied in the batch, next to
+ * the others, than sent in a segment of their own; only a big frame is
+ * worth queueing by reference. A relayed client's goes to it's relay,
+ * once for all the clients there, if it can.
+ */
+static void
+data_event_write_shared(
+		struct ts_remote_t * r,
+		data_frame_p batch,
+		ts_mux_frame_p frame)
+{
+	if (r->relay.via && !data_relay_fanout(r, batch, frame))
+		return;
+	if (frame->len <= TS_MUX_SHARED_COPY) {
+		// after the 'E', and it's one byte length, see ts_mux_frame_new()
+		data_event_batch_add(r, batch, frame->data + 2, frame->len - 2);
+		ts_mux_frame_unref(frame);
+		return;
+	}
+	if (batch->start)
+		data_frame_end(r, batch, 0);
+	batch->start = NULL;
+	ts_mux_seg_p seg = _ts_mux_seg_new(r->mux, 0);
+	if (!seg) {
+		ts_mux_frame_unref(frame);
+		return;
+	}
+	seg->refCon = frame;
+	seg->data = frame->data;
+	seg->len = frame->len;
+	seg->release = data_event_write_unshare;
+	if (r->out_tail)
+		r->out_tail->next = seg;
+	else
+		r->out = seg;
+	r->out_tail = seg;
+	r->out_len += seg->len;
+}
+
+/*
+ * Add an event to the version 2 'E' frame in 'batch', starting one if
+ * needed; anything but an input event ends it, and goes in it's own frame.
+ */
+static void
+data_event_write_batch(
+		struct ts_remote_t * r,
+		data_frame_p batch,
+		ts_display_proxy_event_t * e)
+{
+	uint8_t ev[3 * TS_WIRE_VARINT_MAX];
+	uint8_t * p = data_event_encode(ev, e);
+
+	if (!p) {
+		if (batch->start)
+			data_frame_end(r, batch, 0);
+		batch->start = NULL;
+		data_event_write_frame(r, e);
+		return;
+	}
+	data_event_batch_add(r, batch, ev, p - ev);
+}
+
+/*
+ * Version 1 of the event packets, one zero terminated string each
+ */
+static void
+data_event_write_packet(
+		struct ts_remote_t * r,
+		ts_display_proxy_event_t * e)
+{
+	uint8_t * buf = NULL;
+
+	switch (e->event) {
+		case ts_proxy_enter:
+			buf = data_event_write_alloc(r, 32);
+			sprintf((char*)buf, "ex%dy%d",
+					r->display->mousex, r->display->mousey);
+			V3("%s: %s\n", __func__, (char*)buf);
+			break;
+		case ts_proxy_leave:
+			buf = data_event_write_alloc(r, 8);
+			sprintf((char*)buf, "l");
+			break;
+		case ts_proxy_mouse:
+			buf = data_event_write_alloc(r, 32);
+			sprintf((char*)buf, "mx%dy%d",
+				(int)e->u.mouse.x,  (int)e->u.mouse.y);
+			break;
+		case ts_proxy_button:
+			buf = data_event_write_alloc(r, 32);
+			sprintf((char*)buf, "bb%dd%d",
+				(int)e->u.button, (int)e->down);
+			break;
+		case ts_proxy_key:
+			buf = data_event_write_alloc(r, 32);
+			sprintf((char*)buf, "kd%dkx%04x",
+				(int)e->down, e->u.key);
+			break;
+		case ts_proxy_wheel:
+			buf = data_event_write_alloc(r, 48);
+			sprintf((char*)buf, "wb%dx%dy%d",
+				(int)e->u.wheel.wheel,
+				(int)e->u.wheel.x,(int) e->u.wheel.y);
+			break;
+		case ts_proxy_getclipboard:
+			buf = data_event_write_alloc(r,
+					8 + strlen(ts_master_get_main(r->mux->master)->name));
+			sprintf((char*)buf, "gn%s", ts_master_get_main(r->mux->master)->name);
+			break;
+		case ts_proxy_setclipboard: {
+			if (!e->u.clipboard || !e->u.clipboard->flavorCount)
+				break;
+			data_event_write_clipboard(r,
+					e->u.clipboard, ts_master_get_main(r->mux->master)->name);
+		}	break;
+	}
+	data_event_write_commit(r, buf);
+}
+
+/*
+ * Keep track of the keys and buttons that are down on the other end
+ */
+static void
+data_event_pressed(
+		ts_mux_pressed_t * p,
+		ts_display_proxy_event_t * e)
+{
+	if (e->event == ts_proxy_button && e->u.button < 32) {
+		if (e->down)
+			p->buttons |= 1 << e->u.button;
+		else
+			p->buttons &= ~(1 << e->u.button);
+	} else if (e->event == ts_proxy_key) {
+		int i = 0;
+		while (i < p->count && p->key[i] != e->u.key)
+			i++;
+		if (e->down && i == p->count && p->count < 16)
+			p->key[p->count++] = e->u.key;
+		else if (!e->down && i < p->count)
+			p->key[i] = p->key[--p->count];
+	}
+}
+
+static void
+data_event_write_one(
+		struct ts_remote_t * r,
+		data_frame_p batch,
+		ts_display_proxy_event_t * e)
+{
+	r->mux->stats.batch.events++;
+	data_event_pressed(&r->pressed, e);
+	if (e->frame && r->version >= 2) {
+		data_event_write_shared(r, batch, e->frame);
+		return;
+	}
+	ts_mux_frame_unref(e->frame);
+	if (r->version >= 2)
+		data_event_write_batch(r, batch, e);
+	else
+		data_event_write_packet(r, e);
+}
+
+/*
+ * Write the motion that was held back, if any, in as many events as needed
+ */
+static void
+data_event_write_motion(
+		struct ts_remote_t * r,
+		data_frame_p batch)
+{
+	while (r->motion.x || r->motion.y) {
+		ts_display_proxy_event_t e = { .event = ts_proxy_mouse };
+		int x = r->motion.x, y = r->motion.y;
+		x = x < -TS_PROXY_MOUSE_MAX ? -TS_PROXY_MOUSE_MAX :
+				x > TS_PROXY_MOUSE_MAX ? TS_PROXY_MOUSE_MAX : x;
+		y = y < -TS_PROXY_MOUSE_MAX ? -TS_PROXY_MOUSE_MAX :
+				y > TS_PROXY_MOUSE_MAX ? TS_PROXY_MOUSE_MAX : y;
+		e.u.mouse.x = x;
+		e.u.mouse.y = y;
+		r->motion.x -= x;
+		r->motion.y -= y;
+		data_event_write_one(r, batch, &e);
+	}
+}
+
+static void
+data_event_write_timer(
+		ts_mux_p mux,
+		ts_mux_timer_p timer )
+{
+	ts_remote_p r = timer->refCon;
+
+	data_event_write_flush(r);
+	ts_mux_remote_update(r);
+}
+
+/*
+ * Batching: instead of being written as they come, motion and wheel events
+ * can wait up to mux->batch ms to go in the same write as the following
+ * ones. It only kicks in when the link is slow enough for it to matter;
+ * when nothing is in flight on the socket, the events go right away, like
+ * Nagle would, and the wait never exceeds half the round trip time.
+ * Returns nonzero if the output has to wait for the flush timer.
+ */
+static int
+data_event_write_hold(
+		struct ts_remote_t * r)
+{
+	if (ts_mux_timer_armed(&r->flush))
+		return 1;
+	uint32_t budget = r->mux->batch;
+	if (!budget || !r->out_len || r->out_len >= (int)TS_MUX_SEG_SIZE)
+		return 0;
+	/*
+	 * In us; the heartbeats measure it all the way to the peer's mux, or
+	 * for a relayed client, to it's relay, that's most of the way
+	 */
+	ts_remote_p via = r->relay.via ?
+			ts_mux_get_remote(r->mux, r->relay.via) : NULL;
+	uint32_t rtt = via ? via->rtt.srtt : r->rtt.srtt;
+	int known = (via ? via->rtt.count : r->rtt.count) != 0;
+#if defined(CONFIG_LINUX) && defined(TCP_INFO)
+	struct tcp_info info;
+	socklen_t size = sizeof(info);
+	if (!getsockopt(r->socket, IPPROTO_TCP, TCP_INFO, &info, &size)) {
+		if (!info.tcpi_unacked)
+			return 0;
+		if (!known)
+			rtt = info.tcpi_rtt;
+		known = 1;
+	}
+#endif
+	if (known && budget > rtt / 2000)
+		budget = rtt / 2000;
+	if (!budget)
+		return 0;
+	r->flush.refCon = r;
+	r->flush.callback = data_event_write_timer;
+	ts_mux_timer_arm(r->mux, &r->flush, ts_mux_now() + budget);
+	r->mux->stats.batch.held++;
+	return 1;
+}
+
+/*
+ * Pools the display event fifo, takes the events from there, and packetize
+ * them into an output buffer, they are then sent as fast as the socket will
+ * allow.
+ */
+static int
+data_event_write(
+		struct ts_remote_t * r)
+{
+	/*
+	 * During an outgoing connection to a server, we monitor the socket
+	 * state for a "write event", this is the select() convention
+	 * Once a write event has been received, check for any error, and
+	 * if all is well transform into a normal "data" one...
+	 */
+	if (r->state == skt_state_Connect) {
+		int e = 1;
+		socklen_t s = sizeof(e);
+		// we can ignore error here, on UNIX sockets
+		getsockopt (r->socket, SOL_SOCKET, SO_ERROR, &e, &s);
+	//	printf("data_event_write connection finished error %d\n", e );
+		if (e) {
+			errno = e;
+			perror("connect failed: ");
+			connect_restart(r);
+			return 0;
+		}
+		r->state = skt_state_Data;
+		V2("%s connection established\n", __func__);
+		connect_established(r);
+	}
+	/*
+	 * if there is a buffer with stuff in already, send it off
+	 */
+	int behind = ts_mux_timer_armed(&r->flush) ? 0 : data_event_write_flush(r);
+	if (behind < 0 || !r->proxy)
+		return 0;
+
+	/*
+	 * Empty the fifo, packetize anything we have. Queued motions are
+	 * summed as they are read, and while the socket is full they are
+	 * held back too, so we don't queue up stale positions behind it;
+	 * anything else is queued in order, after the held motion.
+	 */
+	data_frame_t batch = { 0 };
+	int urgent = 0, moved = 0;
+	while (ts_display_proxy_pending(r->proxy)) {
+		ts_display_proxy_event_t e = ts_display_proxy_read(r->proxy);
+		// on UDP, motion doesn't wait for the socket, it's just summed
+		if (e.event == ts_proxy_mouse && r->udp.state == ts_mux_udp_on) {
+			r->udp.x += e.u.mouse.x;
+			r->udp.y += e.u.mouse.y;
+			ts_mux_frame_unref(e.frame);
+			moved = 1;
+			continue;
+		}
+		if (behind && e.event == ts_proxy_mouse) {
+			r->motion.x += e.u.mouse.x;
+			r->motion.y += e.u.mouse.y;
+			ts_mux_frame_unref(e.frame);
+			continue;
+		}
+		// anything but motion and wheel goes out without waiting
+		urgent |= e.event != ts_proxy_mouse && e.event != ts_proxy_wheel;
+		if (moved)
+			data_udp_send(r);
+		moved = 0;
+		data_udp_sync(r, &batch);
+		data_event_write_motion(r, &batch);
+		data_event_write_one(r, &batch, &e);
+	}
+	if (moved)
+		data_udp_send(r);
+	// if that made us give up on UDP, the position goes on TCP
+	if (r->udp.state == ts_mux_udp_failed)
+		data_udp_sync(r, &batch);
+	if (!behind)
+		data_event_write_motion(r, &batch);
+	if (batch.start)
+		data_frame_end(r, &batch, 0);
+	if (!urgent && !behind && data_event_write_hold(r))
+		return 0;
+	ts_mux_timer_cancel(r->mux, &r->flush);
+	/*
+	 * we must have generated packets there, so try to send them now too, instead
+	 * of waiting for another select() event.
+	 */
+	data_event_write_flush(r);
+	return 0;
+}
+
+/*
+ * This is called when our remote master "screen" wants the clipboard;
+ * so we do just that, we serialize it, and we send it off
+ */
+static void ts_mux_remote_setclipboard(struct ts_display_t *d, ts_clipboard_p clipboard)
+{
+	ts_remote_p r = d->driver->refCon;
+	V3("%s\n", __func__);
+
+	data_event_write_clipboard(r, clipboard, d->name);
+	// we're in the mux thread, just tell the poll backend we want to write
+	ts_mux_remote_update(r);
+}
+
+static ts_display_driver_t ts_mux_driver_remote = {
+		.setclipboard = ts_mux_remote_setclipboard,
+};
+
+/*
+ * Receiving side of the clipboard streams. The frames are decoded by the
+ * remote's mux, and handed over to the main one, that owns the transfers
+ * and the displays. Once it has stored the data, the op goes back to the
+ * remote's mux to be acknowledged; so the window also bounds what is in
+ * transit between the two.
+ */
+typedef struct data_xfer_op_t {
+	ts_mux_p mux;			// of the remote, for the ack
+	ts_remote_handle_t handle;
+	ts_mux_xfer_p xfer;		// 'T', the transfer announced
+	char name[256];
+	uint32_t id, offset, size;
+	uint8_t data[0];		// 'D', 'size' bytes of it
+} data_xfer_op_t, *data_xfer_op_p;
+
+static void
+data_xfer_ack(
+		ts_mux_p mux,
+		void * a,
+		void * b)
+{
+	data_xfer_op_p op = a;
+	ts_remote_p r = ts_mux_get_remote(mux, op->handle);
+	data_frame_t f;
+
+	if (r && r->version >= 3 &&
+			!data_frame_begin(r, &f, 'A', 3 * TS_WIRE_VARINT_MAX, 0)) {
+		f.p = ts_wire_put_u(f.p, op->id);
+		f.p = ts_wire_put_u(f.p, op->offset);
+		f.p = ts_wire_put_u(f.p, TS_MUX_WINDOW);
+		data_frame_end(r, &f, 0);
+		ts_mux_remote_update(r);
+	}
+	free(op);
+}
+
+static ts_mux_xfer_p *
+data_xfer_find(
+		ts_mux_p mux,
+		const char * name )
+{
+	ts_mux_xfer_p * x = &mux->xfer;
+	while (*x && strcmp((*x)->name, name))
+		x = &(*x)->next;
+	return x;
+}
+
+static void
+data_xfer_remove(
+		ts_mux_p mux,
+		ts_mux_xfer_p x )
+{
+	ts_mux_xfer_p * l = data_xfer_find(mux, x->name);
+	if (*l == x)
+		*l = x->next;
+	ts_mux_timer_cancel(mux, &x->timer);
+	_ts_mux_xfer_free(x);
+}
+
+static void
+data_xfer_expire(
+		ts_mux_p mux,
+		ts_mux_timer_p timer )
+{
+	ts_mux_xfer_p x = timer->refCon;
+	V1("%s clipboard '%s' dropped at %u/%u\n", __func__,
+			x->name, x->offset, x->size);
+	data_xfer_remove(mux, x);
+}
+
+/*
+ * Set the clipboard if it is complete, or give it some more time, then
+ * send the ack for 'op'
+ */
+static void
+data_xfer_progress(
+		ts_mux_p mux,
+		ts_mux_xfer_p x,
+		data_xfer_op_p op )
+{
+	op->offset = x->offset;
+	if (x->offset == x->size) {
+		ts_display_p target = ts_master_display_get(mux->master, x->name);
+		if (target) {
+			// swap it in, the old one goes with the transfer
+			ts_clipboard_t c = target->clipboard;
+			target->clipboard = x->clipboard;
+			x->clipboard = c;
+			ts_display_setclipboard(ts_master_get_main(mux->master),
+					&target->clipboard);
+		}
+		data_xfer_remove(mux, x);
+	} else
+		ts_mux_timer_arm(mux, &x->timer, ts_mux_now() + TS_MUX_XFER_GRACE);
+	ts_mux_call(op->mux, data_xfer_ack, op, NULL);
+}
+
+/*
+ * 'T' on the main mux; if we have that transfer already, it's resumed
+ */
+static void
+data_xfer_begin(
+		ts_mux_p mux,
+		void * a,
+		void * b)
+{
+	data_xfer_op_p op = a;
+	ts_mux_xfer_p n = op->xfer;
+	ts_mux_xfer_p x = *data_xfer_find(mux, n->name);
+
+	op->xfer = NULL;
+	if (x && x->id == n->id && x->size == n->size) {
+		V1("%s clipboard '%s' resuming at %u/%u\n", __func__,
+				x->name, x->offset, x->size);
+		_ts_mux_xfer_free(n);
+	} else {
+		if (x)
+			data_xfer_remove(mux, x);
+		x = n;
+		x->next = mux->xfer;
+		mux->xfer = x;
+		x->timer.refCon = x;
+		x->timer.callback = data_xfer_expire;
+		// so the flavors are in order, even the empty ones
+		for (int i = 0; i < x->flavorCount; i++)
+			ts_clipboard_add(&x->clipboard, x->flavor[i].name, (uint8_t*)"", 0);
+	}
+	op->id = x->id;
+	data_xfer_progress(mux, x, op);
+}
+
+/*
+ * 'D' on the main mux; data we have already is skipped, and a gap
+ * means we missed something, so that's ignored too
+ */
+static void
+data_xfer_data(
+		ts_mux_p mux,
+		void * a,
+		void * b)
+{
+	data_xfer_op_p op = a;
+	ts_mux_xfer_p x = *data_xfer_find(mux, op->name);
+
+	if (!x || x->id != op->id || op->offset > x->offset) {
+		V1("%s clipboard '%s' id %u unexpected data at %u\n", __func__,
+				op->name, op->id, op->offset);
+		free(op);
+		return;
+	}
+	uint32_t skip = x->offset - op->offset;
+	uint8_t * d = op->data + skip;
+	uint32_t left = op->size > skip ? op->size - skip : 0;
+	uint32_t start = 0;
+	for (int i = 0; i < x->flavorCount && left; i++) {
+		uint32_t end = start + x->flavor[i].size;
+		if (x->offset < end) {
+			uint32_t n = end - x->offset < left ? end - x->offset : left;
+			if (ts_clipboard_add(&x->clipboard, x->flavor[i].name, d, n))
+				break;
+			d += n;
+			left -= n;
+			x->offset += n;
+		}
+		start = end;
+	}
+	data_xfer_progress(mux, x, op);
+}
+
+/*
+ * Decode the clipboard stream frames, see the top of the file
+ */
+static int
+data_process_xfer(
+		struct ts_remote_t * r,
+		uint8_t type,
+		const uint8_t * p,
+		const uint8_t * end )
+{
+	data_xfer_op_p op = NULL;
+	uint32_t id = 0, offset = 0, window = 0;
+
+	switch (type) {
+		case 'T': {
+			ts_mux_xfer_p x = calloc(1, sizeof(*x));
+			uint32_t count = 0;
+			if (!x)
+				return 0;
+			p = ts_wire_get_u(p, end, &x->id);
+			p = ts_wire_get_str(p, end, x->name, sizeof(x->name));
+			p = ts_wire_get_u(p, end, &count);
+			if (count > sizeof(x->flavor) / sizeof(x->flavor[0]))
+				p = NULL;
+			for (uint32_t i = 0; i < count && p; i++) {
+				p = ts_wire_get_str(p, end,
+						x->flavor[i].name, sizeof(x->flavor[i].name));
+				p = ts_wire_get_u(p, end, &x->flavor[i].size);
+				if (x->flavor[i].size > UINT32_MAX - x->size)
+					p = NULL;
+				x->size += x->flavor[i].size;
+				x->flavorCount++;
+			}
+			if (!p || !(op = calloc(1, sizeof(*op)))) {
+				_ts_mux_xfer_free(x);
+				return p ? 0 : -1;
+			}
+			op->xfer = x;
+		}	break;
+		case 'D': {
+			char name[256];
+			p = ts_wire_get_str(p, end, name, sizeof(name));
+			p = ts_wire_get_u(p, end, &id);
+			p = ts_wire_get_u(p, end, &offset);
+			if (!p)
+				return -1;
+			op = malloc(sizeof(*op) + (end - p));
+			if (!op)
+				return 0;
+			memset(op, 0, sizeof(*op));
+			strcpy(op->name, name);
+			op->id = id;
+			op->offset = offset;
+			op->size = end - p;
+			memcpy(op->data, p, op->size);
+		}	break;
+		case 'A':
+			p = ts_wire_get_u(p, end, &id);
+			p = ts_wire_get_u(p, end, &offset);
+			p = ts_wire_get_u(p, end, &window);
+			if (!p)
+				return -1;
+			data_xfer_acked(r, id, offset, window);
+			return 0;
+	}
+	op->mux = r->mux;
+	op->handle = r->handle;
+	ts_mux_call(ts_mux_main(r->mux),
+			type == 'T' ? data_xfer_begin : data_xfer_data, op, NULL);
+	return 0;
+}
+
+/*
+ * A packet, once decoded, whatever version of the protocol it came in
+ */
+/*
+ * Sessions, see the top of the file. The parked displays are owned by the
+ * main mux; a client claiming one is looked up there, and the result is
+ * handed back to the remote's mux to adopt.
+ */
+typedef struct data_session_op_t {
+	ts_mux_p mux;			// of the remote
+	ts_remote_handle_t handle;
+	uint32_t token;			// the client wants back
+	uint32_t fresh;			// the one the connection got
+	ts_mux_session_p session;	// found, if any
+	char * name, * param;
+	char * next;			// display it's placed next to, if not main
+	int w, h;
+} data_session_op_t, *data_session_op_p;
+
+static void
+data_session_expire(
+		ts_mux_p mux,
+		ts_mux_timer_p timer )
 {
-	if (r->out_len)
-		return 1;
-	if (!r->proxy)
-		return 0;
+	ts_mux_session_p s = timer->refCon;
+	ts_mux_session_p * p = &mux->session;
+	while (*p && *p != s)
+		p = &(*p)->next;
+	if (*p)
+		*p = s->next;
+	V1("Client '%s' didn't come back, dropping it's display\n", s->display->name);
+	ts_display_dispose(s->display);
+	_ts_mux_xfer_free(s->xfer);
+	free(s);
+}
+
+/*
+ * Take a client display out of the master, until it's client comes back
+ */
+static void
+data_session_park(
+		ts_mux_p mux,
+		void * a,
+		void * b)
+{
+	ts_mux_session_p s = a;
+	ts_master_p master = mux->master;
 
-	return !proxy_fifo_isempty(&r->proxy->fifo);
+	s->active = master->active == s->display;
+	ts_master_display_detach(master, s->display);
+	s->mousex = master->mousex;
+	s->mousey = master->mousey;
+	s->next = mux->session;
+	mux->session = s;
+	s->timer.refCon = s;
+	s->timer.callback = data_session_expire;
+	ts_mux_timer_arm(mux, &s->timer, ts_mux_now() + TS_MUX_SESSION_GRACE);
+	V2("%s keeping '%s' for it's client\n", __func__, s->display->name);
 }
 
-/* INTERNAL PACKET DECODING UTILITY
- * extract one numerical parameter from the string, advance the pointer.
- * format is either 'xXXXXXX' hex or 'DDDD'
+/*
+ * Back in the remote's mux, with the session if it was found. Either way,
+ * the remote gets a display, and it's proxy sends the events to it.
  */
-static int
-data_get_integer(
-		uint8_t ** o)
+static void
+data_session_adopt(
+		ts_mux_p mux,
+		void * a,
+		void * b)
 {
-	int hex = 0;
-	int minus = 1;
-	uint8_t *p = *o;
+	data_session_op_p op = a;
+	ts_mux_session_p s = op->session;
+	ts_remote_p r = ts_mux_get_remote(mux, op->handle);
 
-	if (*p == 'x') {
-		hex = 1; p++;
-	} else if (*p == '-') {
-		minus = -1; p++;
-	}
-	int res = 0;
-	if (hex) {
-		while (isxdigit(*p)) {
-			char c = tolower(*p);
-			if (isdigit(c))
-				res = (res << 4) | (c - '0');
-			else
-				res = (res << 4) | (c - 'a' + 10);
-			p++;
+	if (!r) {
+		// gone again already, keep it for the next time
+		if (s) {
+			s->token = op->fresh;
+			ts_mux_call(ts_mux_main(mux), data_session_park, s, NULL);
+		}
+	} else if (s) {
+		V1("Client '%s' resumed it's session (%s)\n", op->name, __func__);
+		r->display = s->display;
+		r->proxy = s->proxy;
+		r->proxy->target = r;
+		// it still has these down, as far as it knows
+		data_frame_t batch = { 0 };
+		for (int i = 0; i < 32; i++)
+			if (s->pressed.buttons & (1 << i)) {
+				ts_display_proxy_event_t e = {
+						.event = ts_proxy_button, .u.button = i };
+				data_event_write_one(r, &batch, &e);
+			}
+		for (int i = 0; i < s->pressed.count; i++) {
+			ts_display_proxy_event_t e = {
+					.event = ts_proxy_key, .u.key = s->pressed.key[i] };
+			data_event_write_one(r, &batch, &e);
 		}
+		if (batch.start)
+			data_frame_end(r, &batch, 0);
+		// and the clipboard it was getting, carries on
+		r->xfer = s->xfer;
+		if (r->xfer && r->version >= 3)
+			data_xfer_announce(r);
+		else if (r->xfer) {
+			_ts_mux_xfer_free(r->xfer);
+			r->xfer = NULL;
+		}
+		free(s);
+		ts_mux_remote_update(r);
 	} else {
-		while (isdigit(*p)) {
-			res = (res * 10) + (*p - '0');
-			p++;
+		// we're the server, let's setup a proxy screen to start making packets
+		V1("Setting up new client screen '%s' (%s) \n", op->name, __func__);
+
+		ts_display_driver_p driver = ts_display_proxy_driver(r->mux, NULL);
+		r->proxy = (ts_display_proxy_driver_p)driver;
+		// events queued by the proxy are for us to packetize
+		r->proxy->target = r;
+		ts_display_p new_display = malloc(sizeof(ts_display_t));
+		if (!new_display) {
+			shutdown(r->socket, SHUT_RDWR);
+			goto done;
 		}
+		ts_display_init(new_display, r->mux->master, driver, op->name, op->param);
+		if (r->mux->rt)
+			ts_clipboard_reserve(&new_display->clipboard, 1,
+					r->mux->rt->prealloc);
+		new_display->bounds.w = op->w;
+		new_display->bounds.h = op->h;
+		r->display = new_display;
+		ts_mux_call(ts_mux_main(r->mux), data_display_attach_next,
+				new_display, op->next);
+		op->next = NULL;
 	}
-	*o = p;
-	return res * minus;
+done:
+	free(op->next);
+	free(op->name);
+	free(op->param);
+	free(op);
 }
 
-/* INTERNAL PACKET DECODING UTILITY
- * Reads a string, terminated with zero or a specified
+/*
+ * Main mux, look for the session; if it's there, it's display goes back
+ * in the master, where it was, unless the client screen changed size.
  */
-static char *
-data_get_string(
-		uint8_t **o,
-		char term )
+static void
+data_session_find(
+		ts_mux_p mux,
+		void * a,
+		void * b)
 {
-	uint8_t * p = *o;
-	while (*p && *p != term)
-		p++;
-	if (*p) {
-		*p = 0; p++;
+	data_session_op_p op = a;
+	ts_master_p master = mux->master;
+	ts_mux_session_p * p = &mux->session;
+
+	while (op->token && *p && (*p)->token != op->token)
+		p = &(*p)->next;
+	ts_mux_session_p s = op->token ? *p : NULL;
+	if (s) {
+		*p = s->next;
+		ts_mux_timer_cancel(mux, &s->timer);
+		ts_display_p d = s->display, main = ts_master_get_main(master);
+		ts_display_p next = op->next ? ts_master_display_get(master, op->next) : NULL;
+		int moved = d->bounds.w != op->w || d->bounds.h != op->h;
+		d->bounds.w = op->w;
+		d->bounds.h = op->h;
+		ts_master_display_add(master, d);
+		if (moved)
+			ts_display_place(next ? next : main, d, d->param);
+		// it had the pointer, and nobody touched it since
+		else if (s->active && master->active == main &&
+				master->mousex == s->mousex && master->mousey == s->mousey &&
+				ts_ptinrect(&d->bounds, s->mousex, s->mousey))
+			ts_master_set_active(master, d);
+		/*
+		 * The proxy kicks the remote's mux; nothing was kicked since the
+		 * display was parked, so it can move over to the new one
+		 */
+		s->proxy->remote.mux = op->mux;
+		op->session = s;
 	}
-	uint8_t * res = *o;
-	*o = p;
-	return (char*)res;
+	ts_mux_call(op->mux, data_session_adopt, op, NULL);
+}
+
+/*
+ * Ask the main mux for the session 'token', or a new display; returns -1
+ * if that couldn't even be asked
+ */
+static int
+data_session_claim(
+		struct ts_remote_t * r,
+		uint32_t token,
+		char * name,
+		char * param,
+		int w, int h)
+{
+	data_session_op_p op = calloc(1, sizeof(*op));
+	if (!op)
+		return -1;
+	op->mux = r->mux;
+	op->handle = r->handle;
+	op->token = token;
+	op->fresh = r->session;
+	op->name = strdup(name ? name : "");
+	op->param = param ? strdup(param) : NULL;
+	// a relayed client goes next to it's relay
+	ts_remote_p via = r->relay.via ?
+			ts_mux_get_remote(r->mux, r->relay.via) : NULL;
+	if (via && via->display)
+		op->next = strdup(via->display->name);
+	op->w = w;
+	op->h = h;
+	if (!op->name || ts_mux_call(ts_mux_main(r->mux), data_session_find, op, NULL)) {
+		free(op->next);
+		free(op->name);
+		free(op->param);
+		free(op);
+		return -1;
+	}
+	return 0;
 }
 
+typedef struct data_packet_t {
+	char kind;
+	int v, w, h;
+	int x, y;
+	int b, d;
+	uint16_t k;
+	int u;				// UDP port, for pointer motion
+	uint32_t t;			// and it's token
+	uint32_t r;			// session token
+	uint32_t m;			// shared memory ring size
+	char * param;
+	char * name;
+	char * flavor;
+	uint8_t * data;
+	size_t size;
+} data_packet_t, *data_packet_p;
 
-/* INTERNAL PACKET UTILITY
- * Attemps to write as much as possible from our buffer to the socket.
- * Then move the remaining at the start of the buffer until it's empty
- * return the bytes remaining
+static void
+data_packet_apply(
+		struct ts_remote_t * r,
+		data_packet_p pkt );
+
+/*
+ * Receive a fully formed packet -- refer to the top of the file for a
+ * bit more about the packet format.
+ * One thing of note is that the parameter 'names' is predefined, and the
+ * parser try to decode as many as it can before looking at the data type.
+ * Since many packets share parameter names/type, it makes the code a
+ * lot simpler.
+ */
+static void
+data_process_packet(
+		struct ts_remote_t * r,
+		uint8_t * p,
+		size_t len )
+{
+	data_packet_t pkt = { .kind = *p++ };
+
+//	printf("packet '%s'\n", pkt);
+	/*
+	 * Try to decode all the parameters we find
+	 */
+	int ok = 1;
+	while (*p && ok) {
+		switch (*p) {
+			case 'v': p++; pkt.v = data_get_integer(&p); break; // version
+			case 'w': p++; pkt.w = data_get_integer(&p); break; // width
+			case 'h': p++; pkt.h = data_get_integer(&p); break; // height
+			case 'p': p++; pkt.param = data_get_string(&p, ':'); break; // param
+			case 'n': p++; pkt.name = data_get_string(&p, ':'); break; // name
+			case 'F': p++; pkt.flavor = data_get_string(&p, ':'); break; // flavor string
+			case 'D': p++; pkt.data = (uint8_t*)data_get_string(&p, 0); break; // data, always zero termed
+			case 'x': p++; pkt.x = data_get_integer(&p); break;
+			case 'y': p++; pkt.y = data_get_integer(&p); break;
+			case 'b': p++; pkt.b = data_get_integer(&p); break; // button
+			case 'd': p++; pkt.d = data_get_integer(&p); break; // down/up
+			case 'k': p++; pkt.k = data_get_integer(&p); break; // key (unsigned)
+			case 'u': p++; pkt.u = data_get_integer(&p); break; // UDP port
+			case 't': p++; pkt.t = data_get_integer(&p); break; // UDP token
+			case 'r': p++; pkt.r = data_get_integer(&p); break; // session
+			case 'm': p++; pkt.m = data_get_integer(&p); break; // ring size
+			default: ok = 0;
+		}
+	}
+	if (pkt.data)
+		pkt.size = strlen((char*)pkt.data);
+	data_packet_apply(r, &pkt);
+}
+
+/*
+ * Relays, see the top of the file. Each client of a relay is a tunnel,
+ * a remote for the client's socket on the relay; on the server, for one
+ * end of a socket pair, the other end being a data remote like any other.
+ * A tunnel's bytes are read straight into 'R' frames on the link.
+ */
+enum {
+	data_relay_scan_handshake = 0,	// in the first, text, packet
+	data_relay_scan_wait,			// past it, the version isn't known yet
+	data_relay_scan_framed,
+	data_relay_scan_opaque,			// version 1, or we lost track
+};
+
+/*
+ * Where the frames of a tunnel's stream are, in one direction; a frame,
+ * or it's header, can be split over any number of reads
+ */
+typedef struct data_relay_scan_t {
+	uint8_t state;
+	uint8_t hlen;			// bytes in 'head'
+	uint16_t version;		// in the handshake
+	uint32_t left;			// bytes of the current frame still to come
+	uint8_t head[16];		// start of the handshake, or of a frame header
+} data_relay_scan_t, *data_relay_scan_p;
+
+typedef struct data_relay_remote_t {
+	ts_remote_t remote;
+	ts_remote_p owner;		// the link
+	struct data_relay_remote_t * next;
+	uint32_t id;
+	/*
+	 * On a relay, the frames are followed both ways, so the client's pings
+	 * are answered here instead of by the server; an answer waits for the
+	 * stream to the client to be between frames
+	 */
+	uint8_t scan;
+	uint8_t ponging;
+	uint32_t pong;
+	data_relay_scan_t up, down;
+	/*
+	 * Relayed to the socket, but it didn't take it yet; it's sent from
+	 * 'off', and only moved back to the front when we need the room
+	 */
+	uint8_t * pending;
+	uint32_t off, len, size;
+} data_relay_remote_t, *data_relay_remote_p;
+
+static int
+data_event_read(
+		struct ts_remote_t * r);
+
+static data_relay_remote_p
+data_relay_get(
+		struct ts_remote_t * r,
+		uint32_t id )
+{
+	data_relay_remote_p t = (data_relay_remote_p)r->relay.tunnel;
+	while (t && t->id != id)
+		t = t->next;
+	return t;
+}
+
+/*
+ * Keep 'len' bytes for when the tunnel's socket can take them
  */
 static int
-data_event_write_flush(
+data_relay_pend(
+		data_relay_remote_p t,
+		const uint8_t * data,
+		size_t len )
+{
+	if (t->len - t->off + len > TS_MUX_RELAY_PENDING)
+		return -1;
+	// only worth moving if that frees half of it, otherwise it grows
+	if (t->len + len > t->size && t->off >= t->size / 2) {
+		memmove(t->pending, t->pending + t->off, t->len - t->off);
+		t->len -= t->off;
+		t->off = 0;
+	}
+	if (t->len + len > t->size) {
+		uint32_t news = t->size ? t->size : TS_MUX_IN_SIZE;
+		while (news < t->len + len)
+			news *= 2;
+		uint8_t * p = realloc(t->pending, news);
+		if (!p)
+			return -1;
+		t->pending = p;
+		t->size = news;
+	}
+	memcpy(t->pending + t->len, data, len);
+	t->len += len;
+	ts_mux_remote_update(&t->remote);
+	return 0;
+}
+
+/*
+ * Answer a client's ping, as the server would; if we're in the middle of
+ * a frame to the client, it's answered once that frame is through
+ */
+static void
+data_relay_pong(
+		data_relay_remote_p t,
+		uint32_t stamp )
+{
+	if (t->down.left || t->down.hlen) {
+		t->pong = stamp;
+		t->ponging = 1;
+		return;
+	}
+	uint8_t h[2 + TS_WIRE_VARINT_MAX];
+	uint8_t * p = ts_wire_put_u(h + 2, stamp);
+	h[0] = 'h';
+	h[1] = p - h - 2;
+	t->ponging = 0;
+	// if that fails, the client's data won't fit either, and drops it
+	data_relay_pend(t, h, p - h);
+}
+
+/*
+ * Both handshakes went by; the version they agreed on tells us if what
+ * follows is frames
+ */
+static void
+data_relay_version(
+		data_relay_remote_p t )
+{
+	if (t->up.state != data_relay_scan_wait ||
+			t->down.state != data_relay_scan_wait)
+		return;
+	uint16_t v = t->up.version < t->down.version ?
+			t->up.version : t->down.version;
+	t->up.state = t->down.state = v >= 2 ?
+			data_relay_scan_framed : data_relay_scan_opaque;
+	V2("%s tunnel %u speaks version %d\n", __func__, t->id, v);
+}
+
+/*
+ * Follow the frames in 'len' bytes of a tunnel's stream at 'buf'. From
+ * the client, a ping that is all in there is answered, and cut out; the
+ * number of bytes left is returned.
+ */
+static size_t
+data_relay_scan(
+		data_relay_remote_p t,
+		data_relay_scan_p s,
+		uint8_t * buf,
+		size_t len )
+{
+	size_t i = 0;
+
+	while (i < len) {
+		switch (s->state) {
+			case data_relay_scan_handshake: {
+				uint8_t * zero = memchr(buf + i, 0, len - i);
+				size_t n = (zero ? (size_t)(zero - buf) : len) - i;
+				size_t keep = sizeof(s->head) - 1 - s->hlen;
+				if (keep > n)
+					keep = n;
+				// the version is at the start, "Cvx5..." or "Svx5..."
+				memcpy(s->head + s->hlen, buf + i, keep);
+				s->hlen += keep;
+				i += n;
+				if (!zero)
+					break;
+				i++;
+				s->head[s->hlen] = 0;
+				uint8_t * p = s->head + 2;
+				s->version = s->hlen > 2 && s->head[1] == 'v' ?
+						data_get_integer(&p) : 1;
+				s->hlen = 0;
+				s->state = data_relay_scan_wait;
+				data_relay_version(t);
+			}	break;
+			case data_relay_scan_framed: {
+				if (s->left) {
+					size_t n = len - i < s->left ? len - i : s->left;
+					i += n;
+					s->left -= n;
+					break;
+				}
+				uint32_t flen = 0;
+				const uint8_t * payload = s->hlen ? NULL :
+						ts_wire_get_u(buf + i + 1, buf + len, &flen);
+				if (!payload) {	// a split header, gather it
+					s->head[s->hlen++] = buf[i++];
+					if (s->hlen > 1 &&
+							ts_wire_get_u(s->head + 1, s->head + s->hlen, &flen)) {
+						s->left = flen;
+						s->hlen = 0;
+					} else if (s->hlen > TS_WIRE_VARINT_MAX)
+						s->state = data_relay_scan_opaque;
+					break;
+				}
+				size_t end = (payload - buf) + flen;
+				if (s == &t->up && buf[i] == 'H' && end <= len &&
+						t->down.state == data_relay_scan_framed) {
+					uint32_t stamp = 0;
+					if (ts_wire_get_u(payload, buf + end, &stamp))
+						data_relay_pong(t, stamp);
+					memmove(buf + i, buf + end, len - end);
+					len -= end - i;
+					continue;
+				}
+				s->left = flen;
+				i = payload - buf;
+			}	break;
+			default:	// nothing comes before both handshakes
+				s->state = data_relay_scan_opaque;
+				return len;
+		}
+	}
+	return len;
+}
+
+/*
+ * Send what the link has queued, and make sure it's polled for the rest
+ */
+static void
+data_relay_kick(
 		struct ts_remote_t * r)
 {
-	if (!r->out_len)
-		return 0;
+	if (!ts_mux_timer_armed(&r->flush))
+		data_event_write_flush(r);
+	ts_mux_remote_update(r);
+}
+
+/*
+ * Close a tunnel; 'tell' the other end of the link, unless it's the one
+ * that closed it, or the link is going away anyway
+ */
+static void
+data_relay_close(
+		data_relay_remote_p t,
+		int tell )
+{
+	ts_remote_p r = t->owner;
+	data_relay_remote_p * p = (data_relay_remote_p*)&r->relay.tunnel;
+	while (*p && *p != t)
+		p = &(*p)->next;
+	if (*p)
+		*p = t->next;
+	V2("%s tunnel %u closed\n", __func__, t->id);
+	if (tell) {
+		data_frame_t f;
+		data_relay_fanout_end(r);
+		if (!data_frame_begin(r, &f, 'X', TS_WIRE_VARINT_MAX, 0)) {
+			f.p = ts_wire_put_u(f.p, t->id);
+			data_frame_end(r, &f, 0);
+			data_relay_kick(r);
+		}
+	}
+	ts_mux_unregister(&t->remote);
+	close(t->remote.socket);
+	if (t->pending)
+		free(t->pending);
+	free(t);
+}
+
+static void
+data_relay_drop(
+		struct ts_remote_t * r)
+{
+	while (r->relay.tunnel)
+		data_relay_close((data_relay_remote_p)r->relay.tunnel, 0);
+	r->relay.blocked = 0;
+	for (uint32_t i = 0; i < r->relay.fanout.frames; i++)
+		ts_mux_frame_unref(r->relay.fanout.frame[i]);
+	r->relay.fanout.frames = r->relay.fanout.count = 0;
+}
+
+static int
+data_relay_can_read(
+		struct ts_remote_t * remote)
+{
+	ts_remote_p r = ((data_relay_remote_p)remote)->owner;
+	if (r->out_len < TS_MUX_RELAY_WINDOW)
+		return 1;
+	r->relay.blocked = 1;
+	return 0;
+}
+
+/*
+ * The link drained, the tunnels can be read from again
+ */
+static void
+data_relay_unblock(
+		struct ts_remote_t * r)
+{
+	r->relay.blocked = 0;
+	for (data_relay_remote_p t = (data_relay_remote_p)r->relay.tunnel; t; t = t->next)
+		ts_mux_remote_update(&t->remote);
+}
+
+static int
+data_relay_read(
+		struct ts_remote_t * remote)
+{
+	data_relay_remote_p t = (data_relay_remote_p)remote;
+	ts_remote_p r = t->owner;
+
+	// the frames some tunnels are waiting for go before their next bytes
+	data_relay_fanout_end(r);
+	while (r->out_len < TS_MUX_RELAY_WINDOW) {
+		data_frame_t f;
+		if (data_frame_begin(r, &f, 'R', TS_WIRE_VARINT_MAX + TS_MUX_RELAY_CHUNK, 0))
+			break;
+		f.p = ts_wire_put_u(f.p, t->id);
+		ssize_t ss = read(remote->socket, f.p, TS_MUX_RELAY_CHUNK);
+		if (ss == 0 || (ss < 0 && errno != EAGAIN && errno != EINTR)) {
+			data_relay_close(t, 1);
+			return -1;
+		}
+		if (ss < 0)
+			break;
+		size_t len = t->scan ? data_relay_scan(t, &t->up, f.p, ss) : (size_t)ss;
+		// if it was all pings, there's nothing to send
+		if (len) {
+			f.p += len;
+			data_frame_end(r, &f, 0);
+		}
+		if (ss < (ssize_t)TS_MUX_RELAY_CHUNK)
+			break;
+	}
+	data_relay_kick(r);
+	return 0;
+}
+
+static int
+data_relay_can_write(
+		struct ts_remote_t * remote)
+{
+	data_relay_remote_p t = (data_relay_remote_p)remote;
+	return t->len > t->off;
+}
 
-	ssize_t ss = write(r->socket, r->out, r->out_len);
-	if (ss < 0)
+static int
+data_relay_write(
+		struct ts_remote_t * remote)
+{
+	data_relay_remote_p t = (data_relay_remote_p)remote;
+	ssize_t ss = send(remote->socket, t->pending + t->off, t->len - t->off,
+			TS_MUX_NOSIGNAL);
+	if (ss < 0 && errno != EAGAIN && errno != EINTR) {
+		data_relay_close(t, 1);
 		return -1;
-	if (ss == r->out_len)
-		r->out_len = 0;
-	else {
-		memmove(r->out, r->out + ss, r->out_len - ss);
-		r->out_len -= ss;
 	}
+	if (ss > 0)
+		t->off += ss;
+	if (t->off == t->len)
+		t->off = t->len = 0;
+	return 0;
+}
 
-	return r->out_len;
+static data_relay_remote_p
+data_relay_new(
+		struct ts_remote_t * r,
+		int fd,
+		uint32_t id )
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+	data_relay_remote_p t = calloc(1, sizeof(*t));
+	if (!t)
+		return NULL;
+	t->owner = r;
+	t->id = id;
+	t->remote.mux = r->mux;
+	t->remote.socket = fd;
+	t->remote.can_read = data_relay_can_read;
+	t->remote.data_read = data_relay_read;
+	t->remote.can_write = data_relay_can_write;
+	t->remote.data_write = data_relay_write;
+	if (ts_mux_register(&t->remote)) {
+		free(t);
+		return NULL;
+	}
+	t->next = (data_relay_remote_p)r->relay.tunnel;
+	r->relay.tunnel = &t->remote;
+	return t;
+}
+
+/*
+ * A data remote for an accepted connection, or a relayed one
+ */
+static ts_remote_p
+data_remote_new(
+		ts_mux_p mux,
+		int fd )
+{
+	ts_remote_p res = malloc(sizeof(ts_remote_t));
+	if (!res)
+		return NULL;
+	memset(res, 0, sizeof(*res));
+	res->accept_socket = fd;
+	res->start = data_start;
+	res->restart = data_restart;
+	res->can_write = data_can_write;
+	res->data_read = data_event_read;
+	res->data_write = data_event_write;
+	res->mux = mux;
+	return res;
 }
 
-/* INTERNAL PACKET UTILITY
- * Tries to make sure there's at least 'size' bytes in the buffer, and return
- * a pointer to the place we allocated.
+/*
+ * Relay, a client connected to us; tunnel it to our server
  */
-static uint8_t *
-data_event_write_alloc(
+static void
+data_relay_accept(
 		struct ts_remote_t * r,
-		int size )
+		int fd )
 {
-	if (r->out_len + size >= r->out_size) {
-		int news = (r->out_len + size + 128) & ~127;
-		V3("%s buffer reallocated to %d\n", __func__, (int)news);
-		r->out = realloc(r->out, news);
-		r->out_size = news;
+	if (r->version < 5) {
+		V1("%s not connected to a server that relays, turning a client away\n",
+				__func__);
+		close(fd);
+		return;
+	}
+	if (!++r->relay.next)
+		r->relay.next++;
+	data_relay_remote_p t = data_relay_new(r, fd, r->relay.next);
+	if (!t) {
+		close(fd);
+		return;
 	}
-	*(r->out + r->out_len) = 0;
-	return r->out + r->out_len;
+	t->scan = 1;
+	// nobody pings the client but itself now, the kernel can still tell
+	socklen_t alen = sizeof(t->remote.addr);
+	if (!getpeername(fd, &t->remote.addr.sa, &alen))
+		data_keepalive(&t->remote);
+	data_frame_t f;
+	if (data_frame_begin(r, &f, 'O', TS_WIRE_VARINT_MAX, 0)) {
+		data_relay_close(t, 0);
+		return;
+	}
+	f.p = ts_wire_put_u(f.p, t->id);
+	data_frame_end(r, &f, 0);
+	V1("Relaying a client to the server, tunnel %u (%s)\n", t->id, __func__);
+	data_relay_kick(r);
 }
 
-static uint8_t *
-data_event_write_commit(
+/*
+ * Server, a relay tells us a client connected to it. It gets a data
+ * remote on the same mux as the link, it's just not reading a socket
+ * of it's own.
+ */
+static void
+data_relay_open(
 		struct ts_remote_t * r,
-		uint8_t * buf )
+		uint32_t id )
 {
-	if (!buf || !*buf)
-		return NULL;
-	int l = strlen((char*)buf);
-	r->out_len += l + 1;
-	return NULL;
+	int sv[2];
+	if (r->start != data_start || data_relay_get(r, id)) {
+		V1("%s unexpected tunnel %u, ignored\n", __func__, id);
+		return;
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("data_relay_open socketpair");
+		return;
+	}
+	ts_remote_p res = data_remote_new(r->mux, sv[0]);
+	data_relay_remote_p t = res ? data_relay_new(r, sv[1], id) : NULL;
+	if (res) {
+		res->relay.via = r->handle;
+		res->relay.id = id;
+	}
+	if (!t || ts_mux_register(res)) {
+		V1("%s can't relay tunnel %u, dropping it\n", __func__, id);
+		if (t)
+			data_relay_close(t, 1);
+		else
+			close(sv[1]);
+		close(sv[0]);
+		free(res);
+		return;
+	}
+	V1("Client relayed by '%s', tunnel %u (%s)\n",
+			r->display ? r->display->name : "(unknown)", id, __func__);
 }
 
 /*
- * This look for text in a clipboard, and generate packets to
- * + clear remote clipboard named 'name'
- * + set the text flavors
- * + set the clipboard once it is fully sent
+ * The link has bytes for a tunnel; what the socket doesn't take now is
+ * kept for when it can
  */
 static void
-data_event_write_clipboard(
+data_relay_data(
 		struct ts_remote_t * r,
-		ts_clipboard_p clipboard,
-		char * name)
+		uint32_t id,
+		uint8_t * data,
+		size_t len )
 {
-	uint8_t * buf = data_event_write_alloc(r, 16);
-	sprintf((char*)buf, "cn%s", name);
-	buf = data_event_write_commit(r, buf);
-	for (int i = 0; i < clipboard->flavorCount; i++)
-		if (!strncmp(clipboard->flavor[i].name, "text", 4)) {
-			buf = data_event_write_alloc(r, clipboard->flavor[i].size + 32);
-			sprintf((char*)buf, "fn%s:F%s:D%s", name,
-					clipboard->flavor[i].name,
-					clipboard->flavor[i].data);
-			buf = data_event_write_commit(r, buf);
+	data_relay_remote_p t = data_relay_get(r, id);
+	if (!t)	// closed since, the other end will know
+		return;
+	if (t->scan)
+		data_relay_scan(t, &t->down, data, len);
+	if (!t->len) {
+		ssize_t ss = send(t->remote.socket, data, len, TS_MUX_NOSIGNAL);
+		if (ss < 0 && errno != EAGAIN && errno != EINTR) {
+			data_relay_close(t, 1);
+			return;
 		}
-	buf = data_event_write_alloc(r, 16);
-	sprintf((char*)buf, "sn%s", name);
-	buf = data_event_write_commit(r, buf);
+		if (ss > 0) {
+			data += ss;
+			len -= ss;
+		}
+	}
+	if (len && data_relay_pend(t, data, len)) {
+		V1("%s tunnel %u isn't keeping up, dropping it\n", __func__, t->id);
+		data_relay_close(t, 1);
+		return;
+	}
+	if (t->ponging)
+		data_relay_pong(t, t->pong);
 }
 
 /*
- * Pools the display event fifo, takes the events from there, and packetize
- * them into an output buffer, they are then sent as fast as the socket will
- * allow.
+ * Server, queue the 'F' frames the link has been gathering; the tunnels
+ * that got the same number of frames get one 'F' together, with all their
+ * events in one 'E' frame
  */
-static int
-data_event_write(
+static void
+data_relay_fanout_end(
 		struct ts_remote_t * r)
 {
-	/*
-	 * During an outgoing connection to a server, we monitor the socket
-	 * state for a "write event", this is the select() convention
-	 * Once a write event has been received, check for any error, and
-	 * if all is well transform into a normal "data" one...
-	 */
-	if (r->state == skt_state_Connect) {
-		int e = 1;
-		socklen_t s = sizeof(e);
-		// we can ignore error here, on UNIX sockets
-		getsockopt (r->socket, SOL_SOCKET, SO_ERROR, &e, &s);
-	//	printf("data_event_write connection finished error %d\n", e );
-		if (e) {
-			errno = e;
-			perror("connect failed: ");
-			connect_restart(r);
-			return 0;
+	uint32_t frames = r->relay.fanout.frames, count = r->relay.fanout.count;
+	if (!frames)
+		return;
+	r->relay.fanout.frames = r->relay.fanout.count = 0;
+	for (uint32_t got = frames; got > 0; got--) {
+		uint32_t ids = 0, len = 0;
+		for (uint32_t i = 0; i < count; i++)
+			ids += r->relay.fanout.got[i] == got;
+		if (!ids)
+			continue;
+		// after the 'E', and it's one byte length, see ts_mux_frame_new()
+		for (uint32_t i = 0; i < got; i++)
+			len += r->relay.fanout.frame[i]->len - 2;
+		uint32_t size = 1 + ts_wire_size_u(len) + len;
+		data_frame_t f;
+		if (data_frame_begin(r, &f, 'F', TS_WIRE_VARINT_MAX + size +
+				ids * TS_WIRE_VARINT_MAX, 0))
+			break;
+		f.p = ts_wire_put_u(f.p, size);
+		*f.p++ = 'E';
+		f.p = ts_wire_put_u(f.p, len);
+		for (uint32_t i = 0; i < got; i++) {
+			ts_mux_frame_p frame = r->relay.fanout.frame[i];
+			memcpy(f.p, frame->data + 2, frame->len - 2);
+			f.p += frame->len - 2;
 		}
-		r->state = skt_state_Data;
-		V2("%s connection established\n", __func__);
-		connect_established(r);
+		for (uint32_t i = 0; i < count; i++)
+			if (r->relay.fanout.got[i] == got)
+				f.p = ts_wire_put_u(f.p, r->relay.fanout.id[i]);
+		data_frame_end(r, &f, 0);
 	}
-	/*
-	 * if there is a buffer with stuff in already, send it off
-	 */
-	if (data_event_write_flush(r))
-		return 0;
-	if (!r->proxy)
-		return 0;
+	for (uint32_t i = 0; i < frames; i++)
+		ts_mux_frame_unref(r->relay.fanout.frame[i]);
+}
 
+/*
+ * Server, a group's frame for a relayed client. If nothing of the
+ * client's own is on it's way, not queued, nor in the socket pair, it
+ * goes in the link's 'F' frames instead, with the other clients of the
+ * relay that got the same frames before it.
+ * The members of a group are kicked together, and each takes all it's
+ * frames in one go, so the link usually has them all when it gets to
+ * write. Returns nonzero if the frame has to go the usual way.
+ */
+static int
+data_relay_fanout(
+		struct ts_remote_t * r,
+		data_frame_p batch,
+		ts_mux_frame_p frame)
+{
+	ts_remote_p link = ts_mux_get_remote(r->mux, r->relay.via);
+	if (!link)
+		return -1;
+	typeof(link->relay.fanout) * fo = &link->relay.fanout;
+	uint32_t i = 0;
+	while (i < fo->count && fo->id[i] != r->relay.id)
+		i++;
 	/*
-	 * Empty the fifo, packetize anything we have
+	 * A client that is in there already hasn't sent anything since, the
+	 * link queues what it has before one does, see data_event_write_flush();
+	 * that saves asking the socket pair for every frame
 	 */
-	while (!proxy_fifo_isempty(&r->proxy->fifo)) {
-		ts_display_proxy_event_t e = proxy_fifo_read(&r->proxy->fifo);
-		uint8_t * buf = NULL;
-		switch (e.event) {
-			case ts_proxy_init:
-			//	d->slave->init(display);
-				break;
-			case ts_proxy_dispose:
-			//	d->slave->dispose(display);
-				break;
-			case ts_proxy_enter:
-			//	d->slave->enter(display, e.u.display, e.flags);
-				buf = data_event_write_alloc(r, 32);
-				sprintf((char*)buf, "ex%dy%d",
-						r->display->mousex, r->display->mousey);
-				V3("%s: %s\n", __func__, (char*)buf);
-				break;
-			case ts_proxy_leave:
-				buf = data_event_write_alloc(r, 8);
-				sprintf((char*)buf, "l");
-				break;
-			case ts_proxy_mouse:
-				buf = data_event_write_alloc(r, 32);
-				sprintf((char*)buf, "mx%dy%d",
-					(int)e.u.mouse.x,  (int)e.u.mouse.y);
-				break;
-			case ts_proxy_button:
-				buf = data_event_write_alloc(r, 16);
-				sprintf((char*)buf, "bb%dd%d",
-					(int)e.u.button, (int)e.down);
-				break;
-			case ts_proxy_key:
-				buf = data_event_write_alloc(r, 16);
-				sprintf((char*)buf, "kd%dkx%04x",
-					(int)e.down, e.u.key);
-				break;
-			case ts_proxy_wheel:
-				buf = data_event_write_alloc(r, 16);
-				sprintf((char*)buf, "wb%dx%dy%d",
-					(int)e.u.wheel.wheel,
-					(int)e.u.wheel.x,(int) e.u.wheel.y);
-				break;
-			case ts_proxy_getclipboard:
-				buf = data_event_write_alloc(r, 8);
-				sprintf((char*)buf, "gn%s", ts_master_get_main(r->mux->master)->name);
-				break;
-			case ts_proxy_setclipboard: {
-				if (!e.u.clipboard || !e.u.clipboard->flavorCount)
-					break;
-				data_event_write_clipboard(r,
-						e.u.clipboard, ts_master_get_main(r->mux->master)->name);
-			}	break;
-		}
-		data_event_write_commit(r, buf);
+	int queued = 0;
+	if (i == fo->count) {
+		data_relay_remote_p t = data_relay_get(link, r->relay.id);
+		if (!t || ioctl(t->remote.socket, FIONREAD, &queued))
+			queued = 1;
 	}
+	if (queued || batch->start || r->out_len ||
+			frame->len > TS_MUX_SHARED_COPY ||
+			link->out_len >= TS_MUX_RELAY_WINDOW)
+		return -1;
+	uint32_t got = i < fo->count ? fo->got[i] : 0;
 	/*
-	 * we must have generated packets there, so try to send them now too, instead
-	 * of waiting for another select() event.
+	 * The frames are the same for all, or we start over; a client
+	 * that is at the end of them can add the next one
 	 */
-	data_event_write_flush(r);
+	int match = got < fo->frames ? fo->frame[got] == frame :
+			fo->frames < TS_MUX_FANOUT_MAX;
+	if (!match || (i == fo->count && i == TS_MUX_FANOUT_MAX)) {
+		data_relay_fanout_end(link);
+		i = got = 0;
+	}
+	if (i == fo->count) {
+		fo->id[fo->count++] = r->relay.id;
+		fo->got[i] = 0;
+	}
+	// the link takes over our reference, or already has one
+	if (got == fo->frames)
+		fo->frame[fo->frames++] = frame;
+	else
+		ts_mux_frame_unref(frame);
+	fo->got[i]++;
+	ts_mux_remote_update(link);
 	return 0;
 }
 
 /*
- * This is called when our remote master "screen" wants the clipboard;
- * so we do just that, we serialize it, and we send it off
+ * Receive a version 2 frame, the payload is decoded in place
  */
-static void ts_mux_remote_setclipboard(struct ts_display_t *d, ts_clipboard_p clipboard)
+static void
+data_process_frame(
+		struct ts_remote_t * r,
+		uint8_t type,
+		uint8_t * payload,
+		size_t len )
 {
-	ts_remote_p r = d->driver->refCon;
-	V3("%s\n", __func__);
+	data_packet_t pkt = { .kind = type };
+	const uint8_t * p = payload, * end = payload + len;
+	char name[256], flavor[64];
 
-	data_event_write_clipboard(r, clipboard, d->name);
-	ts_mux_signal(r->mux, 0);
+	switch (type) {
+		case 'E':
+			while (p && p < end) {
+				uint32_t head = 0;
+				p = ts_wire_get_u(p, end, &head);
+				pkt.d = (head >> 2) & 1;
+				switch (head & 3) {
+					case data_event_motion:
+						pkt.kind = 'm';
+						pkt.x = ts_wire_unzigzag(head >> 3);
+						p = ts_wire_get_s(p, end, &pkt.y);
+						break;
+					case data_event_button:
+						pkt.kind = 'b';
+						pkt.b = head >> 3;
+						break;
+					case data_event_key:
+						pkt.kind = 'k';
+						pkt.k = head >> 3;
+						break;
+					case data_event_wheel:
+						pkt.kind = 'w';
+						pkt.b = ts_wire_unzigzag(head >> 3);
+						p = ts_wire_get_s(p, end, &pkt.x);
+						p = ts_wire_get_s(p, end, &pkt.y);
+						break;
+				}
+				if (p)
+					data_packet_apply(r, &pkt);
+			}
+			if (!p)
+				V1("%s invalid '%c' frame\n", __func__, type);
+			return;
+		case 'e':
+			p = ts_wire_get_s(p, end, &pkt.x);
+			p = ts_wire_get_s(p, end, &pkt.y);
+			break;
+		case 'l':
+			break;
+		case 'g':
+		case 'c':
+		case 's':
+			p = ts_wire_get_str(p, end, name, sizeof(name));
+			pkt.name = name;
+			break;
+		case 'f':
+			p = ts_wire_get_str(p, end, name, sizeof(name));
+			p = ts_wire_get_str(p, end, flavor, sizeof(flavor));
+			pkt.name = name;
+			pkt.flavor = flavor;
+			pkt.data = (uint8_t*)p;
+			pkt.size = p ? end - p : 0;
+			break;
+		case 'T':
+		case 'D':
+		case 'A':
+			if (data_process_xfer(r, type, p, end))
+				V1("%s invalid '%c' frame\n", __func__, type);
+			return;
+		case 'U': {
+			uint32_t seq = 0;
+			if (!(p = ts_wire_get_u(p, end, &seq)))
+				break;
+			data_udp_acked(r, seq);
+		}	return;
+		case 'P': {
+			uint32_t seq = 0;
+			p = ts_wire_get_u(p, end, &seq);
+			p = ts_wire_get_s(p, end, &pkt.x);
+			p = ts_wire_get_s(p, end, &pkt.y);
+			if (!p)
+				break;
+			data_udp_apply(r, seq, pkt.x, pkt.y);
+		}	return;
+		case 'H':
+		case 'h': {
+			uint32_t stamp = 0;
+			if (!(p = ts_wire_get_u(p, end, &stamp)))
+				break;
+			if (type == 'H')
+				data_heartbeat_write(r, 'h', stamp);
+			else
+				data_heartbeat_pong(r, stamp);
+		}	return;
+		case 'F': {
+			uint32_t n = 0, id = 0;
+			if ((p = ts_wire_get_u(p, end, &n)) && n > (uint32_t)(end - p))
+				p = NULL;
+			if (!p)
+				break;
+			uint8_t * data = (uint8_t*)p;
+			for (p += n; p && p < end; )
+				if ((p = ts_wire_get_u(p, end, &id)))
+					data_relay_data(r, id, data, n);
+		}	return;
+		case 'O':
+		case 'R':
+		case 'X': {
+			uint32_t id = 0;
+			if (!(p = ts_wire_get_u(p, end, &id)))
+				break;
+			if (type == 'O')
+				data_relay_open(r, id);
+			else if (type == 'R')
+				data_relay_data(r, id, (uint8_t*)p, end - p);
+			else if (data_relay_get(r, id))
+				data_relay_close(data_relay_get(r, id), 0);
+		}	return;
+		default:
+			V2("%s skipping frame '%c' (%d bytes)\n", __func__, type, (int)len);
+			return;
+	}
+	if (!p) {
+		V1("%s invalid '%c' frame\n", __func__, type);
+		return;
+	}
+	data_packet_apply(r, &pkt);
 }
 
-static ts_display_driver_t ts_mux_driver_remote = {
-		.setclipboard = ts_mux_remote_setclipboard,
-};
-
-/*
- * Receive a fully formed packet -- refer to the top of the file for a
- * bit more about the packet format.
- * One thing of note is that the parameter 'names' is predefined, and the
- * parser try to decode as many as it can before looking at the data type.
- * Since many packets share parameter names/type, it makes the code a
- * lot simpler.
- */
 static void
-data_process_packet(
+data_packet_apply(
 		struct ts_remote_t * r,
-		uint8_t * pkt,
-		size_t len )
+		data_packet_p pkt )
 {
-	uint8_t * p = pkt;
-	char kind = *p++;
-
-	int v = 0 , w = 0, h = 0;
-	int x = 0, y = 0;
-	int b = 0, d = 0;
-	uint16_t k = 0;
-	char * param = NULL;
-	char * name = NULL;
-	char * flavor = NULL;
-	char * data = NULL;
-
-//	printf("packet '%s'\n", pkt);
-	/*
-	 * Try to decode all the parameters we find
-	 */
-	int ok = 1;
-	while (*p && ok) {
-		switch (*p) {
-			case 'v': p++; v = data_get_integer(&p); break; // version
-			case 'w': p++; w = data_get_integer(&p); break; // width
-			case 'h': p++; h = data_get_integer(&p); break; // height
-			case 'p': p++; param = data_get_string(&p, ':'); break; // param
-			case 'n': p++; name = data_get_string(&p, ':'); break; // name
-			case 'F': p++; flavor = data_get_string(&p, ':'); break; // flavor string
-			case 'D': p++; data = data_get_string(&p, 0); break; // data, always zero termed
-			case 'x': p++; x = data_get_integer(&p); break;
-			case 'y': p++; y = data_get_integer(&p); break;
-			case 'b': p++; b = data_get_integer(&p); break; // button
-			case 'd': p++; d = data_get_integer(&p); break; // down/up
-			case 'k': p++; k = data_get_integer(&p); break; // key (unsigned)
-			default: ok = 0;
-		}
-	}
+	char kind = pkt->kind;
+	int v = pkt->v, w = pkt->w, h = pkt->h;
+	int x = pkt->x, y = pkt->y;
+	int b = pkt->b, d = pkt->d;
+	uint16_t k = pkt->k;
+	char * param = pkt->param;
+	char * name = pkt->name;
+	char * flavor = pkt->flavor;
 
 	switch (kind) {
 		case 'C':	// client screen
@@ -715,39 +4796,59 @@ data_process_packet(
 				V1("%s invalid '%c' packet anyway\n", __func__, kind);
 				break;
 			}
+			// from now on, we speak the highest version we both know
+			r->version = v < 1 ? 1 : v < TS_MUX_VERSION ? v : TS_MUX_VERSION;
+			V1("Speaking protocol version %d with '%s'\n", r->version, name);
+			// we got through, the next reconnection can be quick again
+			r->backoff = 0;
+			// we offered our ring; if the peer did too, it's using it
+			if (r->ring.out && pkt->m) {
+				if (data_ring_start(r)) {
+					V1("%s can't use the ring from '%s', dropping it\n", __func__, name);
+					r->ring.failed = 1;
+					shutdown(r->socket, SHUT_RDWR);
+					break;
+				}
+				V1("Using shared memory rings with '%s'\n", name);
+			} else	// and whatever the peer sent along, if we didn't
+				data_ring_close(r);
+			data_heartbeat_start(r);
+			// a clipboard the last connection didn't finish sending
+			if (r->xfer && r->version >= 3)
+				data_xfer_announce(r);
+			else if (r->xfer) {
+				_ts_mux_xfer_free(r->xfer);
+				r->xfer = NULL;
+			}
 
-			ts_display_driver_p driver = NULL;
 			if (kind == 'C') {
-				// we're the server, let's setup a proxy screen to start making packets
-				V1("Setting up new client screen '%s' (%s) \n", name, __func__);
-
-				driver = ts_display_proxy_driver(r->mux, NULL);
-				r->proxy = (ts_display_proxy_driver_p)driver;
-				r->proxy->signal.fd[TS_SIGNAL_END0] = r->mux->signal.fd[TS_SIGNAL_END0];
-			} else {
-				V1("Setting server screen '%s' (%s) \n", name, __func__);
-				driver = ts_display_clone_driver(&ts_mux_driver_remote);
-				driver->refCon = r;
-				param = r->display->param;
+				// the client wants pointer motion over UDP, and so do we
+				if (pkt->u && r->mux->udp && r->version >= 2 &&
+						r->addr.sa.sa_family == AF_INET)
+					data_udp_start(r, pkt->u, pkt->t);
+				// it might be coming back, the main mux knows
+				if (data_session_claim(r, pkt->r, name, param, w, h)) {
+					V1("%s can't set up '%s', dropping it\n", __func__, name);
+					shutdown(r->socket, SHUT_RDWR);
+				}
+				break;
 			}
+			// keep the server's token, to give it back if we reconnect
+			r->session = pkt->r;
+			V1("Setting server screen '%s' (%s) \n", name, __func__);
+			ts_display_driver_p driver = ts_display_clone_driver(&ts_mux_driver_remote);
+			driver->refCon = r;
+			param = r->display->param;
 			ts_display_p new_display = malloc(sizeof(ts_display_t));
 			ts_display_init(new_display, r->mux->master, driver, name, param);
+			if (r->mux->rt)
+				ts_clipboard_reserve(&new_display->clipboard, 1,
+						r->mux->rt->prealloc);
 			new_display->bounds.w = w;
 			new_display->bounds.h = h;
-			ts_master_display_add(r->mux->master, new_display);
-
-			if (kind == 'C') {
-				r->display = new_display;
-				ts_display_place(
-						ts_master_get_main(r->mux->master),
-						new_display, param);
-			} else {
-				// we're a client, we're just happy about life and getting events!
-				// we still attach a screen for the "server", so the mouse warp is easier
-				ts_display_place(
-						new_display,
-						ts_master_get_main(r->mux->master), param);
-			}
+			// we're a client, we're just happy about life and getting events!
+			ts_mux_call(ts_mux_main(r->mux), data_display_attach,
+					new_display, new_display);
 		}	break;
 		case 'm': {	// mouse move
 			if (r->proxy)
@@ -794,31 +4895,13 @@ data_process_packet(
 					ts_master_get_main(r->mux->master),
 					target);
 		}	break;
-		case 'c': {	// clear clipboard
-			V3("%s clear clipboard\n", __func__);
-			ts_display_p target = name ?
-					ts_master_display_get(r->mux->master, name) :
-					ts_master_get_main(r->mux->master);
-			if (target)
-				ts_clipboard_clear(&target->clipboard);
-		}	break;
-		case 'f': {	// clipboard flavor
-			V3("%s clipboard flavor\n", __func__);
-			ts_display_p target = name ?
-					ts_master_display_get(r->mux->master, name) :
-					ts_master_get_main(r->mux->master);
-			if (target)
-				ts_clipboard_add(&target->clipboard, flavor, (uint8_t*)data, strlen(data));
-		}	break;
+		case 'c':	// clear clipboard
+		case 'f':	// clipboard flavor
 		case 's': {	// set clipboard
-			V3("%s set clipboard\n", __func__);
-			ts_display_p target = name ?
-					ts_master_display_get(r->mux->master, name) :
-					ts_master_get_main(r->mux->master);
-			if (target)
-				ts_display_setclipboard(
-					ts_master_get_main(r->mux->master),
-					&target->clipboard);
+			V3("%s clipboard '%c'\n", __func__, kind);
+			if (kind == 'f' && !(flavor && pkt->data))
+				break;
+			data_clipboard_op(r, kind, name, flavor, pkt->data, pkt->size);
 		}	break;
 		default:
 			V1("%s unknown packet kind '%c'\n", __func__, kind);
@@ -827,80 +4910,107 @@ data_process_packet(
 }
 
 /*
- * read some data, we first save it in a growing buffer, until we find a zero.
- * Then we process that packet and continue on for each line.
+ * Dispatch every complete packet we have in the input buffer. The first
+ * one is always a text one, the handshake, and it tells us what version
+ * the rest is going to be in, so it's checked again after each packet.
+ */
+static int
+data_event_parse(
+		struct ts_remote_t * r)
+{
+	while (r->in_start < r->in_len) {
+		if (r->version < 2) {
+			uint8_t * zero = memchr(r->in + r->in_scan, 0, r->in_len - r->in_scan);
+			if (!zero) {
+				r->in_scan = r->in_len;
+				break;
+			}
+			int end = zero - r->in;
+			// eat up any remaining line terminations etc
+			while (r->in_start < end && r->in[r->in_start] < ' ')
+				r->in_start++;
+			if (end > r->in_start)
+				data_process_packet(r, r->in + r->in_start, end - r->in_start);
+			r->in_start = r->in_scan = end + 1;
+			continue;
+		}
+		uint8_t * p = r->in + r->in_start;
+		uint8_t * end = r->in + r->in_len;
+		uint32_t len = 0;
+		uint8_t * payload = (uint8_t*)ts_wire_get_u(p + 1, end, &len);
+		if (!payload) {
+			if (end - p > TS_WIRE_VARINT_MAX) {
+				V1("%s invalid frame length, dropping connection\n", __func__);
+				if (r->restart)
+					r->restart(r);
+				return -1;
+			}
+			break;
+		}
+		if (len > TS_MUX_FRAME_MAX) {
+			V1("%s %u bytes frame, dropping connection\n", __func__, len);
+			if (r->restart)
+				r->restart(r);
+			return -1;
+		}
+		if ((size_t)(end - payload) < len)
+			break;
+		data_process_frame(r, *p, payload, len);
+		r->in_start = r->in_scan = (payload + len) - r->in;
+	}
+	if (r->in_start == r->in_len)
+		r->in_start = r->in_scan = r->in_len = 0;
+	return 0;
+}
+
+/*
+ * Data is read straight at the end of the input buffer, in big chunks,
+ * and packets are dispatched in place, where they are. Each byte is only
+ * looked at once, as we remember how far we scanned for the terminating
+ * zero. The unprocessed bytes are only moved back to the front when we
+ * run out of room at the end, and the buffer doubles if a single packet
+ * fills it up, so receiving a big clipboard is linear.
+ * We stop after TS_MUX_READ_BUDGET bytes, to give the other remotes a
+ * chance; the poll backend will tell us there is more.
  */
 static int
 data_event_read(
 		struct ts_remote_t * r)
 {
-	uint8_t in[256];
+	int budget = TS_MUX_READ_BUDGET;
 	ssize_t ss = 0;
+	int room;
+
+	// an error queue notification wakes us up too
+	data_zerocopy_reap(r);
 	do {
-		ss = read(r->socket, in, sizeof(in));
+		room = data_event_room(r);
+		if (room < 0)
+			return -1;
+		// the peer's ring and doorbell come along with the 'S' or 'C' packet
+		if (r->addr.sa.sa_family == AF_UNIX)
+			ss = data_ring_recv(r, r->in + r->in_len, room);
+		else
+			ss = read(r->socket, r->in + r->in_len, room);
 
 		/*
 		 * Error, or disconnect, we drop this link
 		 */
-		if (ss <= 0) {
+		if (ss == 0 || (ss < 0 && errno != EAGAIN && errno != EINTR)) {
 			if (r->restart)
 				r->restart(r);
-			//sleep(1);
 			return -1;
 		}
-		/*
-		 * Try to add this in to the 'current' buffer, grow it if necessary
-		 */
-		//printf("%s in len %d, ss %d\n",__func__, r->in_len, (int)ss);
-		if (r->in_len + ss > r->in_size) {
-			int news = (r->in_len + ss + 128) & ~127;
-			r->in = realloc(r->in, news);
-			V3("%s reallocated in from %d to %d\n", __func__, r->in_size, news);
-			r->in_size = news;
-		}
-		memcpy(r->in + r->in_len, in, ss);
+		if (ss < 0)
+			break;
 		r->in_len += ss;
+		budget -= ss;
+		if (r->mux->heartbeat)
+			r->heard = ts_mux_now();
 
-		/*
-		 * try to find 'packets' from the current input buffer
-		 */
-		int packet_len = 0;
-		do {
-			packet_len = 0;
-
-			for (int bi = 0; bi < r->in_len; bi++)
-				if (r->in[bi] == 0) {
-					packet_len = bi;
-					break;
-				}
-
-			/*
-			 * if a packet is found, move the remaining and continue
-			 */
-			if (packet_len) {
-				// got a packet
-			//	printf("%s found a packet %d size (%d in in)\n", __func__, packet_len, r->in_len);
-
-				r->in[packet_len] = 0;
-				if (packet_len > 0)
-					data_process_packet(r, r->in, packet_len);
-				/*
-				 * eat up any remaining line terminations etc
-				 */
-				packet_len++;
-				while (packet_len < r->in_len && r->in[packet_len] < ' ')
-					packet_len++;
-				/* move remaining bytes */
-				if (r->in_len > packet_len)
-					memmove(r->in,
-							r->in + packet_len,
-							r->in_len - packet_len);
-				r->in_len -= packet_len;
-			//	printf("%s processed packet, %d remains\n", __func__, r->in_len);
-			}
-		} while (packet_len);
-
-	} while (ss == sizeof(in));
+		if (data_event_parse(r) < 0)
+			return -1;
+	} while (ss == room && budget > 0);
 	return 0;
 }
 
@@ -911,15 +5021,21 @@ static int
 listen_start(
 		struct ts_remote_t * r)
 {
-	int skt = socket(AF_INET, SOCK_STREAM, 0);
+	int skt = socket(r->addr.sa.sa_family, SOCK_STREAM, 0);
 	if (skt < 0)
 		return -1;
 	int optval = 1;
-	setsockopt(skt, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+	if (r->addr.sa.sa_family == AF_UNIX) {
+		// a socket left over by a previous run would make bind() fail
+		struct stat st;
+		if (!stat(r->addr.un.sun_path, &st) && S_ISSOCK(st.st_mode))
+			unlink(r->addr.un.sun_path);
+	} else
+		setsockopt(skt, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
 
-	size_t addrLen = sizeof(r->addr);
+	size_t addrLen = _ts_mux_addr_len(r);
 
-	if (bind(skt, (struct sockaddr*)&r->addr, addrLen) < 0) {
+	if (bind(skt, &r->addr.sa, addrLen) < 0) {
 		perror("listen_start bind");
 		close(skt);
 		return -1;
@@ -960,9 +5076,9 @@ listen_event_read(
 		struct ts_remote_t * r)
 {
 	V2("%s accepting on %d\n", __func__, r->socket);
-	struct sockaddr_in  addr;
-	socklen_t addrLen = sizeof(addr);
-	int fd = accept(r->socket, (struct sockaddr*)&addr, &addrLen);
+	ts_remote_t peer;
+	socklen_t addrLen = sizeof(peer.addr);
+	int fd = accept(r->socket, &peer.addr.sa, &addrLen);
 	if (fd <= 0) {
 		perror("_vdmsg_funnel_event_listen accept");
 		exit(1);
@@ -970,20 +5086,45 @@ listen_event_read(
 	}
 	int i = 1;
 	setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &i, sizeof (i));
+	// we're a client, so a relay
+	if (r->mux->upstream) {
+		data_relay_accept(r->mux->upstream, fd);
+		return 0;
+	}
 
-	ts_remote_p res = malloc(sizeof(ts_remote_t));
-	memset(res, 0, sizeof(*res));
-	res->addr = addr;
-	res->accept_socket = fd;
-	res->start = data_start;
-	res->restart = data_restart;
-	res->can_write = data_can_write;
-	res->data_read = data_event_read;
-	res->data_write = data_event_write;
-	res->mux = r->mux;
+	// the new connection lives on whichever shard the policy picks
+	ts_remote_p res = data_remote_new(ts_mux_pick(r->mux), fd);
+	if (!res) {
+		close(fd);
+		return 0;
+	}
+	// unix domain clients have no name, they are known by our path
+	res->addr = r->addr.sa.sa_family == AF_UNIX ? r->addr : peer.addr;
+	V2("%s connection %d on mux shard %d\n", __func__, fd, res->mux->index);
 
-	ts_mux_register(res);
+	if (ts_mux_register(res)) {
+		fprintf(stderr, "%s can't register connection, dropping it\n", __func__);
+		close(fd);
+		free(res);
+	}
+	return 0;
+}
 
+/*
+ * Make 'r' a unix domain socket remote, on 'path'
+ */
+static int
+_ts_mux_addr_unix(
+		ts_remote_p r,
+		const char * path )
+{
+	if (strlen(path) >= sizeof(r->addr.un.sun_path)) {
+		fprintf(stderr, "%s '%s' is too long for a socket path\n", __func__, path);
+		return -1;
+	}
+	memset(&r->addr, 0, sizeof(r->addr));
+	r->addr.un.sun_family = AF_UNIX;
+	strcpy(r->addr.un.sun_path, path);
 	return 0;
 }
 
@@ -1002,24 +5143,28 @@ ts_mux_port_new(
 	memset(res, 0, sizeof(*res));
 
 	res->mux = mux;
-	res->addr.sin_family = AF_INET;
-	res->addr.sin_addr.s_addr = INADDR_ANY;
-	res->addr.sin_port = htons(1869);
+	res->addr.in.sin_family = AF_INET;
+	res->addr.in.sin_addr.s_addr = INADDR_ANY;
+	res->addr.in.sin_port = htons(1869);
 	res->display = display;
 
-	if (address) {
+	if (address && !strncmp(address, "unix:", 5)) {
+		if (_ts_mux_addr_unix(res, address + 5)) {
+			free(res);
+			return -1;
+		}
+	} else if (address) {
 		char *port = strchr(address, ':');
 		if (port) {
 			*port = 0; port++;
-			res->addr.sin_port = htons(atoi(port));
+			res->addr.in.sin_port = htons(atoi(port));
 		}
-		struct hostent *hp = gethostbyname(address);
-		if (!hp) {
-			fprintf(stderr, "%s unknown host '%s'\n", __func__, address);
-			exit(1);
-		}
-		res->addr.sin_addr.s_addr = *(in_addr_t *) (hp->h_addr_list[0]);
-
+		// looked up by connect_start(), not here, it could take a while
+		res->resolve = malloc(sizeof(ts_resolve_t));
+		ts_resolve_init(res->resolve, mux, address, connect_resolved, res);
+	}
+	if (address) {
+		mux->upstream = res;
 		res->start = connect_start;
 		res->restart = connect_restart;
 		res->can_read = connect_can_read;
@@ -1040,3 +5185,38 @@ ts_mux_port_new(
 	return -1;
 }
 
+/*
+ * An extra listen remote, typically a unix domain one for the clients on
+ * this host, next to the TCP one
+ */
+int
+ts_mux_port_listen(
+		ts_mux_p mux,
+		ts_master_p master,
+		char * address,
+		ts_display_p display)
+{
+	ts_remote_p res = malloc(sizeof(ts_remote_t));
+	memset(res, 0, sizeof(*res));
+
+	res->mux = mux;
+	res->display = display;
+	if (!strncmp(address, "unix:", 5)) {
+		if (_ts_mux_addr_unix(res, address + 5)) {
+			free(res);
+			return -1;
+		}
+	} else {
+		char *port = strchr(address, ':');
+		res->addr.in.sin_family = AF_INET;
+		res->addr.in.sin_addr.s_addr = INADDR_ANY;
+		res->addr.in.sin_port = htons(atoi(port ? port + 1 : address));
+	}
+	res->start = listen_start;
+	res->restart = listen_restart;
+	res->data_read = listen_event_read;
+
+	ts_mux_start(mux, master);
+	return ts_mux_register(res);
+}
+
@@ -41,9 +41,11 @@
 #define __TS_MUX_H___
 
 #include <netinet/in.h>
+#include <sys/un.h>
 #include "ts_display.h"
 #include "ts_master.h"
 #include "ts_signal.h"
+#include "ts_rt.h"
 
 /*
  * "macro" states for remote connections/sockets
@@ -55,7 +57,194 @@ enum {
 	skt_state_Data,
 };
 
+/*
+ * Interest bits a remote is registered with in the poll backend
+ */
+enum {
+	ts_mux_event_read	= (1 << 0),
+	ts_mux_event_write	= (1 << 1),
+};
+
+/*
+ * Wakeup causes, the mux keeps count of why it woke up, so we can
+ * check it really stays asleep when there is nothing to do.
+ */
+enum {
+	ts_mux_wake_socket = 0,	// network activity
+	ts_mux_wake_signal,		// another thread signaled us
+	ts_mux_wake_xorg,		// event from an X server
+	ts_mux_wake_timer,		// a deadline expired
+	ts_mux_wake_count,
+};
+
+/*
+ * Polling modes. By default the mux sleeps in the kernel until something
+ * happens. 'hybrid' keeps polling without sleeping for a while after each
+ * event, as events tend to come in bursts, and only goes back to sleep
+ * when it's been idle long enough. 'spin' never sleeps. Both trade a CPU
+ * for not paying the wakeup latency of the sleeping thread.
+ */
+enum {
+	ts_mux_spin_block = 0,
+	ts_mux_spin_hybrid,
+	ts_mux_spin_always,
+};
+
+/*
+ * Handle to a remote registered with a mux. The low bits are the index of
+ * it's slot, the high bits are a generation count that changes every time
+ * the slot is reused, so a stale handle (for example, a poll event for a
+ * remote that was just unregistered) can be detected. Zero is never valid.
+ */
+typedef uint32_t ts_remote_handle_t;
+
+#define TS_MUX_HANDLE_INDEX_BITS	20
+#define TS_MUX_HANDLE_INDEX_MASK	((1U << TS_MUX_HANDLE_INDEX_BITS) - 1)
+#define TS_MUX_HANDLE_GEN_MASK	((1U << (32 - TS_MUX_HANDLE_INDEX_BITS)) - 1)
+
+/*
+ * Deadline timers. The mux keeps the armed ones in a min-heap, and sleeps
+ * exactly until the first one expires, or forever if there are none.
+ * 'when' is absolute, in milliseconds on the ts_mux_now() clock.
+ * Timers are armed, cancelled and fired in the mux thread only.
+ */
+struct ts_mux_t;
+typedef struct ts_mux_timer_t {
+	uint64_t when;
+	uint32_t index;		// position in the heap + 1, zero when not armed
+	void * refCon;		// reference constant, optional, used by callback
+	void (*callback)(struct ts_mux_t * mux, struct ts_mux_timer_t * timer);
+} ts_mux_timer_t, *ts_mux_timer_p;
+
+/*
+ * Reasons for signaling the mux thread, see ts_mux_signal()
+ */
+enum {
+	ts_mux_signal_wake = 1,	// just wake up
+	ts_mux_signal_register,	// remotes are waiting to be registered
+	ts_mux_signal_kick,		// kicks are queued
+};
+
+/*
+ * A "kick" is how another thread tells the mux that something has new
+ * work, for example a proxy display fifo that isn't empty anymore.
+ * Kicks are queued on a lock free list, and the thread is only signaled
+ * when that list was empty, so a burst of events costs one wakeup, and
+ * the mux only services what was actually kicked. A kick that is already
+ * queued isn't queued again. The callback is called in the mux thread.
+ * The kick structure needs to outlive anything that can kick it.
+ */
+typedef struct ts_mux_kick_t {
+	volatile int queued;
+	struct ts_mux_kick_t * next;
+	void * refCon;		// reference constant, optional, used by callback
+	void (*callback)(struct ts_mux_t * mux, struct ts_mux_kick_t * kick);
+} ts_mux_kick_t, *ts_mux_kick_p;
+
+/*
+ * Output queue segment. Small packets are appended to 'buf' of the last
+ * segment, bigger payloads get their own, or point to data that isn't
+ * ours, in which case 'release' is called once it has been sent.
+ * The queue is sent with sendmsg(), a partial send just moves 'sent'.
+ */
+typedef struct ts_mux_seg_t {
+	struct ts_mux_seg_t * next;
+	uint8_t * data;		// payload, 'buf' unless it's a reference
+	uint32_t len;		// bytes in the payload
+	uint32_t sent;		// bytes of it already sent
+	uint32_t size;		// room in 'buf'
+	uint32_t zerocopy;	// last MSG_ZEROCOPY send it was part of, + 1
+	uint32_t glued;		// the next segment is the rest of the same frame
+	void * refCon;		// reference constant, optional, used by release
+	void (*release)(struct ts_mux_seg_t * seg);
+	uint8_t buf[0];
+} ts_mux_seg_t, *ts_mux_seg_p;
+
+#define TS_MUX_SEG_SIZE		(4096 - sizeof(ts_mux_seg_t))
+// tunnels, and frames, a link gathers for it's 'F' frames, at most
+#define TS_MUX_FANOUT_MAX	32
+
+/*
+ * A clipboard streamed in version 3, see ts_mux.c. The sender keeps one
+ * per remote, with references to the flavors it is sending, and sends
+ * them as the window the receiver advertised allows. The receiver keeps
+ * them on the main mux, keyed by name and id, so a transfer that was cut
+ * short can be resumed from 'offset' by the next connection.
+ */
+typedef struct ts_mux_xfer_t {
+	struct ts_mux_xfer_t * next;	// receiver, main mux list
+	uint32_t id;
+	char name[256];
+	uint32_t size;		// of all the flavors
+	uint32_t offset;	// sent, or received
+	uint32_t limit;		// sender, how far the window lets us send
+	int flavorCount;
+	struct {
+		char name[64];
+		uint32_t size;
+		uint8_t * data;		// sender, reference to the flavor
+	} flavor[8];			// as many as a ts_clipboard_t
+	ts_clipboard_t clipboard;	// receiver, where the flavors are rebuilt
+	ts_mux_timer_t timer;		// receiver, expiry when idle
+} ts_mux_xfer_t, *ts_mux_xfer_p;
+
+/*
+ * State of the UDP side channel for pointer motion, see ts_mux.c
+ */
+enum {
+	ts_mux_udp_off = 0,
+	ts_mux_udp_probing,	// waiting for the receiver to see our datagrams
+	ts_mux_udp_on,
+	ts_mux_udp_failed,	// blocked, or went quiet; motion stays on TCP
+};
+
+/*
+ * Both ends keep this in their TCP remote. The sender's 'socket' is
+ * connected to the receiver's, the receiver has an extra remote reading
+ * it's 'socket', that points back to the connection it belongs to.
+ */
+typedef struct ts_mux_udp_t {
+	int socket;
+	uint8_t state;		// ts_mux_udp_*
+	uint32_t token;		// picked by the receiver, stale datagrams don't match
+	uint32_t seq;		// last sent, or last applied
+	int32_t x, y;		// summed motion, sent or applied
+	uint32_t synced;	// sender, 'seq' last sent over TCP too
+	uint32_t since_seq;	// sender, first datagram not acknowledged yet,
+	uint64_t since;		//   and when it went, zero if none
+	ts_mux_timer_t timer;	// sender probes, receiver delayed ack
+	struct ts_remote_t * remote;	// receiver, the one reading 'socket'
+} ts_mux_udp_t, *ts_mux_udp_p;
+
+/*
+ * Keys and buttons a client was told are down, so they can be let go of
+ * when it comes back after losing it's connection
+ */
+typedef struct ts_mux_pressed_t {
+	uint32_t buttons;		// bit 'n' for button 'n'
+	uint8_t count;
+	uint16_t key[16];
+} ts_mux_pressed_t;
+
 struct ts_display_proxy_driver_t;
+/*
+ * A client display kept for a while after it's connection dropped, so
+ * the client can take it back, as it was, when it reconnects
+ */
+typedef struct ts_mux_session_t {
+	struct ts_mux_session_t * next;
+	uint32_t token;
+	ts_display_p display;	// out of the master, while it's parked
+	struct ts_display_proxy_driver_t * proxy;
+	ts_mux_xfer_p xfer;		// clipboard it was being sent
+	ts_mux_pressed_t pressed;
+	uint8_t active;			// it had the pointer,
+	int mousex, mousey;		//   there, when it was parked
+	ts_mux_timer_t timer;	// expiry
+} ts_mux_session_t, *ts_mux_session_p;
+
+struct ts_resolve_t;
+struct ts_ring_t;
 /*
  * a ts_remote_t handles one connection for the mux. They can be
  * listen remotes, data (accepted) remotes, connect (outgoing)
@@ -65,22 +254,120 @@ struct ts_display_proxy_driver_t;
 struct ts_mux_t;
 typedef struct ts_remote_t {
 	struct ts_mux_t * mux;
+	ts_remote_handle_t handle;	// zero when not registered
+	struct ts_remote_t * pending;	// registration list from other threads
 	ts_display_p display;
 	int socket;
 	int state;
-	struct sockaddr_in  addr;
+	/*
+	 * What is currently registered with the poll backend; the 'socket'
+	 * can change (reconnect) so we keep a copy of what we told it about
+	 */
+	int poll_socket;
+	uint32_t events;
+	uint8_t wake;		// ts_mux_wake_* to account our events to
+	uint16_t version;	// protocol spoken after the handshake, 0 until then
+	// TCP, or unix domain for peers on the same host, see ts_mux_port_new()
+	union {
+		struct sockaddr sa;
+		struct sockaddr_in in;
+		struct sockaddr_un un;
+	} addr;
+	struct ts_resolve_t * resolve;	// host name of an outgoing connection
 	int accept_socket;
-	time_t timeout;
+	ts_mux_timer_t timer;	// (re)start deadline
+	ts_mux_timer_t flush;	// end of the batching delay, see ts_mux_t 'batch'
+	ts_mux_timer_t heartbeat;	// next ping, see ts_mux_t 'heartbeat'
+	uint32_t backoff;	// ms, last reconnection delay, zero once connected
+	uint64_t heard;		// ms, when we last read anything from the peer
+	/*
+	 * Session token; the server picks one per connection, and the client
+	 * sends the last one it got back when it reconnects
+	 */
+	uint32_t session;
+	ts_mux_pressed_t pressed;
+	/*
+	 * Round trip time measured with the pings, in us; 'srtt' and 'var'
+	 * are smoothed as TCP does (RFC 6298)
+	 */
+	struct {
+		uint32_t count;		// samples, zero if there aren't any yet
+		uint32_t min, srtt, var;
+	} rtt;
 
 	struct ts_display_proxy_driver_t * proxy;
 
+	/*
+	 * Input buffer; 'in_start' is where the packet being received
+	 * starts, 'in_scan' how far we already looked for it's end
+	 */
 	int		in_len;
 	int		in_size;
+	int		in_start, in_scan;
 	uint8_t * in;
 
+	// output queue, and the number of bytes waiting in it, and in 'bulk'
+	ts_mux_seg_p out, out_tail;
 	int 	out_len;
-	int 	out_size;
-	uint8_t * out;
+	/*
+	 * Bulk output, clipboards; it is moved to 'out' one chunk at a time,
+	 * only when 'out' is empty, so input events don't wait behind it
+	 */
+	struct {
+		ts_mux_seg_p head, tail;
+	} bulk;
+	// clipboard being streamed, it's kept across reconnections
+	ts_mux_xfer_p xfer;
+	ts_mux_udp_t udp;
+	/*
+	 * Shared memory rings, with a peer on the same host, see ts_ring.h;
+	 * once they are 'up', they carry the frames instead of the socket
+	 */
+	struct {
+		uint8_t up, full, failed;	// 'full': wait for the bell to write
+		struct ts_ring_t * out, * in;	// ours, and the peer's
+		uint32_t outSize, inSize;
+		int fd;				// memfd of 'out', until it's sent
+		int bell;			// ours, the peer rings it
+		int peer;			// the peer's
+		int recv[2];		// memfd and bell the peer sent us, if any
+		struct ts_remote_t * remote;	// reading 'bell'
+	} ring;
+	/*
+	 * Relays, see ts_mux.c; the downstream clients tunneled over this
+	 * link, and on the server, the link a relayed client came through,
+	 * and it's tunnel
+	 */
+	struct {
+		struct ts_remote_t * tunnel;
+		uint32_t next;		// id of the next tunnel we open
+		uint8_t blocked;	// a tunnel waits for 'out' to drain
+		ts_remote_handle_t via;
+		uint32_t id;
+		/*
+		 * Server, a group's frames for some of the tunnels, and how
+		 * many of them each got, that go in 'F' frames before anything
+		 * else for them, see data_relay_fanout()
+		 */
+		struct {
+			uint32_t count, frames;
+			uint32_t id[TS_MUX_FANOUT_MAX];
+			uint8_t got[TS_MUX_FANOUT_MAX];
+			struct ts_mux_frame_t * frame[TS_MUX_FANOUT_MAX];
+		} fanout;
+	} relay;
+	// motion summed while 'out' was waiting for the socket
+	struct {
+		int x, y;
+	} motion;
+	/*
+	 * Segments sent with MSG_ZEROCOPY, that the kernel isn't done with
+	 */
+	struct {
+		int enabled;
+		uint32_t next;		// id of the next MSG_ZEROCOPY send
+		ts_mux_seg_p pending, tail;
+	} zerocopy;
 
 	int (*start)(struct ts_remote_t * remote);
 	int (*restart)(struct ts_remote_t * remote);
@@ -94,37 +381,254 @@ typedef struct ts_remote_t {
 } ts_remote_t, *ts_remote_p;
 
 /*
- * A mux handles up to 32 remote
+ * Policies to spread new remotes amongst the mux shards
+ */
+enum {
+	ts_mux_policy_leastloaded = 0,
+	ts_mux_policy_roundrobin,
+};
+
+#define TS_MUX_SHARDS_MAX	16
+
+/*
+ * A slot of the remote slab; when used, 'index' is the position of the
+ * remote in the dense 'live' array, otherwise it links the free list.
+ */
+typedef struct ts_mux_slot_t {
+	ts_remote_p remote;
+	uint32_t generation;
+	uint32_t index;
+} ts_mux_slot_t, *ts_mux_slot_p;
+
+/*
+ * A mux handles any number of remotes. They are kept in a growable slab
+ * with a free list, so registering and unregistering are O(1), and the
+ * live ones are also kept packed in an array, so iterating on them
+ * doesn't have to skip holes.
  */
 typedef struct ts_mux_t {
 	ts_master_p master;
 	pthread_t	thread;
 
+	/*
+	 * Shards are sibling muxes, each with it's own thread and it's own
+	 * remotes. The first one is the 'main' one, it is the one that
+	 * touches the master, the others hand it work with ts_mux_call()
+	 */
+	struct ts_mux_t * shards;
+	uint8_t shardCount, index, policy;
+	uint32_t next;				// round robin cursor
+	volatile uint32_t load;		// remotes registered, or about to be
+
+	// real time settings, shared by all the shards, NULL if not enabled
+	ts_rt_p rt;
+
 	ts_signal_t signal;
-	uint32_t dp_usage;
-	ts_remote_p dp[32];
+	int poll_fd;		// epoll descriptor, if supported
+
+	struct {
+		uint8_t mode;		// ts_mux_spin_*
+		uint32_t idle;		// us without event before hybrid blocks again
+		uint32_t busy;		// SO_BUSY_POLL us for data sockets, zero for none
+		uint64_t until;		// us, when hybrid stops spinning
+	} spin;
+	/*
+	 * Up to how many ms outgoing events can wait to be sent together,
+	 * zero to send them as they come
+	 */
+	uint32_t batch;
+	// offer, or accept, to send pointer motion over UDP
+	uint8_t udp;
+	/*
+	 * ms without hearing from a peer before it is considered dead, zero
+	 * for no heartbeat; it is pinged every third of that
+	 */
+	uint32_t heartbeat;
+	// size of the shared memory rings to offer unix socket peers, zero for none
+	uint32_t ring;
+	/*
+	 * Outgoing connection of a client; if it listens too, it's a relay,
+	 * and the clients it accepts are tunneled there
+	 */
+	struct ts_remote_t * upstream;
+
+	struct {
+		uint32_t count, size;
+		ts_mux_timer_p * heap;
+	} timers;
+
+	struct {
+		uint32_t size;		// slots allocated
+		uint32_t free;		// head of the free list, + 1
+		ts_mux_slot_p slot;
+		uint32_t count;		// remotes in 'live'
+		ts_remote_p * live;
+	} remotes;
+	// remotes registered from another thread, waiting to be added
+	ts_remote_p pending;
+	// kicks waiting to be serviced
+	ts_mux_kick_p kick;
+	// clipboards being received, on the main mux only
+	ts_mux_xfer_p xfer;
+	// client displays waiting for their client to come back, main mux only
+	ts_mux_session_p session;
+	// spare output segments, TS_MUX_SEG_SIZE ones only
+	ts_mux_seg_p seg;
+	uint32_t segCount;
+
+	struct {
+		uint32_t period;	// ms between reports, zero for none
+		uint64_t start;		// start of the current period
+		uint32_t wakeups;
+		uint32_t cause[ts_mux_wake_count];
+		uint32_t spins;		// polls that found nothing to do
+		/*
+		 * Signal to dispatch latency, in us; 'signaled' is set by the
+		 * first thread to signal us, and cleared when we service it
+		 */
+		volatile uint64_t signaled;
+		struct {
+			uint32_t count, min, max;
+			uint64_t sum;
+		} latency;
+		struct {
+			uint32_t events;	// packetized
+			uint32_t writes;	// sendmsg() calls
+			uint32_t held;		// times the output waited for more
+		} batch;
+	} stats;
 } ts_mux_t, *ts_mux_p;
 
 /*
- * This is called by ts_mux_port_new()
+ * Make 'mux' an array of 'count' shards, using 'policy' to assign new
+ * remotes to them. Needs to be called before the mux is started.
+ */
+void
+ts_mux_shards_init(
+		ts_mux_p mux,
+		int count,
+		int policy );
+
+/*
+ * Return the shard a new remote should be registered with; for a
+ * mux that isn't sharded, that's 'mux' itself
+ */
+ts_mux_p
+ts_mux_pick(
+		ts_mux_p mux );
+
+/*
+ * Returns the main mux, the one that owns the master
+ */
+static inline struct ts_mux_t *
+ts_mux_main(
+		ts_mux_p mux )
+{
+	return mux->shards ? mux->shards : mux;
+}
+
+/*
+ * An input event, encoded once as an 'E' frame, for all the members of
+ * a group (see ts_display_group.h); each remote it goes to copies it in
+ * it's output, or queues it by reference if it's big, and drops it's
+ * reference once it's done with it.
+ */
+typedef struct ts_mux_frame_t {
+	volatile uint32_t ref;
+	uint32_t len;
+	uint8_t data[0];
+} ts_mux_frame_t, *ts_mux_frame_p;
+
+struct ts_display_proxy_event_t;
+/*
+ * Encode 'e', a motion, button, key or wheel event; the frame has one
+ * reference, NULL for any other event
+ */
+ts_mux_frame_p
+ts_mux_frame_new(
+		const struct ts_display_proxy_event_t * e );
+
+static inline ts_mux_frame_p
+ts_mux_frame_ref(
+		ts_mux_frame_p f )
+{
+	if (f)
+		__sync_fetch_and_add(&f->ref, 1);
+	return f;
+}
+
+void
+ts_mux_frame_unref(
+		ts_mux_frame_p f );
+
+/*
+ * Call fn(mux, a, b) in the thread of 'mux'. If we are already in it,
+ * (or it isn't started yet) the call is made synchronously, otherwise
+ * it is queued, calls to the same mux are made in order.
+ */
+typedef void (*ts_mux_call_p)(
+		struct ts_mux_t * mux,
+		void * a,
+		void * b );
+int
+ts_mux_call(
+		ts_mux_p mux,
+		ts_mux_call_p fn,
+		void * a,
+		void * b );
+
+/*
+ * This is called by ts_mux_port_new(); starting the main mux
+ * also starts it's shards
  */
 int
 ts_mux_start(
 		ts_mux_p mux,
 		ts_master_p master );
 
+/*
+ * Connect to 'address', 'host[:port]' or 'unix:/path', or listen on the
+ * default TCP port if it's NULL
+ */
 int
 ts_mux_port_new(
 		ts_mux_p mux,
 		ts_master_p master,
 		char * address,
 		ts_display_p display);
+/*
+ * Listen on 'address' too, 'unix:/path' or ':port'. On a client, that
+ * makes it a relay for the clients connecting there
+ */
+int
+ts_mux_port_listen(
+		ts_mux_p mux,
+		ts_master_p master,
+		char * address,
+		ts_display_p display);
 
+/*
+ * Wake up the mux thread, 'what' is one of ts_mux_signal_*
+ */
 void
 ts_mux_signal(
 		ts_mux_p mux,
 		uint8_t what );
 
+/*
+ * Queue 'kick' for the mux thread; can be called from any thread
+ */
+void
+ts_mux_kick(
+		ts_mux_p mux,
+		ts_mux_kick_p kick );
+
+/*
+ * Add/remove remote 'r' to it's mux. Registering can be done from any
+ * thread, but unless it's done before the mux is started or from the
+ * mux's thread, the remote is only really added once the mux thread
+ * picks it up. Unregistering is for the mux thread only.
+ */
 int
 ts_mux_register(
 		ts_remote_p r );
@@ -132,4 +636,60 @@ int
 ts_mux_unregister(
 		ts_remote_p r);
 
+/*
+ * Returns the remote for 'handle', or NULL if that remote is
+ * not registered anymore
+ */
+ts_remote_p
+ts_mux_get_remote(
+		ts_mux_p mux,
+		ts_remote_handle_t handle );
+
+/*
+ * Returns the mux clock, monotonic, in milliseconds
+ */
+uint64_t
+ts_mux_now(void);
+
+/*
+ * Arm 'timer' to fire at 'when' (see ts_mux_now()), if it was already
+ * armed, it is just moved. Cancelling a timer that isn't armed is harmless
+ */
+void
+ts_mux_timer_arm(
+		ts_mux_p mux,
+		ts_mux_timer_p timer,
+		uint64_t when );
+void
+ts_mux_timer_cancel(
+		ts_mux_p mux,
+		ts_mux_timer_p timer );
+
+static inline int
+ts_mux_timer_armed(
+		ts_mux_timer_p timer )
+{
+	return timer->index != 0;
+}
+
+/*
+ * Re-evaluate the read/write interest of remote 'r' using it's can_read
+ * and can_write callbacks, and tell the poll backend only if it changed.
+ * This is called by the mux after each callback, but any code that changes
+ * the state of a remote outside of these should call it too.
+ * Mux thread only.
+ */
+void
+ts_mux_remote_update(
+		ts_remote_p r );
+
+/*
+ * Remove the remote's socket from the poll backend, and close it. This
+ * needs to be done in that order, otherwise the file descriptor could be
+ * reused by another remote before we get to remove it.
+ */
+void
+ts_mux_remote_close(
+		ts_remote_p r );
+
 #endif /* __TS_MUX_H___ */
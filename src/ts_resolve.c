@@ -0,0 +1,189 @@
+/*
+	ts_resolve.c
+
+	Copyright 2011 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of touchstream.
+
+	touchstream is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	touchstream is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with touchstream.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "ts_resolve.h"
+#include "ts_verbose.h"
+
+/*
+ * The cache is shared by the helper threads, and the muxes, it's small
+ * and seldom used, so a list and a mutex are plenty.
+ */
+typedef struct ts_resolve_cache_t {
+	struct ts_resolve_cache_t * next;
+	char * name;
+	uint64_t expires;
+	struct in_addr addr;
+} ts_resolve_cache_t, *ts_resolve_cache_p;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static ts_resolve_cache_p cache = NULL;
+
+// call with the lock held
+static ts_resolve_cache_p
+_ts_resolve_cache_get(
+		const char * name )
+{
+	for (ts_resolve_cache_p c = cache; c; c = c->next)
+		if (!strcmp(c->name, name))
+			return c;
+	return NULL;
+}
+
+static void
+_ts_resolve_cache_set(
+		const char * name,
+		struct in_addr addr,
+		uint64_t expires )
+{
+	pthread_mutex_lock(&cache_lock);
+	ts_resolve_cache_p c = _ts_resolve_cache_get(name);
+	if (!c && (c = malloc(sizeof(*c)))) {
+		memset(c, 0, sizeof(*c));
+		c->name = strdup(name);
+		c->next = cache;
+		cache = c;
+	}
+	if (c) {
+		c->addr = addr;
+		c->expires = expires;
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Called in the mux thread when the helper thread is done
+ */
+static void
+_ts_resolve_done(
+		ts_mux_p mux,
+		ts_mux_kick_p kick )
+{
+	ts_resolve_p res = kick->refCon;
+
+	res->busy = 0;
+	if (res->error) {
+		fprintf(stderr, "%s can't resolve '%s': %s\n", __func__,
+				res->name, gai_strerror(res->error));
+		// keep using the previous address, if we had one, for a while
+		if (res->valid)
+			res->expires = ts_mux_now() + 5000;
+	} else {
+		res->valid = 1;
+		res->expires = ts_mux_now() + TS_RESOLVE_TTL;
+		V2("%s '%s' is %s\n", __func__, res->name, inet_ntoa(res->addr));
+	}
+	if (res->callback)
+		res->callback(mux, res);
+}
+
+static void *
+_ts_resolve_thread(
+		void * param )
+{
+	ts_resolve_p res = param;
+	struct addrinfo hints = {
+			.ai_family = AF_INET,
+			.ai_socktype = SOCK_STREAM,
+	};
+	struct addrinfo * ai = NULL;
+
+	res->error = getaddrinfo(res->name, NULL, &hints, &ai);
+	if (!res->error) {
+		res->addr = ((struct sockaddr_in *)ai->ai_addr)->sin_addr;
+		freeaddrinfo(ai);
+		_ts_resolve_cache_set(res->name, res->addr,
+				ts_mux_now() + TS_RESOLVE_TTL);
+	}
+	ts_mux_kick(res->mux, &res->kick);
+	return NULL;
+}
+
+void
+ts_resolve_init(
+		ts_resolve_p res,
+		ts_mux_p mux,
+		const char * name,
+		void (*callback)(struct ts_mux_t * mux, struct ts_resolve_t * res),
+		void * refCon )
+{
+	memset(res, 0, sizeof(*res));
+	res->mux = mux;
+	res->name = strdup(name);
+	res->callback = callback;
+	res->refCon = refCon;
+	res->kick.refCon = res;
+	res->kick.callback = _ts_resolve_done;
+}
+
+int
+ts_resolve_lookup(
+		ts_resolve_p res )
+{
+	if (res->busy)
+		return 0;
+	uint64_t now = ts_mux_now();
+	if (res->valid && now < res->expires)
+		return 1;
+
+	pthread_mutex_lock(&cache_lock);
+	ts_resolve_cache_p c = _ts_resolve_cache_get(res->name);
+	if (c && now < c->expires) {
+		res->addr = c->addr;
+		res->expires = c->expires;
+		res->valid = 1;
+	}
+	pthread_mutex_unlock(&cache_lock);
+	if (res->valid && now < res->expires)
+		return 1;
+
+	V1("Resolving '%s' (%s)\n", res->name, __func__);
+	pthread_t thread;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	res->busy = 1;
+	if (pthread_create(&thread, &attr, _ts_resolve_thread, res)) {
+		perror("ts_resolve_lookup pthread_create");
+		res->busy = 0;
+	}
+	pthread_attr_destroy(&attr);
+	return res->busy ? 0 : -1;
+}
+
+void
+ts_resolve_expire(
+		ts_resolve_p res )
+{
+	res->expires = 0;
+	pthread_mutex_lock(&cache_lock);
+	ts_resolve_cache_p c = _ts_resolve_cache_get(res->name);
+	if (c)
+		c->expires = 0;
+	pthread_mutex_unlock(&cache_lock);
+}
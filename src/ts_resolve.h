@@ -0,0 +1,82 @@
+/*
+	ts_resolve.h
+
+	Copyright 2011 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of touchstream.
+
+	touchstream is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	touchstream is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with touchstream.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Asynchronous host name resolution for the mux. The resolver can block
+ * for seconds, so each lookup runs getaddrinfo() on a short lived helper
+ * thread, and the result is handed back to the mux with a kick; the
+ * callback is called in the mux thread.
+ * Results are cached (for all the muxes) for TS_RESOLVE_TTL, as the
+ * resolver doesn't tell us the real TTL of the record.
+ */
+#ifndef __TS_RESOLVE_H___
+#define __TS_RESOLVE_H___
+
+#include <netinet/in.h>
+#include "ts_mux.h"
+
+#define TS_RESOLVE_TTL		(60 * 1000)
+
+/*
+ * A lookup "job". It needs to outlive any lookup it has started
+ */
+typedef struct ts_resolve_t {
+	ts_mux_kick_t kick;		// completion
+	ts_mux_p mux;
+	char * name;
+	volatile int busy;		// a lookup is in progress
+	int error;				// of the last lookup, 0 or EAI_*
+	int valid;				// 'addr' has been resolved, at some point
+	uint64_t expires;		// ts_mux_now() time 'addr' needs refreshing
+	struct in_addr addr;
+
+	void * refCon;			// reference constant, optional, used by callback
+	void (*callback)(struct ts_mux_t * mux, struct ts_resolve_t * res);
+} ts_resolve_t, *ts_resolve_p;
+
+void
+ts_resolve_init(
+		ts_resolve_p res,
+		ts_mux_p mux,
+		const char * name,
+		void (*callback)(struct ts_mux_t * mux, struct ts_resolve_t * res),
+		void * refCon );
+
+/*
+ * Returns 1 if 'addr' is fresh, and can be used right away. Otherwise
+ * starts a lookup if there isn't one already and returns 0; the callback
+ * will be called when it's done. Returns -1 if the lookup can't be started.
+ * Needs to be called from the mux thread.
+ */
+int
+ts_resolve_lookup(
+		ts_resolve_p res );
+
+/*
+ * Forget the current address, for 'res' and in the cache, so the next
+ * ts_resolve_lookup() asks the resolver again. Called when a connection
+ * fails, in case the host has moved.
+ */
+void
+ts_resolve_expire(
+		ts_resolve_p res );
+
+#endif /* __TS_RESOLVE_H___ */
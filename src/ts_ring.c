@@ -0,0 +1,142 @@
+/*
+	ts_ring.c
+
+	Copyright 2011 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of touchstream.
+
+	touchstream is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	touchstream is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with touchstream.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef CONFIG_LINUX
+#define _GNU_SOURCE		// for memfd_create
+#endif
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef CONFIG_LINUX
+#include <sys/eventfd.h>
+#endif
+
+#include "ts_ring.h"
+#include "ts_verbose.h"
+
+#if defined(CONFIG_LINUX) && defined(MFD_ALLOW_SEALING) && defined(F_SEAL_SHRINK)
+#define TS_RING_MEMFD 1
+#endif
+
+ts_ring_p
+ts_ring_create(
+		uint32_t size,
+		int * fd )
+{
+#ifdef TS_RING_MEMFD
+	size_t len = sizeof(ts_ring_t) + size;
+	int m = memfd_create("touchstream", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (m < 0) {
+		perror("ts_ring_create memfd_create");
+		return NULL;
+	}
+	if (ftruncate(m, len) ||
+			fcntl(m, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)) {
+		perror("ts_ring_create");
+		close(m);
+		return NULL;
+	}
+	ts_ring_p ring = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, m, 0);
+	if (ring == MAP_FAILED) {
+		perror("ts_ring_create mmap");
+		close(m);
+		return NULL;
+	}
+	// fresh from ftruncate(), it's all zeroes, the consumer isn't there yet
+	ring->reader = 1;
+	*fd = m;
+	return ring;
+#else
+	return NULL;
+#endif
+}
+
+ts_ring_p
+ts_ring_map(
+		int fd,
+		uint32_t * size )
+{
+#ifdef TS_RING_MEMFD
+	struct stat st;
+	int seals = fcntl(fd, F_GET_SEALS);
+	if (seals < 0 || !(seals & F_SEAL_SHRINK) || fstat(fd, &st)) {
+		V1("%s the ring isn't sealed\n", __func__);
+		return NULL;
+	}
+	if (st.st_size <= (off_t)sizeof(ts_ring_t) || st.st_size > (1 << 30)) {
+		V1("%s the ring is %d bytes\n", __func__, (int)st.st_size);
+		return NULL;
+	}
+	uint32_t s = st.st_size - sizeof(ts_ring_t);
+	if (s & (s - 1)) {
+		V1("%s the ring size %u isn't a power of two\n", __func__, s);
+		return NULL;
+	}
+	ts_ring_p ring = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED) {
+		perror("ts_ring_map mmap");
+		return NULL;
+	}
+	*size = s;
+	return ring;
+#else
+	return NULL;
+#endif
+}
+
+void
+ts_ring_unmap(
+		ts_ring_p ring,
+		uint32_t size )
+{
+	if (ring)
+		munmap(ring, sizeof(ts_ring_t) + size);
+}
+
+int
+ts_ring_bell_new(void)
+{
+#ifdef CONFIG_LINUX
+	return eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+	return -1;
+#endif
+}
+
+void
+ts_ring_bell(
+		int bell )
+{
+	uint64_t one = 1;
+	if (write(bell, &one, sizeof(one)))
+		;
+}
+
+void
+ts_ring_bell_clear(
+		int bell )
+{
+	uint64_t count;
+	if (read(bell, &count, sizeof(count)))
+		;
+}
@@ -0,0 +1,191 @@
+/*
+	ts_ring.h
+
+	Copyright 2011 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of touchstream.
+
+	touchstream is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	touchstream is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with touchstream.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A single producer, single consumer byte ring in shared memory, for two
+ * processes on the same host. It's the same idea as fifo_declare.h, with
+ * free running 'head' and 'tail' counters, but the two ends don't trust
+ * each other: the memory is a sealed memfd, so it can't shrink under the
+ * consumer, and the counters are checked before they are used.
+ *
+ * Each end also has a "doorbell", an eventfd the other end writes to. The
+ * consumer only wants to be rung when it has emptied the ring ('reader'),
+ * and the producer when it has filled it ('writer'); as long as both are
+ * busy, data goes through without a single system call.
+ */
+#ifndef __TS_RING_H___
+#define __TS_RING_H___
+
+#include <stdint.h>
+#include <string.h>
+
+typedef struct ts_ring_t {
+	volatile uint32_t head;		// producer, bytes written so far
+	uint8_t _pad0[60];
+	volatile uint32_t tail;		// consumer, bytes read so far
+	uint8_t _pad1[60];
+	volatile uint32_t reader;	// consumer waits for the bell
+	volatile uint32_t writer;	// producer waits for the bell
+	uint8_t _pad2[56];
+	uint8_t data[0];
+} ts_ring_t, *ts_ring_p;
+
+/*
+ * Create a ring with 'size' bytes of data, a power of two, and return it
+ * mapped, with the memfd in 'fd' to pass on to the consumer.
+ */
+ts_ring_p
+ts_ring_create(
+		uint32_t size,
+		int * fd );
+
+/*
+ * Map the ring the producer sent us, after checking it can be trusted
+ * that far; it's size is returned in 'size'
+ */
+ts_ring_p
+ts_ring_map(
+		int fd,
+		uint32_t * size );
+
+void
+ts_ring_unmap(
+		ts_ring_p ring,
+		uint32_t size );
+
+// A new doorbell, for the other end to ring, -1 if not supported
+int
+ts_ring_bell_new(void);
+
+void
+ts_ring_bell(
+		int bell );
+
+// Clear our doorbell after it rang
+void
+ts_ring_bell_clear(
+		int bell );
+
+/*
+ * Producer, copy as much of 'data' as fits, returns how many bytes
+ * that was, or -1 if the consumer broke the ring
+ */
+static inline int
+ts_ring_write(
+		ts_ring_p ring,
+		uint32_t size,
+		const uint8_t * data,
+		uint32_t len )
+{
+	uint32_t head = ring->head, used = head - ring->tail;
+	if (used > size)
+		return -1;
+	if (len > size - used)
+		len = size - used;
+	uint32_t at = head & (size - 1), first = size - at;
+	if (first > len)
+		first = len;
+	memcpy(ring->data + at, data, first);
+	memcpy(ring->data, data + first, len - first);
+	__sync_synchronize();	// the data is there before the head moves
+	ring->head = head + len;
+	return len;
+}
+
+/*
+ * Consumer, the same the other way around
+ */
+static inline int
+ts_ring_read(
+		ts_ring_p ring,
+		uint32_t size,
+		uint8_t * data,
+		uint32_t len )
+{
+	uint32_t tail = ring->tail, avail = ring->head - tail;
+	if (avail > size)
+		return -1;
+	__sync_synchronize();	// see the data the new head covers
+	if (len > avail)
+		len = avail;
+	uint32_t at = tail & (size - 1), first = size - at;
+	if (first > len)
+		first = len;
+	memcpy(data, ring->data + at, first);
+	memcpy(data + first, ring->data, len - first);
+	__sync_synchronize();	// done with it before the producer reuses it
+	ring->tail = tail + len;
+	return len;
+}
+
+/*
+ * Consumer, found the ring empty; ask for the bell, unless data came in
+ * meanwhile. Returns nonzero if it's really empty, and we can sleep.
+ */
+static inline int
+ts_ring_sleep(
+		ts_ring_p ring )
+{
+	ring->reader = 1;
+	__sync_synchronize();
+	if (ring->head == ring->tail)
+		return 1;
+	ring->reader = 0;
+	return 0;
+}
+
+/*
+ * Producer, found the ring full; same as ts_ring_sleep()
+ */
+static inline int
+ts_ring_full(
+		ts_ring_p ring,
+		uint32_t size )
+{
+	ring->writer = 1;
+	__sync_synchronize();
+	if (ring->head - ring->tail >= size)
+		return 1;
+	ring->writer = 0;
+	return 0;
+}
+
+/*
+ * After writing, or reading; returns nonzero if the other end is waiting
+ * for the bell, and clears that, so it's only rung once
+ */
+static inline int
+ts_ring_wake_reader(
+		ts_ring_p ring )
+{
+	__sync_synchronize();
+	return ring->reader && __sync_fetch_and_and(&ring->reader, 0);
+}
+
+static inline int
+ts_ring_wake_writer(
+		ts_ring_p ring )
+{
+	__sync_synchronize();
+	return ring->writer && __sync_fetch_and_and(&ring->writer, 0);
+}
+
+#endif /* __TS_RING_H___ */
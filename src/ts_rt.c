@@ -0,0 +1,129 @@
+/*
+	ts_rt.c
+
+	Copyright 2011 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of touchstream.
+
+	touchstream is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	touchstream is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with touchstream.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef CONFIG_LINUX
+#define _GNU_SOURCE		// for pthread_setaffinity_np
+#include <sched.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "ts_rt.h"
+#include "ts_verbose.h"
+
+int
+ts_rt_parse(
+		ts_rt_p rt,
+		const char * arg )
+{
+	memset(rt, 0, sizeof(*rt));
+	rt->priority = TS_RT_PRIORITY;
+	rt->prealloc = TS_RT_PREALLOC;
+	if (!arg)
+		return 0;
+	if (isdigit(*arg))
+		rt->priority = strtol(arg, (char**)&arg, 10);
+	if (*arg == ':') do {
+		arg++;
+		if (!isdigit(*arg))
+			return -1;
+		if (rt->cpuCount < TS_RT_CPU_MAX)
+			rt->cpu[rt->cpuCount++] = strtol(arg, (char**)&arg, 10);
+	} while (*arg == ',');
+	if (*arg || rt->priority < 1 || rt->priority > 99)
+		return -1;
+	return 0;
+}
+
+int
+ts_rt_lock(
+		ts_rt_p rt )
+{
+	if (!rt || !rt->priority)
+		return 0;
+	if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+		perror("ts_rt_lock mlockall");
+		return -1;
+	}
+	/*
+	 * Make sure the stack we are going to use is there already
+	 */
+	volatile uint8_t stack[32 * 1024];
+	memset((uint8_t*)stack, 0, sizeof(stack));
+	return 0;
+}
+
+int
+ts_rt_thread(
+		ts_rt_p rt,
+		int which )
+{
+	if (!rt || !rt->priority)
+		return 0;
+	int res = 0;
+	struct sched_param param = { .sched_priority = rt->priority };
+	int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	if (err) {
+		fprintf(stderr, "ts_rt_thread SCHED_FIFO %d: %s\n",
+				rt->priority, strerror(err));
+		res = -1;
+	}
+	if (!rt->cpuCount)
+		return res;
+	int cpu = rt->cpu[which % rt->cpuCount];
+#ifdef CONFIG_LINUX
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (err) {
+		fprintf(stderr, "ts_rt_thread pinning to CPU %d: %s\n",
+				cpu, strerror(err));
+		res = -1;
+	}
+#else
+	V1("%s CPU pinning not supported on this platform, ignoring CPU %d\n",
+			__func__, cpu);
+#endif
+	V2("%s thread %d priority %d CPU %d\n", __func__, which, rt->priority, cpu);
+	return res;
+}
+
+void *
+ts_rt_prefault(
+		void * buffer,
+		size_t size )
+{
+	uint8_t * res = realloc(buffer, size);
+	if (!res)
+		return NULL;
+	/*
+	 * Write to every page, without touching what's there already
+	 */
+	for (size_t i = 0; i < size; i += 4096)
+		((volatile uint8_t*)res)[i] = res[i];
+	return res;
+}
@@ -0,0 +1,83 @@
+/*
+	ts_rt.h
+
+	Copyright 2011 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of touchstream.
+
+	touchstream is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	touchstream is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with touchstream.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * "Real time" mode for the input path. The capture thread and the mux
+ * threads are made SCHED_FIFO, optionally pinned to a CPU each, the
+ * process memory is locked, and the buffers the events go through are
+ * allocated and touched up front, so that moving the mouse never has to
+ * wait for a page fault or a realloc() on a loaded machine.
+ */
+#ifndef __TS_RT_H___
+#define __TS_RT_H___
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define TS_RT_CPU_MAX		16
+#define TS_RT_PRIORITY		50
+// bytes of in/out buffers, and clipboard, allocated for each connection
+#define TS_RT_PREALLOC		(64 * 1024)
+
+typedef struct ts_rt_t {
+	int priority;		// SCHED_FIFO priority, zero when not enabled
+	int cpuCount;		// zero for no pinning
+	int cpu[TS_RT_CPU_MAX];
+	uint32_t prealloc;
+} ts_rt_t, *ts_rt_p;
+
+/*
+ * Parse the "[priority][:cpu,cpu...]" argument of -R; it's valid for
+ * it to be empty, defaults are used.
+ */
+int
+ts_rt_parse(
+		ts_rt_p rt,
+		const char * arg );
+
+/*
+ * Lock all the process memory, current and future, and touch some of
+ * the stack of the calling thread
+ */
+int
+ts_rt_lock(
+		ts_rt_p rt );
+
+/*
+ * Make the calling thread SCHED_FIFO, and pin it to the CPU 'which'
+ * in the list (modulo the number of CPUs given).
+ * 0 is the capture thread, the mux threads are 1 + their shard index.
+ */
+int
+ts_rt_thread(
+		ts_rt_p rt,
+		int which );
+
+/*
+ * (re)allocate 'buffer' to be at least 'size' bytes, and touch every
+ * page of it so it's mapped. Returns the new buffer, or NULL.
+ */
+void *
+ts_rt_prefault(
+		void * buffer,
+		size_t size );
+
+#endif /* __TS_RT_H___ */
@@ -73,14 +73,18 @@ ts_signal(
 		;
 }
 
-void
+uint32_t
 ts_signal_flush(
 		ts_signal_p s,
 		int end )
 {
+	uint32_t res = 0;
 	uint8_t buf[32];
-	while (read(s->fd[end], buf, sizeof(buf)) == sizeof(buf))
-		;
+	ssize_t ss;
+	/* it's a datagram socket, each read() returns one signal */
+	while ((ss = read(s->fd[end], buf, sizeof(buf))) > 0)
+		res |= 1 << (buf[0] & 31);
+	return res;
 }
 
 //! Signal wait
@@ -52,7 +52,11 @@ ts_signal(
 		int end,
 		uint8_t what );
 
-void
+/*
+ * Read all the pending signals, return a bitfield of
+ * (1 << what) of the ones that were received
+ */
+uint32_t
 ts_signal_flush(
 		ts_signal_p s,
 		int end );
@@ -0,0 +1,169 @@
+/*
+	ts_wire.h
+
+	Copyright 2011 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of touchstream.
+
+	touchstream is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	touchstream is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with touchstream.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Encoding primitives for the v2 link protocol, see ts_mux.c.
+ * Integers are LEB128 varints, 7 bits per byte, low bits first, with the
+ * top bit set on all but the last byte. Signed ones are "zigzag" encoded
+ * first, so small negative numbers are small too. Strings are a varint
+ * length followed by the bytes, without terminating zero.
+ * The getters never read past 'end', and return NULL if they would have;
+ * they also return NULL when passed NULL, so they can be chained.
+ */
+#ifndef __TS_WIRE_H___
+#define __TS_WIRE_H___
+
+#include <stdint.h>
+#include <string.h>
+
+#define TS_WIRE_VARINT_MAX	5	// bytes for a 32 bits varint
+
+static inline int
+ts_wire_size_u(
+		uint32_t v )
+{
+	int res = 1;
+	while (v >= 0x80) {
+		v >>= 7;
+		res++;
+	}
+	return res;
+}
+
+static inline uint8_t *
+ts_wire_put_u(
+		uint8_t * p,
+		uint32_t v )
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+/*
+ * Always use 'size' bytes, padding with empty continuation bytes; so a
+ * length can be reserved before it is known
+ */
+static inline uint8_t *
+ts_wire_put_un(
+		uint8_t * p,
+		uint32_t v,
+		int size )
+{
+	while (--size) {
+		*p++ = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static inline uint32_t
+ts_wire_zigzag(
+		int32_t v )
+{
+	return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static inline int32_t
+ts_wire_unzigzag(
+		uint32_t v )
+{
+	return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+static inline uint8_t *
+ts_wire_put_s(
+		uint8_t * p,
+		int32_t v )
+{
+	return ts_wire_put_u(p, ts_wire_zigzag(v));
+}
+
+static inline uint8_t *
+ts_wire_put_str(
+		uint8_t * p,
+		const char * s )
+{
+	uint32_t l = s ? strlen(s) : 0;
+	p = ts_wire_put_u(p, l);
+	if (l)
+		memcpy(p, s, l);
+	return p + l;
+}
+
+static inline const uint8_t *
+ts_wire_get_u(
+		const uint8_t * p,
+		const uint8_t * end,
+		uint32_t * v )
+{
+	uint32_t res = 0;
+	if (!p)
+		return NULL;
+	for (int shift = 0; shift < 7 * TS_WIRE_VARINT_MAX; shift += 7) {
+		if (p >= end)
+			return NULL;
+		uint8_t b = *p++;
+		res |= (uint32_t)(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			*v = res;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+static inline const uint8_t *
+ts_wire_get_s(
+		const uint8_t * p,
+		const uint8_t * end,
+		int32_t * v )
+{
+	uint32_t u = 0;
+	p = ts_wire_get_u(p, end, &u);
+	*v = ts_wire_unzigzag(u);
+	return p;
+}
+
+/*
+ * Copy a string into 'out', zero terminated, and truncated to 'size'
+ */
+static inline const uint8_t *
+ts_wire_get_str(
+		const uint8_t * p,
+		const uint8_t * end,
+		char * out,
+		uint32_t size )
+{
+	uint32_t l = 0;
+	if (!(p = ts_wire_get_u(p, end, &l)) || l > (uint32_t)(end - p))
+		return NULL;
+	uint32_t c = l < size ? l : size - 1;
+	memcpy(out, p, c);
+	out[c] = 0;
+	return p + l;
+}
+
+#endif /* __TS_WIRE_H___ */
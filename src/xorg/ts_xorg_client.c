@@ -40,12 +40,25 @@
 #include "ts_mux.h"
 #include "ts_xorg.h"
 #include "ts_display_proxy.h"
+#include "ts_resolve.h"
 #include "ts_verbose.h"
 
+// ms before looking up, or opening, a remote display again, doubling
+#define TS_XORG_RETRY_MIN	250
+#define TS_XORG_RETRY_MAX	5000
+
 typedef struct ts_xorg_client_t {
 	ts_display_t display;
 	ts_mux_p mux;
 	char * displayname;
+	/*
+	 * For remote X servers, the host, and the display number that
+	 * goes with it once we know the address
+	 */
+	ts_resolve_t resolve;
+	ts_mux_timer_t retry;
+	uint32_t backoff;	// ms, the last retry delay
+	char * screen;
 	Display * dp;
 	Window	root;
 	Window window;
@@ -209,14 +222,19 @@ xorg_client_eventloop(
 	return 0;
 }
 
-static void
-ts_xorg_client_driver_init(
-		ts_display_p display)
+static int
+ts_xorg_client_open(
+		ts_xorg_client_p d)
 {
-	ts_xorg_client_p d = (ts_xorg_client_p)display;
+	ts_display_p display = &d->display;
 
 	XSetErrorHandler(x11_error_handler);
 	d->dp = XOpenDisplay(d->displayname);
+	if (!d->dp) {
+		fprintf(stderr, "%s can't open display '%s'\n", __func__, d->displayname);
+		return -1;
+	}
+	d->backoff = 0;
 
 	XA_CLIPBOARD = XInternAtom(d->dp, "CLIPBOARD", 0);
 
@@ -271,6 +289,7 @@ ts_xorg_client_driver_init(
 	d->remote.display = display;
 	d->remote.mux = d->mux;
 	d->remote.socket = ConnectionNumber(d->dp);
+	d->remote.wake = ts_mux_wake_xorg;
 	d->remote.data_read = xorg_client_eventloop;
 	ts_mux_register(&d->remote);
 
@@ -278,14 +297,104 @@ ts_xorg_client_driver_init(
 		ts_display_place(
 				ts_master_get_main(display->master),
 				display, display->param);
+	return 0;
 }
 
+/*
+ * A remote display couldn't be looked up, or opened; try again later,
+ * less and less often, like the outgoing connections do
+ */
+static void
+ts_xorg_client_retry(
+		ts_xorg_client_p d)
+{
+	uint32_t b = d->backoff * 2;
+	d->backoff = b < TS_XORG_RETRY_MIN ? TS_XORG_RETRY_MIN :
+			b > TS_XORG_RETRY_MAX ? TS_XORG_RETRY_MAX : b;
+	V1("%s '%s' retrying in %ums\n", __func__, d->resolve.name, d->backoff);
+	ts_mux_timer_arm(d->mux, &d->retry, ts_mux_now() + d->backoff);
+}
+
+/*
+ * The remote X server's host name has been looked up, we can connect
+ */
+static void
+ts_xorg_client_resolved(
+		ts_mux_p mux,
+		ts_resolve_p res)
+{
+	ts_xorg_client_p d = res->refCon;
+
+	if (!res->valid) {
+		fprintf(stderr, "%s host '%s' doesn't exists\n", __func__, res->name);
+		ts_xorg_client_retry(d);
+		return;
+	}
+	char displayname[128];
+	snprintf(displayname, sizeof(displayname), "%s:%s",
+			inet_ntoa(res->addr), d->screen);
+	free(d->displayname);
+	d->displayname = strdup(displayname);
+	if (ts_xorg_client_open(d)) {
+		// the host might have moved, look it up again when we retry
+		ts_resolve_expire(res);
+		ts_xorg_client_retry(d);
+	}
+}
+
+/*
+ * Look the remote display's host up, it's opened once that's done
+ */
+static void
+ts_xorg_client_lookup(
+		ts_xorg_client_p d)
+{
+	switch (ts_resolve_lookup(&d->resolve)) {
+		case 1:
+			ts_xorg_client_resolved(d->mux, &d->resolve);
+			break;
+		case -1:
+			fprintf(stderr, "%s can't look up '%s'\n", __func__, d->resolve.name);
+			ts_xorg_client_retry(d);
+			break;
+	}
+}
+
+static void
+ts_xorg_client_retry_timer(
+		ts_mux_p mux,
+		ts_mux_timer_p timer)
+{
+	ts_xorg_client_lookup(timer->refCon);
+}
+
+/*
+ * This is called in the mux thread; local displays are opened right
+ * away, remote ones once we know where they are
+ */
+static void
+ts_xorg_client_driver_init(
+		ts_display_p display)
+{
+	ts_xorg_client_p d = (ts_xorg_client_p)display;
+
+	if (!d->resolve.name) {
+		ts_xorg_client_open(d);
+		return;
+	}
+	ts_xorg_client_lookup(d);
+}
+
+/*
+ * Everything happends in the mux thread, this one has nothing to do, and
+ * it should not wake up periodically to do it either
+ */
 static void
 ts_xorg_client_driver_run(
 		ts_display_p display)
 {
 	while(1)
-		sleep(1);
+		pause();
 }
 
 static void
@@ -536,6 +645,8 @@ ts_xorg_client_create(
 	ts_xorg_client_p res = malloc(sizeof(ts_xorg_client_t));
 	memset(res, 0, sizeof(ts_xorg_client_t));
 
+	// our proxy and X connection live on their own shard, if any
+	mux = ts_mux_pick(mux);
 	res->mux = mux;
 
 	char name[128];
@@ -548,22 +659,17 @@ ts_xorg_client_create(
 	char * col = strchr(name, ':');
 	if (col) *col = 0;
 
-	struct hostent *hp = gethostbyname(name);
-	if (!hp) {
-		fprintf(stderr, "%s host '%s' doesn't exists\n", __func__, name);
-		return NULL;
-	}
-	char displayname[128];
-	sprintf(displayname, "%s:%s",
-			inet_ntoa(*(struct in_addr *) (hp->h_addr_list[0])),
-			col ? col+1 : "0.0");
-	res->displayname = strdup(displayname);
+	// the display is opened in the mux thread, once 'name' is resolved
+	ts_resolve_init(&res->resolve, mux, name, ts_xorg_client_resolved, res);
+	res->retry.refCon = res;
+	res->retry.callback = ts_xorg_client_retry_timer;
+	res->screen = strdup(col ? col+1 : "0.0");
 
 	if (!isdigit(name[0])) {
 		col = strchr(name, '.');
 		if (col) * col = 0;
 	}
-	V2("%s name '%s' param '%s' display '%s'\n", __func__, name, param, displayname);
+	V2("%s name '%s' param '%s' screen '%s'\n", __func__, name, param, res->screen);
 
 	int doproxy = 1;
 	ts_display_driver_p driver = &ts_xorg_client_driver;